@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Block request activity of the HDD Saver drives
+ *
+ * Only requests on the devices in the devs map are reported, and at most
+ * one event per device every throttle_ns, so a busy drive does not flood
+ * the ring buffer and an idle one costs nothing.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+
+#include "activity.h"
+
+const volatile __u64 throttle_ns = 100000000;
+
+/* Kernel dev_t -> time of the last event */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, HDDSAVER_MAX_DEVS);
+	__type(key, __u32);
+	__type(value, __u64);
+} devs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 4096);
+} events SEC(".maps");
+
+static __always_inline int report(__u32 dev, __u8 type)
+{
+	struct hddsaver_activity *e;
+	__u64 now, *last;
+
+	last = bpf_map_lookup_elem(&devs, &dev);
+	if (!last)
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	if (now - *last < throttle_ns)
+		return 0;
+	*last = now;
+
+	e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+	if (!e)
+		return 0;
+	e->ts = now;
+	e->dev = dev;
+	e->type = type;
+	bpf_ringbuf_submit(e, 0);
+
+	return 0;
+}
+
+SEC("tracepoint/block/block_rq_issue")
+int rq_issue(struct trace_event_raw_block_rq *ctx)
+{
+	return report(ctx->dev, HDDSAVER_RQ_ISSUE);
+}
+
+SEC("tracepoint/block/block_rq_complete")
+int rq_complete(struct trace_event_raw_block_rq_completion *ctx)
+{
+	return report(ctx->dev, HDDSAVER_RQ_COMPLETE);
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Shared between activity.bpf.c and its loader
+ */
+#ifndef HDDSAVER_ACTIVITY_H
+#define HDDSAVER_ACTIVITY_H
+
+#define HDDSAVER_MAX_DEVS	32
+
+enum {
+	HDDSAVER_RQ_ISSUE,
+	HDDSAVER_RQ_COMPLETE,
+};
+
+struct hddsaver_activity {
+	__u64 ts;		/* CLOCK_MONOTONIC ns */
+	__u32 dev;		/* Kernel dev_t, major << 20 | minor */
+	__u8 type;
+};
+
+#endif
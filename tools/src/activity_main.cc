@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-activity - prints block requests of the given drives
+ *
+ * Checks the eBPF activity source without hddsaverd, e.g. against a loop
+ * or null_blk device:
+ *
+ *   modprobe null_blk; hddsaver-activity nullb0 &
+ *   dd if=/dev/nullb0 of=/dev/null bs=4k count=1 iflag=direct
+ */
+#include "bpf_activity.h"
+#include "event_loop.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace hddsaver;
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> disks(argv + 1, argv + argc);
+	static const char *const types[] = { "issue", "complete" };
+	event_loop loop;
+	bpf_activity activity;
+	int err;
+
+	if (disks.empty()) {
+		fprintf(stderr, "Usage: %s DISK...\n", argv[0]);
+		return 2;
+	}
+
+	/* Report every request */
+	err = activity.open(loop, 0, [](const std::string &disk, int type,
+					uint64_t ts) {
+		printf("%llu.%09llu %s %s\n",
+		       (unsigned long long)ts / 1000000000,
+		       (unsigned long long)ts % 1000000000, disk.c_str(),
+		       types[type & 1]);
+		fflush(stdout);
+	});
+	if (!err)
+		err = activity.watch(disks);
+	if (!err)
+		err = add_signals(loop, { SIGTERM, SIGINT },
+				  [&loop](int) { loop.stop(); });
+	if (err) {
+		fprintf(stderr, "%s\n", strerror(-err));
+		return 1;
+	}
+
+	return loop.run() ? 1 : 0;
+}
@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Automount of the file system on the HDD Saver drives
+ */
+#include "automount.h"
+#include "rail.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/auto_fs4.h>
+#include <mntent.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+static const struct {
+	const char *name;
+	unsigned long set;
+	unsigned long clear;
+} mount_flags[] = {
+	{ "ro", MS_RDONLY, 0 },
+	{ "rw", 0, MS_RDONLY },
+	{ "nosuid", MS_NOSUID, 0 },
+	{ "suid", 0, MS_NOSUID },
+	{ "nodev", MS_NODEV, 0 },
+	{ "dev", 0, MS_NODEV },
+	{ "noexec", MS_NOEXEC, 0 },
+	{ "exec", 0, MS_NOEXEC },
+	{ "sync", MS_SYNCHRONOUS, 0 },
+	{ "async", 0, MS_SYNCHRONOUS },
+	{ "dirsync", MS_DIRSYNC, 0 },
+	{ "noatime", MS_NOATIME, 0 },
+	{ "nodiratime", MS_NODIRATIME, 0 },
+	{ "relatime", MS_RELATIME, 0 },
+	{ "strictatime", MS_STRICTATIME, 0 },
+	{ "lazytime", MS_LAZYTIME, 0 },
+};
+
+/* Options for mount(8) and the other tools, not for the file system */
+static bool ignored_option(const std::string &o)
+{
+	static const char *const names[] = {
+		"defaults", "auto", "noauto", "nofail", "user", "users",
+		"nouser", "owner", "group", "_netdev",
+	};
+
+	for (const char *n : names)
+		if (o == n)
+			return true;
+
+	return !o.compare(0, 2, "x-") || !o.compare(0, 8, "comment=");
+}
+
+/* UUID= and friends as the udev links to the device */
+static std::string resolve_source(const std::string &spec)
+{
+	static const struct {
+		const char *tag;
+		const char *dir;
+	} tags[] = {
+		{ "UUID=", "/dev/disk/by-uuid/" },
+		{ "LABEL=", "/dev/disk/by-label/" },
+		{ "PARTUUID=", "/dev/disk/by-partuuid/" },
+		{ "PARTLABEL=", "/dev/disk/by-partlabel/" },
+	};
+
+	for (const auto &t : tags) {
+		size_t len = strlen(t.tag);
+
+		if (!spec.compare(0, len, t.tag))
+			return t.dir + spec.substr(len);
+	}
+
+	return spec;
+}
+
+/* Type of the file system on top at dir, empty if nothing is mounted */
+static std::string top_type(const std::string &dir)
+{
+	char line[8192], mnt[4096], type[64];
+	std::string top;
+	const char *sep;
+	FILE *f;
+
+	f = fopen("/proc/self/mountinfo", "re");
+	if (!f)
+		return top;
+	while (fgets(line, sizeof(line), f)) {
+		sep = strstr(line, " - ");
+		if (!sep || sscanf(line, "%*d %*d %*s %*s %4095s", mnt) != 1 ||
+		    sscanf(sep, " - %63s", type) != 1)
+			continue;
+		/* Later lines are mounted over the earlier ones */
+		if (mountinfo_unescape(mnt) == dir)
+			top = type;
+	}
+	fclose(f);
+
+	return top;
+}
+
+/* Leftovers of a daemon that did not exit cleanly are catatonic */
+static void detach_autofs(const std::string &dir)
+{
+	while (top_type(dir) == "autofs")
+		if (umount2(dir.c_str(), MNT_DETACH))
+			break;
+}
+
+automount::~automount()
+{
+	release(-ENOENT);
+	if (pipe_fd >= 0) {
+		loop->remove(pipe_fd);
+		close(pipe_fd);
+	}
+	if (ioctl_fd >= 0)
+		close(ioctl_fd);
+	/* The real file system keeps its mount, on top of a catatonic one */
+	if (armed && !is_mounted)
+		umount2(dir.c_str(), MNT_DETACH);
+}
+
+int automount::read_fstab()
+{
+	struct mntent *m;
+	std::string opts;
+	FILE *f;
+	int err = -ENOENT;
+
+	f = setmntent("/etc/fstab", "re");
+	if (!f)
+		return -errno;
+	while ((m = getmntent(f)) != nullptr) {
+		if (dir != m->mnt_dir)
+			continue;
+		source = resolve_source(m->mnt_fsname);
+		type = m->mnt_type;
+		opts = m->mnt_opts;
+		err = 0;
+	}
+	endmntent(f);
+	if (err)
+		return err;
+	if (type == "auto" || type == "swap" || type == "autofs")
+		return -EINVAL;
+
+	flags = 0;
+	data.clear();
+	for (size_t pos = 0; pos <= opts.size();) {
+		size_t end = opts.find(',', pos);
+		std::string o;
+		bool found = false;
+
+		if (end == std::string::npos)
+			end = opts.size();
+		o = opts.substr(pos, end - pos);
+		pos = end + 1;
+		if (o.empty() || ignored_option(o))
+			continue;
+
+		for (const auto &mf : mount_flags) {
+			if (o != mf.name)
+				continue;
+			flags = (flags & ~mf.clear) | mf.set;
+			found = true;
+		}
+		if (found)
+			continue;
+		if (!data.empty())
+			data += ',';
+		data += o;
+	}
+
+	return 0;
+}
+
+int automount::open(event_loop &l, const std::string &path,
+		    std::function<void()> on_missing)
+{
+	std::string top;
+	int err;
+
+	loop = &l;
+	dir = path;
+	missing = std::move(on_missing);
+
+	err = read_fstab();
+	if (err)
+		return err;
+
+	detach_autofs(dir);
+	top = top_type(dir);
+	if (!top.empty() && top != type)
+		return -EEXIST;
+	is_mounted = !top.empty();
+
+	/* Armed under the file system when it is unmounted first */
+	return is_mounted ? 0 : arm();
+}
+
+int automount::arm()
+{
+	unsigned long timeout = 0;
+	char opts[128];
+	int fds[2];
+
+	if (armed)
+		return 0;
+	if (pipe2(fds, O_CLOEXEC))
+		return -errno;
+
+	snprintf(opts, sizeof(opts),
+		 "fd=%d,pgrp=%d,minproto=5,maxproto=5,direct", fds[1],
+		 (int)getpgrp());
+	if (::mount("hddsaverd", dir.c_str(), "autofs", 0, opts)) {
+		int err = -errno;
+
+		close(fds[0]);
+		close(fds[1]);
+		return err;
+	}
+	/* The kernel holds its own reference */
+	close(fds[1]);
+
+	/* Our own process group does not trigger, this is the autofs root */
+	ioctl_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ioctl_fd < 0) {
+		int err = -errno;
+
+		close(fds[0]);
+		umount2(dir.c_str(), MNT_DETACH);
+		return err;
+	}
+	/* No expiry, unmounting is up to the owner */
+	ioctl(ioctl_fd, AUTOFS_IOC_SETTIMEOUT, &timeout);
+
+	pipe_fd = fds[0];
+	fcntl(pipe_fd, F_SETFL, fcntl(pipe_fd, F_GETFL) | O_NONBLOCK);
+	loop->add(pipe_fd, EPOLLIN, [this](uint32_t) { read_packets(); });
+	armed = true;
+
+	return 0;
+}
+
+void automount::read_packets()
+{
+	union autofs_v5_packet_union pkt;
+	bool added = false;
+	ssize_t n;
+
+	/* The pipe is in packet mode, a read returns one request */
+	while ((n = read(pipe_fd, &pkt, sizeof(pkt))) > 0) {
+		if ((size_t)n < sizeof(pkt.hdr))
+			continue;
+		if (pkt.hdr.type == autofs_ptype_missing_direct) {
+			tokens.push_back(pkt.v5_packet.wait_queue_token);
+			added = true;
+		} else if (pkt.hdr.type == autofs_ptype_expire_direct) {
+			/* Not asked for with no timeout, never expire */
+			ioctl(ioctl_fd, AUTOFS_IOC_FAIL,
+			      pkt.v5_packet.wait_queue_token);
+		}
+	}
+
+	if (added && missing)
+		missing();
+}
+
+int automount::mount()
+{
+	struct stat st;
+
+	if (is_mounted)
+		return 0;
+	/* Not a path for tmpfs and the like */
+	if (source[0] == '/' && stat(source.c_str(), &st))
+		return errno == ENOENT ? -EAGAIN : -errno;
+
+	if (::mount(source.c_str(), dir.c_str(), type.c_str(), flags,
+		    data.empty() ? nullptr : data.c_str())) {
+		/* Not readable yet, right after the device showed up */
+		if (errno == ENXIO || errno == ENOMEDIUM)
+			return -EAGAIN;
+		return -errno;
+	}
+	is_mounted = true;
+
+	return 0;
+}
+
+int automount::unmount()
+{
+	if (is_mounted) {
+		if (umount(dir.c_str()))
+			return -errno;
+		is_mounted = false;
+	}
+	if (!armed)
+		detach_autofs(dir);
+
+	return arm();
+}
+
+void automount::release(int err)
+{
+	for (unsigned int token : tokens)
+		ioctl(ioctl_fd, err ? AUTOFS_IOC_FAIL : AUTOFS_IOC_READY, token);
+	tokens.clear();
+}
+
+int scsi_rescan()
+{
+	static const char base[] = "/sys/class/scsi_host";
+	struct dirent *de;
+	int fd, n = 0;
+	DIR *d;
+
+	d = opendir(base);
+	if (!d)
+		return -errno;
+	while ((de = readdir(d)) != nullptr) {
+		if (de->d_name[0] == '.')
+			continue;
+		fd = ::open((std::string(base) + "/" + de->d_name + "/scan").c_str(),
+			    O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		/* Every channel, target and lun */
+		if (write(fd, "- - -", 5) == 5)
+			n++;
+		close(fd);
+	}
+	closedir(d);
+
+	return n;
+}
+
+} /* namespace hddsaver */
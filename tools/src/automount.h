@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Automount of the file system on the HDD Saver drives
+ */
+#ifndef HDDSAVER_AUTOMOUNT_H
+#define HDDSAVER_AUTOMOUNT_H
+
+#include "event_loop.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+/*
+ * Keeps a direct autofs mount under the mount point of a file system on
+ * the drives, set up from its /etc/fstab entry. The file system is
+ * unmounted before the power goes off. The first path lookup that
+ * reaches the mount point afterwards blocks in the kernel, and
+ * on_missing() is called. The owner powers the drives on, calls mount()
+ * until the device is back and then release(), which lets every process
+ * waiting on the mount point continue into the file system.
+ *
+ * The owner's process group does not trigger the mount, see autofs(5).
+ */
+class automount {
+public:
+	automount() = default;
+	~automount();
+	automount(const automount &) = delete;
+	automount &operator=(const automount &) = delete;
+
+	int open(event_loop &loop, const std::string &dir,
+		 std::function<void()> on_missing);
+	const std::string &path() const { return dir; }
+	bool mounted() const { return is_mounted; }
+	bool waiting() const { return !tokens.empty(); }
+
+	/* 0 if mounted, -EAGAIN while the device is missing */
+	int mount();
+
+	/* -EBUSY if in use, the trigger is armed again after */
+	int unmount();
+
+	/* Lets the waiting lookups go on, failed with err if not 0 */
+	void release(int err);
+
+private:
+	int read_fstab();
+	int arm();
+	void read_packets();
+
+	event_loop *loop = nullptr;
+	std::string dir;
+	std::string source;
+	std::string type;
+	unsigned long flags = 0;
+	std::string data;
+	std::function<void()> missing;
+
+	int pipe_fd = -1;
+	int ioctl_fd = -1;		/* On the autofs mount */
+	bool armed = false;
+	bool is_mounted = false;
+	std::vector<unsigned int> tokens;
+};
+
+/*
+ * Makes every SCSI host scan its ports, for drives not seen returning.
+ * Returns the number of hosts scanned.
+ */
+int scsi_rescan();
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Block request events of the watched drives from an eBPF program
+ */
+#include "bpf_activity.h"
+#include "rail.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HDDSAVER_BPF
+#include <bpf/libbpf.h>
+#include <linux/types.h>
+#include <sys/epoll.h>
+
+#include "activity.h"
+#include "activity.skel.h"
+#endif
+
+namespace hddsaver {
+
+int64_t block_dev(const std::string &name)
+{
+	std::string path = "/sys/class/block/" + name + "/dev";
+	unsigned int major, minor;
+	char buf[32];
+	int fd, len;
+
+	if (name.find('/') != std::string::npos)
+		return -EINVAL;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read_attr(fd, buf, sizeof(buf));
+	::close(fd);
+	if (len < 0)
+		return len;
+
+	if (sscanf(buf, "%u:%u", &major, &minor) != 2)
+		return -EINVAL;
+
+	/* MKDEV() of the kernel, not of glibc */
+	return (int64_t)major << 20 | minor;
+}
+
+bpf_activity::~bpf_activity()
+{
+	close();
+}
+
+#ifdef HDDSAVER_BPF
+
+int bpf_activity::open(event_loop &l, uint64_t throttle_ms, handler h)
+{
+	int err;
+
+	skel = activity_bpf__open();
+	if (!skel)
+		return -errno;
+	skel->rodata->throttle_ns = throttle_ms * 1000000;
+
+	err = activity_bpf__load(skel);
+	if (!err)
+		err = activity_bpf__attach(skel);
+	if (err)
+		goto fail;
+
+	rb = ring_buffer__new(bpf_map__fd(skel->maps.events), event, this,
+			      nullptr);
+	if (!rb) {
+		err = -errno;
+		goto fail;
+	}
+
+	loop = &l;
+	callback = std::move(h);
+	fd = ring_buffer__epoll_fd(rb);
+	err = loop->add(fd, EPOLLIN, [this](uint32_t) {
+		ring_buffer__consume(rb);
+	});
+	if (err)
+		goto fail;
+
+	return 0;
+
+fail:
+	close();
+	return err;
+}
+
+void bpf_activity::close()
+{
+	if (fd >= 0)
+		loop->remove(fd);
+	fd = -1;
+	ring_buffer__free(rb);
+	rb = nullptr;
+	activity_bpf__destroy(skel);
+	skel = nullptr;
+}
+
+int bpf_activity::watch(const std::vector<std::string> &names)
+{
+	struct bpf_map *map = skel->maps.devs;
+	uint64_t last = 0;
+	uint32_t key, next;
+
+	/* Deleting while iterating restarts from the first key */
+	while (!bpf_map__get_next_key(map, nullptr, &next, sizeof(next))) {
+		key = next;
+		bpf_map__delete_elem(map, &key, sizeof(key), 0);
+	}
+	disks.clear();
+
+	for (const auto &name : names) {
+		int64_t dev = block_dev(name);
+
+		if (dev < 0 || disks.size() == HDDSAVER_MAX_DEVS)
+			continue;
+		key = dev;
+		if (bpf_map__update_elem(map, &key, sizeof(key), &last,
+					 sizeof(last), BPF_ANY))
+			return -errno;
+		disks.push_back({ name, key });
+	}
+
+	return 0;
+}
+
+void bpf_activity::unthrottle()
+{
+	uint64_t last = 0;
+
+	for (const auto &d : disks)
+		bpf_map__update_elem(skel->maps.devs, &d.dev, sizeof(d.dev),
+				     &last, sizeof(last), BPF_EXIST);
+}
+
+int bpf_activity::event(void *ctx, void *data, size_t size)
+{
+	auto *self = static_cast<bpf_activity *>(ctx);
+	auto *e = static_cast<const struct hddsaver_activity *>(data);
+
+	if (size < sizeof(*e))
+		return 0;
+
+	for (const auto &d : self->disks) {
+		if (d.dev == e->dev) {
+			self->callback(d.name, e->type, e->ts);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+#else /* !HDDSAVER_BPF */
+
+int bpf_activity::open(event_loop &, uint64_t, handler)
+{
+	return -EOPNOTSUPP;
+}
+
+void bpf_activity::close()
+{
+}
+
+int bpf_activity::watch(const std::vector<std::string> &)
+{
+	return -EOPNOTSUPP;
+}
+
+void bpf_activity::unthrottle()
+{
+}
+
+int bpf_activity::event(void *, void *, size_t)
+{
+	return 0;
+}
+
+#endif
+
+} /* namespace hddsaver */
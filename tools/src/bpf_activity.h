@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Block request events of the watched drives from an eBPF program
+ */
+#ifndef HDDSAVER_BPF_ACTIVITY_H
+#define HDDSAVER_BPF_ACTIVITY_H
+
+#include "event_loop.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct activity_bpf;
+struct ring_buffer;
+
+namespace hddsaver {
+
+/*
+ * Attaches to the block_rq_issue and block_rq_complete tracepoints with
+ * the device numbers of the watched drives as an in-kernel filter. The
+ * callback runs from the event loop when a request was seen, at most
+ * once per drive and throttle interval. Without requests nothing wakes up.
+ *
+ * open() fails with -EOPNOTSUPP if the tools were built without libbpf.
+ */
+class bpf_activity {
+public:
+	/* Drive name, kind (HDDSAVER_RQ_*), CLOCK_MONOTONIC ns */
+	using handler = std::function<void(const std::string &disk, int type,
+					   uint64_t ts)>;
+
+	bpf_activity() = default;
+	~bpf_activity();
+	bpf_activity(const bpf_activity &) = delete;
+	bpf_activity &operator=(const bpf_activity &) = delete;
+
+	int open(event_loop &loop, uint64_t throttle_ms, handler h);
+	void close();
+
+	/* Replaces the filter, names the kernel does not know are skipped */
+	int watch(const std::vector<std::string> &disks);
+	size_t watching() const { return disks.size(); }
+
+	/* The next request of each drive is reported, throttled or not */
+	void unthrottle();
+
+private:
+	struct disk {
+		std::string name;
+		uint32_t dev;
+	};
+
+	static int event(void *ctx, void *data, size_t size);
+
+	event_loop *loop = nullptr;
+	struct activity_bpf *skel = nullptr;
+	struct ring_buffer *rb = nullptr;
+	int fd = -1;
+	std::vector<disk> disks;
+	handler callback;
+};
+
+/* Kernel dev_t of a block device from /sys/class/block, -errno if none */
+int64_t block_dev(const std::string &name);
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Read cache of the files on the HDD Saver drives
+ */
+#include "cache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+/* Copies are named by a 64 bit serial in hex */
+static bool is_copy_name(const char *name)
+{
+	if (!strcmp(name, ".fill"))
+		return true;
+	if (strlen(name) != 16)
+		return false;
+
+	return strspn(name, "0123456789abcdef") == 16;
+}
+
+static bool same_file(const struct stat &s, uint64_t size,
+		      const struct timespec &mtime)
+{
+	return (uint64_t)s.st_size == size &&
+	       s.st_mtim.tv_sec == mtime.tv_sec &&
+	       s.st_mtim.tv_nsec == mtime.tv_nsec;
+}
+
+int read_cache::open(const cache_options &o)
+{
+	struct dirent *de;
+	DIR *d;
+
+	if (::mkdir(o.dir.c_str(), 0700) && errno != EEXIST)
+		return -errno;
+	d = opendir(o.dir.c_str());
+	if (!d)
+		return -errno;
+
+	/* What the lower tree was like then is not known, start over */
+	while ((de = readdir(d)) != nullptr)
+		if (is_copy_name(de->d_name))
+			unlinkat(dirfd(d), de->d_name, 0);
+	closedir(d);
+
+	opt = o;
+	seen.clear();
+	queue.clear();
+	st = cache_stats();
+
+	return 0;
+}
+
+std::string read_cache::copy_path(uint64_t id) const
+{
+	char name[24];
+
+	snprintf(name, sizeof(name), "/%016llx", (unsigned long long)id);
+
+	return opt.dir + name;
+}
+
+std::string read_cache::fill_path() const
+{
+	return opt.dir + "/.fill";
+}
+
+void read_cache::power_changed(bool now_off)
+{
+	if (now_off == off)
+		return;
+
+	if (now_off) {
+		period_hits = 0;
+		woke = false;
+	} else {
+		if (period_hits && !woke)
+			st.avoided_wakes++;
+		period++;
+	}
+	off = now_off;
+}
+
+/* Entries without a copy are only hints, they go first */
+void read_cache::forget()
+{
+	for (auto it = seen.begin(); it != seen.end();) {
+		if (!it->second.id && !it->second.queued)
+			it = seen.erase(it);
+		else
+			++it;
+	}
+}
+
+read_cache::entry &read_cache::lookup(const std::string &path)
+{
+	if (seen.size() >= MAX_SEEN && !seen.count(path))
+		forget();
+
+	return seen[path];
+}
+
+void read_cache::admit(const std::string &path, entry &e)
+{
+	if (e.id || e.queued)
+		return;
+	e.queued = true;
+	queue.push_back(path);
+}
+
+void read_cache::note_open(const std::string &path, const struct stat &s)
+{
+	if (!is_open() || !S_ISREG(s.st_mode) ||
+	    (uint64_t)s.st_size > opt.max_file)
+		return;
+
+	entry &e = lookup(path);
+
+	e.used = ++serial;
+	if (e.id && !same_file(s, e.size, e.mtime))
+		drop(e);
+
+	/* Rereading in the same period is no reason to keep a copy */
+	if (e.opens && e.period == period)
+		return;
+	e.opens++;
+	e.period = period;
+	if (e.opens >= opt.admit)
+		admit(path, e);
+}
+
+void read_cache::note_miss(const std::string &path, bool wakes)
+{
+	if (!is_open())
+		return;
+
+	st.misses++;
+	if (!wakes)
+		return;
+	if (off)
+		woke = true;
+
+	entry &e = lookup(path);
+
+	e.used = ++serial;
+	admit(path, e);
+}
+
+void read_cache::note_hit(const std::string &path, uint64_t bytes)
+{
+	auto it = seen.find(path);
+
+	st.hits++;
+	st.hit_bytes += bytes;
+	if (off)
+		period_hits++;
+	if (it != seen.end()) {
+		it->second.used = ++serial;
+		it->second.avoided++;
+	}
+}
+
+void read_cache::drop(entry &e)
+{
+	if (!e.id)
+		return;
+
+	unlink(copy_path(e.id).c_str());
+	st.bytes -= e.size;
+	st.files--;
+	e.id = 0;
+}
+
+void read_cache::invalidate(const std::string &path, const struct stat *s)
+{
+	auto it = seen.find(path);
+
+	if (it == seen.end())
+		return;
+	if (s && (!it->second.id ||
+		  same_file(*s, it->second.size, it->second.mtime)))
+		return;
+
+	drop(it->second);
+	if (!s)
+		seen.erase(it);
+}
+
+int read_cache::open_copy(const std::string &path, const struct stat &s) const
+{
+	auto it = seen.find(path);
+
+	if (it == seen.end() || !it->second.id ||
+	    !same_file(s, it->second.size, it->second.mtime))
+		return -1;
+
+	return ::open(copy_path(it->second.id).c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+bool read_cache::next(std::string &path)
+{
+	while (!queue.empty()) {
+		std::string p = std::move(queue.front());
+		auto it = seen.find(p);
+
+		queue.pop_front();
+		if (it != seen.end() && it->second.queued) {
+			it->second.queued = false;
+			path = std::move(p);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int read_cache::copy(const std::string &lower, const std::string &path,
+		     struct stat &s) const
+{
+	std::string fill = fill_path();
+	struct stat after;
+	char buf[65536];
+	int in, out, err = 0;
+	ssize_t n;
+
+	in = ::open((lower + path).c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return -errno;
+	if (fstat(in, &s)) {
+		err = -errno;
+		::close(in);
+		return err;
+	}
+	if (!S_ISREG(s.st_mode) || (uint64_t)s.st_size > opt.max_file ||
+	    (uint64_t)s.st_size > opt.size) {
+		::close(in);
+		return -EFBIG;
+	}
+
+	out = ::open(fill.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		     0600);
+	if (out < 0) {
+		err = -errno;
+		::close(in);
+		return err;
+	}
+
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, n) != n) {
+			err = errno ? -errno : -ENOSPC;
+			break;
+		}
+	if (n < 0)
+		err = -errno;
+
+	/* Changed while being copied, a later open admits it again */
+	if (!err && (fstat(in, &after) ||
+		     !same_file(after, s.st_size, s.st_mtim)))
+		err = -EAGAIN;
+	::close(in);
+	::close(out);
+	if (err)
+		unlink(fill.c_str());
+
+	return err;
+}
+
+/* The least recently used of the copies that never avoided a wake */
+bool read_cache::evict(uint64_t need, const std::string &keep)
+{
+	while (st.bytes + need > opt.size) {
+		entry *victim = nullptr;
+
+		for (auto &it : seen) {
+			entry &e = it.second;
+
+			if (!e.id || it.first == keep)
+				continue;
+			if (!victim || (!e.avoided && victim->avoided) ||
+			    (!e.avoided == !victim->avoided &&
+			     e.used < victim->used))
+				victim = &e;
+		}
+		if (!victim)
+			return false;
+		drop(*victim);
+		st.evicted++;
+	}
+
+	return true;
+}
+
+void read_cache::commit(const std::string &path, const struct stat &s)
+{
+	std::string fill = fill_path();
+	auto it = seen.find(path);
+
+	if (it == seen.end()) {
+		unlink(fill.c_str());
+		return;
+	}
+
+	entry &e = it->second;
+
+	drop(e);
+	if (!evict(s.st_size, path) ||
+	    rename(fill.c_str(), copy_path(next_id).c_str())) {
+		unlink(fill.c_str());
+		return;
+	}
+	e.id = next_id++;
+	e.size = s.st_size;
+	e.mtime = s.st_mtim;
+	st.bytes += e.size;
+	st.files++;
+	st.admitted++;
+}
+
+} /* namespace hddsaver */
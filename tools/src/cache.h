@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Read cache of the files on the HDD Saver drives
+ *
+ * Learns which files are opened while the drives are on and keeps whole
+ * copies of the hot ones in a directory on another drive (an SSD), so
+ * reads of them while the drives are off need no wake. A file is
+ * admitted once opened in admit different periods on, or at once if a
+ * read of it had to power the drives on. Copies are made while the
+ * drives are on and are only used while their size and mtime match what
+ * the lower tree last showed. Files that avoided a wake are evicted
+ * last, the least recently used first.
+ *
+ * Not thread safe, callers serialize. copy() is the exception, it only
+ * touches the file system.
+ */
+#ifndef HDDSAVER_CACHE_H
+#define HDDSAVER_CACHE_H
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+namespace hddsaver {
+
+struct cache_options {
+	std::string dir;
+	uint64_t size = 1ULL << 30;
+	uint64_t max_file = 64ULL << 20;
+	unsigned int admit = 2;
+};
+
+struct cache_stats {
+	uint64_t hits = 0;		/* Reads while off served from copies */
+	uint64_t misses = 0;		/* Reads while off that went lower */
+	uint64_t hit_bytes = 0;
+	uint64_t avoided_wakes = 0;	/* Periods off the cache kept off */
+	uint64_t admitted = 0;
+	uint64_t evicted = 0;
+	uint64_t bytes = 0;		/* Of the copies */
+	uint64_t files = 0;
+};
+
+class read_cache {
+public:
+	read_cache() = default;
+	read_cache(const read_cache &) = delete;
+	read_cache &operator=(const read_cache &) = delete;
+
+	/* Creates the directory, or empties what a previous run left */
+	int open(const cache_options &o);
+	bool is_open() const { return !opt.dir.empty(); }
+	const cache_stats &stats() const { return st; }
+
+	/* The drives went off, or came back */
+	void power_changed(bool off);
+
+	/* A file was opened while the drives were usable */
+	void note_open(const std::string &path, const struct stat &s);
+
+	/*
+	 * A read while the drives were off could not be served. If that
+	 * powers them on the file is admitted.
+	 */
+	void note_miss(const std::string &path, bool wakes);
+	void note_hit(const std::string &path, uint64_t bytes);
+
+	/* The lower file changed to s, or is gone if s is nullptr */
+	void invalidate(const std::string &path, const struct stat *s);
+
+	/* A copy matching s, opened for reading, or -1 */
+	int open_copy(const std::string &path, const struct stat &s) const;
+
+	/* Files to copy, next() takes the first */
+	bool pending() const { return !queue.empty(); }
+	bool next(std::string &path);
+
+	/* Copies the lower file to the staging name, s is what was copied */
+	int copy(const std::string &lower, const std::string &path,
+		 struct stat &s) const;
+
+	/* Makes the staged copy of path the cached one, unless invalidated */
+	void commit(const std::string &path, const struct stat &s);
+
+private:
+	static constexpr size_t MAX_SEEN = 65536;
+
+	struct entry {
+		uint64_t id = 0;	/* Name of the copy, 0 if none */
+		bool queued = false;
+		unsigned int opens = 0;	/* In different periods on */
+		uint64_t period = 0;	/* Of the last counted open */
+		uint64_t size = 0;
+		struct timespec mtime = {};
+		uint64_t used = 0;	/* Serial of the last use */
+		uint64_t avoided = 0;	/* Hits while off */
+	};
+
+	std::string copy_path(uint64_t id) const;
+	std::string fill_path() const;
+	void admit(const std::string &path, entry &e);
+	void drop(entry &e);
+	bool evict(uint64_t need, const std::string &keep);
+	void forget();
+	entry &lookup(const std::string &path);
+
+	cache_options opt;
+	std::unordered_map<std::string, entry> seen;
+	std::deque<std::string> queue;
+	uint64_t next_id = 1;
+	uint64_t serial = 0;
+	uint64_t period = 0;
+	bool off = false;
+	bool woke = false;		/* A miss powered the drives on */
+	uint64_t period_hits = 0;
+	cache_stats st;
+};
+
+} /* namespace hddsaver */
+
+#endif
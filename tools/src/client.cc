@@ -0,0 +1,490 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Client library for programs sharing the drives behind the HDD Saver
+ */
+#include "client.h"
+#include "event_loop.h"
+#include "rail.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <poll.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define WAIT_CHECK_MS	100
+
+/*
+ * Backing store for the shared states of the futures. A promise made
+ * with an allocator allocates its state and its result through it, both
+ * fit a slot. Anything larger, or a request while all slots are taken by
+ * futures the caller still keeps, falls back to the heap.
+ */
+struct slot_pool {
+	static constexpr size_t SLOT_SIZE = 128;
+	static constexpr unsigned int SLOTS = 256;
+
+	alignas(std::max_align_t) unsigned char mem[SLOTS][SLOT_SIZE];
+	std::mutex lock;
+	uint16_t free_slots[SLOTS];
+	unsigned int nfree = SLOTS;
+
+	slot_pool()
+	{
+		for (unsigned int i = 0; i < SLOTS; i++)
+			free_slots[i] = SLOTS - 1 - i;
+	}
+
+	void *get(size_t size)
+	{
+		if (size <= SLOT_SIZE) {
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (nfree)
+				return mem[free_slots[--nfree]];
+		}
+		return ::operator new(size);
+	}
+
+	void put(void *p)
+	{
+		uintptr_t addr = uintptr_t(p), base = uintptr_t(mem);
+
+		if (addr < base || addr >= base + sizeof(mem)) {
+			::operator delete(p);
+			return;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		free_slots[nfree++] = (addr - base) / SLOT_SIZE;
+	}
+};
+
+/* Copies share the pool, which lives as long as any state made from it */
+template <typename T>
+struct pool_allocator {
+	using value_type = T;
+
+	std::shared_ptr<slot_pool> pool;
+
+	explicit pool_allocator(std::shared_ptr<slot_pool> p)
+		: pool(std::move(p)) {}
+	template <typename U>
+	pool_allocator(const pool_allocator<U> &o) : pool(o.pool) {}
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(pool->get(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t) { pool->put(p); }
+
+	template <typename U>
+	bool operator==(const pool_allocator<U> &o) const
+	{
+		return pool == o.pool;
+	}
+
+	template <typename U>
+	bool operator!=(const pool_allocator<U> &o) const
+	{
+		return pool != o.pool;
+	}
+};
+
+client::hold_guard::hold_guard(hold_guard &&o) noexcept
+	: owner(o.owner), fut(std::move(o.fut))
+{
+	o.owner = nullptr;
+}
+
+client::hold_guard &client::hold_guard::operator=(hold_guard &&o) noexcept
+{
+	if (this != &o) {
+		release();
+		owner = o.owner;
+		fut = std::move(o.fut);
+		o.owner = nullptr;
+	}
+
+	return *this;
+}
+
+void client::hold_guard::release()
+{
+	if (!owner)
+		return;
+
+	owner->holds--;
+	owner->wake();
+	owner = nullptr;
+}
+
+client::~client()
+{
+	close();
+}
+
+int client::open(const client_options &o)
+{
+	std::vector<std::string> disks = o.disks;
+	int fd, err;
+
+	close();
+	opt = o;
+	if (opt.hwmon.empty())
+		opt.hwmon = find_hwmon();
+	if (opt.hwmon.empty())
+		return -ENODEV;
+
+	power_fd = ::open((opt.hwmon + "/hddsaver_power").c_str(),
+			  O_RDWR | O_CLOEXEC);
+	if (power_fd < 0)
+		return -errno;
+
+	/* Patch 0005, without it there is only on and off */
+	state_fd = ::open((opt.hwmon + "/hddsaver_state").c_str(),
+			  O_RDONLY | O_CLOEXEC);
+
+	fd = ::open((opt.hwmon + "/hddsaver_disks").c_str(),
+		    O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && disks.empty()) {
+		char buf[512];
+
+		if (read_attr(fd, buf, sizeof(buf)) > 0)
+			disks = split_list(buf);
+	}
+	if (fd >= 0)
+		::close(fd);
+	disk_paths.clear();
+	for (const auto &disk : disks)
+		disk_paths.push_back(disk[0] == '/' ? disk :
+				     "/sys/class/block/" + disk);
+
+	/* Unprivileged holders need the file to exist already */
+	if (!opt.lock.empty()) {
+		lock_fd = ::open(opt.lock.c_str(), O_RDONLY | O_CREAT |
+				 O_CLOEXEC, 0644);
+		if (lock_fd < 0) {
+			err = -errno;
+			close();
+			return err;
+		}
+	}
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		err = -errno;
+		close();
+		return err;
+	}
+
+	/* The thread reports changes from here on */
+	err = read_state();
+	cur = err < 0 ? int(power_state::off) : err;
+	is_ready = err > 0 && disks_present();
+
+	pool = std::make_shared<slot_pool>();
+	thread = std::thread(&client::run, this);
+
+	return 0;
+}
+
+void client::close()
+{
+	if (thread.joinable()) {
+		stopping = true;
+		wake();
+		thread.join();
+		stopping = false;
+	}
+
+	for (int *fd : { &power_fd, &state_fd, &lock_fd, &wake_fd }) {
+		if (*fd >= 0)
+			::close(*fd);
+		*fd = -1;
+	}
+	pool.reset();
+	head = tail = 0;
+	locked = false;
+}
+
+void client::wake()
+{
+	uint64_t one = 1;
+
+	if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return;
+}
+
+int client::submit(op_type type, std::promise<int> *p, callback cb,
+		   void *arg)
+{
+	if (!thread.joinable())
+		return -EBADF;
+
+	{
+		std::lock_guard<std::mutex> guard(queue_lock);
+		op &o = queue[head % QUEUE];
+
+		if (head - tail == QUEUE)
+			return -EAGAIN;
+		o.type = type;
+		if (p)
+			o.promise.emplace(std::move(*p));
+		o.cb = cb;
+		o.arg = arg;
+		head++;
+	}
+	wake();
+
+	return 0;
+}
+
+std::future<int> client::request(op_type type)
+{
+	std::future<int> f;
+	int err;
+
+	/* Not open, the heap will do for the error */
+	if (!pool) {
+		std::promise<int> p;
+
+		f = p.get_future();
+		p.set_value(-EBADF);
+		return f;
+	}
+
+	std::promise<int> p(std::allocator_arg, pool_allocator<int>(pool));
+
+	f = p.get_future();
+	err = submit(type, &p, nullptr, nullptr);
+	if (err)
+		p.set_value(err);
+
+	return f;
+}
+
+std::future<int> client::power_on()
+{
+	return request(OP_ON);
+}
+
+std::future<int> client::power_off()
+{
+	return request(OP_OFF);
+}
+
+int client::power_on(callback cb, void *arg)
+{
+	return submit(OP_ON, nullptr, cb, arg);
+}
+
+int client::power_off(callback cb, void *arg)
+{
+	return submit(OP_OFF, nullptr, cb, arg);
+}
+
+client::hold_guard client::hold()
+{
+	hold_guard g;
+
+	holds++;
+	g.owner = this;
+	g.fut = power_on();
+
+	return g;
+}
+
+void client::complete(op &o, int result)
+{
+	if (o.promise) {
+		o.promise->set_value(result);
+		o.promise.reset();
+	} else if (o.cb) {
+		o.cb(result, o.arg);
+	}
+}
+
+/* Reading also rearms the notification of the attribute polled */
+int client::read_state() const
+{
+	char buf[16];
+	int len;
+
+	if (state_fd >= 0) {
+		len = read_attr(state_fd, buf, sizeof(buf));
+		if (len < 0)
+			return len;
+		if (!strncmp(buf, "active", 6))
+			return int(power_state::active);
+		if (!strncmp(buf, "standby", 7))
+			return int(power_state::standby);
+		if (!strncmp(buf, "off", 3))
+			return int(power_state::off);
+		return -EINVAL;
+	}
+
+	len = read_attr(power_fd, buf, sizeof(buf));
+	if (len < 0)
+		return len;
+	if (!strncasecmp(buf, "on", 2))
+		return int(power_state::active);
+	if (!strncasecmp(buf, "off", 3))
+		return int(power_state::off);
+
+	return -EINVAL;
+}
+
+bool client::disks_present() const
+{
+	for (const auto &path : disk_paths)
+		if (access(path.c_str(), F_OK))
+			return false;
+
+	return true;
+}
+
+/* The shared lock follows the holders, one flock per client */
+void client::sync_holds()
+{
+	bool want = holds.load() > 0;
+
+	if (lock_fd < 0 || want == locked)
+		return;
+	if (!flock(lock_fd, want ? LOCK_SH : LOCK_UN))
+		locked = want;
+}
+
+void client::finish_waiters(int result)
+{
+	for (unsigned int i = 0; i < nwaiters; i++)
+		complete(waiters[i], result);
+	nwaiters = 0;
+}
+
+void client::update()
+{
+	int s = read_state();
+	bool rdy;
+
+	if (s < 0)
+		return;
+
+	rdy = s != int(power_state::off) && disks_present();
+	is_ready = rdy;
+	if (s != cur.exchange(s) && changed)
+		changed(power_state(s));
+
+	if (!nwaiters)
+		return;
+	if (rdy)
+		finish_waiters(0);
+	else if (s == int(power_state::off))
+		finish_waiters(-ECANCELED);
+	else if (now_ms() >= deadline)
+		finish_waiters(-ETIMEDOUT);
+}
+
+void client::process(op &o)
+{
+	ssize_t len;
+	int err = 0;
+
+	switch (o.type) {
+	case OP_ON:
+		update();
+		if (is_ready) {
+			complete(o, 0);
+			break;
+		}
+		if (cur == int(power_state::off)) {
+			len = pwrite(power_fd, "on\n", 3, 0);
+			if (len < 0) {
+				complete(o, -errno);
+				break;
+			}
+		}
+		if (nwaiters == QUEUE) {
+			complete(o, -EAGAIN);
+			break;
+		}
+		if (!nwaiters)
+			deadline = now_ms() + opt.ready_timeout_ms;
+		waiters[nwaiters++] = std::move(o);
+		o.promise.reset();
+		update();
+		break;
+
+	case OP_OFF:
+		if (holds.load() > 0) {
+			complete(o, -EBUSY);
+			break;
+		}
+		if (lock_fd >= 0 && flock(lock_fd, LOCK_EX | LOCK_NB)) {
+			complete(o, errno == EWOULDBLOCK ? -EBUSY : -errno);
+			break;
+		}
+		finish_waiters(-ECANCELED);
+		len = pwrite(power_fd, "off\n", 4, 0);
+		if (len < 0)
+			err = -errno;
+		if (lock_fd >= 0)
+			flock(lock_fd, LOCK_UN);
+		update();
+		if (!err && cur != int(power_state::off))
+			err = -EIO;
+		complete(o, err);
+		break;
+	}
+}
+
+void client::run()
+{
+	struct pollfd pfd[2] = {
+		{ wake_fd, POLLIN, 0 },
+		/* Patch 0007 notifies both, polling one needs one read */
+		{ state_fd >= 0 ? state_fd : power_fd, POLLPRI, 0 },
+	};
+	uint64_t val;
+	int timeout;
+
+	while (!stopping) {
+		timeout = nwaiters ? WAIT_CHECK_MS :
+			  opt.poll_ms ? int(opt.poll_ms) : -1;
+		if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+			break;
+		if (pfd[0].revents & POLLIN)
+			while (read(wake_fd, &val, sizeof(val)) > 0)
+				;
+
+		sync_holds();
+		for (;;) {
+			{
+				std::lock_guard<std::mutex> guard(queue_lock);
+
+				if (tail == head)
+					break;
+			}
+			process(queue[tail % QUEUE]);
+			std::lock_guard<std::mutex> guard(queue_lock);
+			tail++;
+		}
+		update();
+	}
+
+	finish_waiters(-ECANCELED);
+	for (; tail != head; tail++)
+		complete(queue[tail % QUEUE], -ECANCELED);
+	if (locked)
+		flock(lock_fd, LOCK_UN);
+	locked = false;
+}
+
+} /* namespace hddsaver */
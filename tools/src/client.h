@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Client library for programs sharing the drives behind the HDD Saver
+ *
+ * A client keeps hddsaver_power and hddsaver_state open and waits for
+ * changes in poll() on a thread of its own. Requests complete when the
+ * drives are usable, i.e. after the rail is on and every drive of
+ * hddsaver_disks has reappeared, or once the rail is off. Futures share
+ * a pool allocated at open() and callbacks are plain function pointers,
+ * so a request allocates nothing.
+ *
+ * hold() keeps the drives on while its guard lives. Holders take a
+ * shared flock on a lock file which hddsaverd and power_off() of every
+ * client try to take exclusively, so the power is not cut under another
+ * process either.
+ */
+#ifndef HDDSAVER_CLIENT_H
+#define HDDSAVER_CLIENT_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hddsaver {
+
+/* Processes holding the power take a shared flock on this file */
+#define HOLD_LOCK_PATH	"/run/hddsaver.lock"
+
+enum class power_state { off, standby, active };
+
+struct client_options {
+	std::string hwmon;			/* Default autodetect */
+	std::vector<std::string> disks;		/* Default hddsaver_disks */
+	std::string lock = HOLD_LOCK_PATH;	/* "" for no cross-process holds */
+	unsigned int ready_timeout_ms = 60000;
+
+	/*
+	 * Kernels with patch 0007 wake pollers of the attributes on every
+	 * change. Older ones are only noticed by reading them every poll_ms,
+	 * 0 relies on the notifications. Pending requests are checked every
+	 * 100 ms regardless, drives do not notify when they reappear.
+	 */
+	unsigned int poll_ms = 0;
+};
+
+struct slot_pool;
+
+class client {
+public:
+	/* result is 0 or -errno, called on the client thread */
+	using callback = void (*)(int result, void *arg);
+
+	class hold_guard {
+	public:
+		hold_guard() = default;
+		hold_guard(hold_guard &&o) noexcept;
+		hold_guard &operator=(hold_guard &&o) noexcept;
+		~hold_guard() { release(); }
+
+		/* Completes like power_on() */
+		std::future<int> &ready() { return fut; }
+		void release();
+		explicit operator bool() const { return owner != nullptr; }
+
+	private:
+		friend class client;
+
+		client *owner = nullptr;
+		std::future<int> fut;
+	};
+
+	client() = default;
+	~client();
+	client(const client &) = delete;
+	client &operator=(const client &) = delete;
+
+	int open(const client_options &opt = client_options());
+	void close();
+
+	std::future<int> power_on();
+	std::future<int> power_off();
+	int power_on(callback cb, void *arg);
+	int power_off(callback cb, void *arg);
+
+	/*
+	 * power_off() fails with -EBUSY while any holder, here or in another
+	 * process, lives. Guards must not outlive the client.
+	 */
+	hold_guard hold();
+
+	/* Set before open(), called on the client thread on every change */
+	void on_change(std::function<void(power_state)> cb) { changed = cb; }
+
+	power_state state() const { return power_state(cur.load()); }
+	bool ready() const { return is_ready.load(); }
+	const std::string &path() const { return opt.hwmon; }
+
+private:
+	enum op_type : uint8_t { OP_ON, OP_OFF };
+
+	/* A default constructed promise allocates, an empty optional not */
+	struct op {
+		op_type type = OP_ON;
+		std::optional<std::promise<int>> promise;
+		callback cb = nullptr;
+		void *arg = nullptr;
+	};
+
+	static constexpr unsigned int QUEUE = 64;
+
+	std::future<int> request(op_type type);
+	int submit(op_type type, std::promise<int> *p, callback cb, void *arg);
+	void wake();
+	static void complete(op &o, int result);
+	void run();
+	int read_state() const;
+	bool disks_present() const;
+	void sync_holds();
+	void process(op &o);
+	void finish_waiters(int result);
+	void update();
+
+	client_options opt;
+	std::vector<std::string> disk_paths;
+	int power_fd = -1;
+	int state_fd = -1;
+	int lock_fd = -1;
+	int wake_fd = -1;
+	std::shared_ptr<slot_pool> pool;
+	std::function<void(power_state)> changed;
+
+	std::mutex queue_lock;
+	op queue[QUEUE];
+	unsigned int head = 0;
+	unsigned int tail = 0;
+
+	/* Client thread only */
+	op waiters[QUEUE];
+	unsigned int nwaiters = 0;
+	uint64_t deadline = 0;
+	bool locked = false;
+
+	std::atomic<int> holds{ 0 };
+	std::atomic<int> cur{ int(power_state::off) };
+	std::atomic<bool> is_ready{ false };
+	std::atomic<bool> stopping{ false };
+	std::thread thread;
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Unix socket control interface of hddsaverd
+ */
+#include "control.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+control::~control()
+{
+	for (auto &c : clients) {
+		if (c.fd < 0)
+			continue;
+		loop->remove(c.fd);
+		close(c.fd);
+	}
+	if (fd < 0)
+		return;
+	loop->remove(fd);
+	close(fd);
+	unlink(path.c_str());
+}
+
+int control::open(event_loop &l, const std::string &p, mode_t mode,
+		  gid_t group, handler h)
+{
+	struct sockaddr_un addr = {};
+	int err;
+
+	if (p.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, p.c_str());
+	unlink(p.c_str());
+	/* Before listen(), nobody else can connect in between */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chown(p.c_str(), -1, group) || chmod(p.c_str(), mode) ||
+	    listen(fd, 4)) {
+		err = -errno;
+		goto fail;
+	}
+
+	loop = &l;
+	path = p;
+	cmd_handler = std::move(h);
+	err = deadline_timer.open(l, [this] { expire(); });
+	if (!err)
+		err = loop->add(fd, EPOLLIN,
+				[this](uint32_t) { accept_client(); });
+	if (err)
+		goto fail;
+
+	return 0;
+
+fail:
+	close(fd);
+	fd = -1;
+	return err;
+}
+
+void control::accept_client()
+{
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	client *c = nullptr;
+	int cfd;
+
+	cfd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
+	for (auto &slot : clients) {
+		if (slot.fd < 0) {
+			c = &slot;
+			break;
+		}
+	}
+	if (!c || loop->add(cfd, EPOLLIN, [this, c](uint32_t) { receive(*c); })) {
+		close(cfd);
+		return;
+	}
+
+	if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len))
+		cred.uid = -1;
+	c->fd = cfd;
+	c->uid = cred.uid;
+	c->deadline = now_ms() + CLIENT_TIMEOUT_MS;
+	c->len = 0;
+	if (!deadline_timer.armed())
+		deadline_timer.arm(CLIENT_TIMEOUT_MS);
+}
+
+/* Up to the end of the line, or of what the client sends */
+void control::receive(client &c)
+{
+	ssize_t n = read(c.fd, c.cmd + c.len, sizeof(c.cmd) - 1 - c.len);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			drop(c);
+		return;
+	}
+	c.len += n;
+	c.cmd[c.len] = '\0';
+	if (n && c.len < sizeof(c.cmd) - 1 && !strchr(c.cmd, '\n'))
+		return;
+
+	respond(c);
+}
+
+void control::respond(client &c)
+{
+	if (!c.len) {
+		drop(c);
+		return;
+	}
+	c.cmd[strcspn(c.cmd, "\r\n")] = '\0';
+	c.out = cmd_handler(c.cmd, c.uid) + "\n";
+	c.sent = 0;
+
+	loop->remove(c.fd);
+	if (loop->add(c.fd, EPOLLOUT, [this, p = &c](uint32_t) { send(*p); })) {
+		drop(c);
+		return;
+	}
+	send(c);
+}
+
+void control::send(client &c)
+{
+	ssize_t n = write(c.fd, c.out.data() + c.sent, c.out.size() - c.sent);
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0)
+		c.sent += n;
+	if (n < 0 || c.sent == c.out.size())
+		drop(c);
+}
+
+void control::drop(client &c)
+{
+	loop->remove(c.fd);
+	close(c.fd);
+	c.fd = -1;
+	c.out.clear();
+}
+
+/* Whatever did not finish by its deadline, the timer follows the next */
+void control::expire()
+{
+	uint64_t now = now_ms(), next = 0;
+
+	for (auto &c : clients) {
+		if (c.fd < 0)
+			continue;
+		if (c.deadline <= now) {
+			drop(c);
+			continue;
+		}
+		if (!next || c.deadline < next)
+			next = c.deadline;
+	}
+	if (next)
+		deadline_timer.arm(next - now);
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Unix socket control interface of hddsaverd
+ */
+#ifndef HDDSAVER_CONTROL_H
+#define HDDSAVER_CONTROL_H
+
+#include "event_loop.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+
+namespace hddsaver {
+
+/*
+ * Every client sends one command line and gets one reply back: "on",
+ * "off" or "status" get one line, "smart" one per drive, "jobs" one per
+ * job and "qos" one per latency request. The socket is given its mode
+ * and group after bind(), and each command comes with the uid of its
+ * client, so the caller decides what other users may do. Clients are
+ * read and written from the loop as they are ready, and dropped at a
+ * deadline, so a stuck client never blocks the daemon.
+ */
+class control {
+public:
+	using handler = std::function<std::string(const std::string &cmd,
+						  uid_t uid)>;
+
+	control() = default;
+	~control();
+	control(const control &) = delete;
+	control &operator=(const control &) = delete;
+
+	/* A group of -1 leaves the socket in the group of the daemon */
+	int open(event_loop &loop, const std::string &path, mode_t mode,
+		 gid_t group, handler h);
+
+private:
+	static constexpr size_t MAX_CLIENTS = 8;
+	static constexpr uint64_t CLIENT_TIMEOUT_MS = 1000;
+
+	struct client {
+		int fd = -1;		/* -1 if the slot is free */
+		uid_t uid;
+		uint64_t deadline;
+		size_t len;
+		char cmd[128];
+		std::string out;	/* The reply */
+		size_t sent;
+	};
+
+	void accept_client();
+	void receive(client &c);
+	void respond(client &c);
+	void send(client &c);
+	void drop(client &c);
+	void expire();
+
+	event_loop *loop = nullptr;
+	std::string path;
+	int fd = -1;
+	handler cmd_handler;
+	client clients[MAX_CLIENTS];
+	timer deadline_timer;
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Activity detection from /proc/diskstats
+ */
+#include "diskstats.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+/* Fields after the name: reads, reads merged, sectors read, ms reading,
+ * writes, writes merged, sectors written, ms writing, in flight */
+#define FIELD_READS	0
+#define FIELD_WRITES	4
+#define FIELD_IN_FLIGHT	8
+
+diskstats::~diskstats()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+int diskstats::open(const char *path)
+{
+	fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	buf.resize(4096);
+
+	return 0;
+}
+
+void diskstats::watch(const std::vector<std::string> &names)
+{
+	disks.clear();
+	for (const auto &name : names) {
+		disk d = {};
+
+		/* Longer names cannot be block devices, skip them */
+		if (name.size() > sizeof(d.key) - 3)
+			continue;
+		d.key_len = snprintf(d.key, sizeof(d.key), " %s ",
+				     name.c_str());
+		disks.push_back(d);
+	}
+}
+
+/* Reads the whole file, growing buf only if it does not fit */
+int diskstats::fill()
+{
+	for (;;) {
+		ssize_t ret = pread(fd, buf.data(), buf.size(), 0);
+
+		if (ret < 0)
+			return -errno;
+		if ((size_t)ret < buf.size()) {
+			len = ret;
+			return 0;
+		}
+		buf.resize(buf.size() * 2);
+	}
+}
+
+/*
+ * The name is the only field with letters in it, so " name " cannot
+ * match anywhere but in its own line.
+ */
+const char *diskstats::find(disk &d, const char *end)
+{
+	const char *base = buf.data();
+	const char *p;
+
+	if (d.offset + d.key_len <= len &&
+	    !memcmp(base + d.offset, d.key, d.key_len))
+		return base + d.offset + d.key_len;
+
+	p = (const char *)memmem(base, end - base, d.key, d.key_len);
+	if (!p)
+		return nullptr;
+	d.offset = p - base;
+
+	return p + d.key_len;
+}
+
+static const char *parse_u64(const char *p, const char *end, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	while (p < end && *p == ' ')
+		p++;
+	if (p == end || *p < '0' || *p > '9')
+		return nullptr;
+	while (p < end && *p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+	*val = v;
+
+	return p;
+}
+
+int diskstats::poll()
+{
+	const char *end;
+	int changed = 0;
+	int err;
+
+	err = fill();
+	if (err)
+		return err;
+	end = buf.data() + len;
+
+	for (auto &d : disks) {
+		const char *p = find(d, end);
+		uint64_t val = 0, ios = 0;
+		int i;
+
+		d.changed = false;
+		if (!p)
+			continue;
+
+		for (i = 0; i < FIELD_IN_FLIGHT; i++) {
+			p = parse_u64(p, end, &val);
+			if (!p)
+				break;
+			if (i == FIELD_READS || i == FIELD_WRITES)
+				ios += val;
+		}
+		if (!p || !parse_u64(p, end, &val))
+			continue;
+
+		/* A request that stays in flight is activity too */
+		if ((d.seen && d.ios != ios) || val) {
+			d.changed = true;
+			changed = 1;
+		}
+		d.ios = ios;
+		d.seen = true;
+	}
+
+	return changed;
+}
+
+} /* namespace hddsaver */
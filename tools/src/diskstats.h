@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Activity detection from /proc/diskstats
+ */
+#ifndef HDDSAVER_DISKSTATS_H
+#define HDDSAVER_DISKSTATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+/*
+ * Keeps /proc/diskstats open and compares the completed and in flight
+ * request counters of the watched drives between two polls.
+ *
+ * poll() does not allocate once the buffer has grown to the size of the
+ * file. Only the lines of the watched drives are parsed: each is looked
+ * up at the offset where it was found last time, and searched for with
+ * memmem() only when the device list has changed.
+ */
+class diskstats {
+public:
+	diskstats() = default;
+	~diskstats();
+	diskstats(const diskstats &) = delete;
+	diskstats &operator=(const diskstats &) = delete;
+
+	int open(const char *path = "/proc/diskstats");
+	void watch(const std::vector<std::string> &disks);
+
+	/* 1 if a watched drive saw I/O since the last poll or has some in flight */
+	int poll();
+
+	/* After poll(), whether drive i (in watch() order) saw I/O */
+	bool changed(size_t i) const { return disks[i].changed; }
+
+private:
+	struct disk {
+		char key[36];		/* " name " */
+		size_t key_len;
+		size_t offset;		/* Of key in buf during the last poll */
+		uint64_t ios;
+		bool seen;
+		bool changed;
+	};
+
+	int fill();
+	const char *find(disk &d, const char *end);
+
+	int fd = -1;
+	std::vector<disk> disks;
+	std::vector<char> buf;
+	size_t len = 0;
+};
+
+} /* namespace hddsaver */
+
+#endif
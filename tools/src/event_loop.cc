@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Single threaded epoll loop with timerfd based timers
+ */
+#include "event_loop.h"
+
+#include <cerrno>
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+uint64_t now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+event_loop::event_loop()
+	: epfd(epoll_create1(EPOLL_CLOEXEC))
+{
+}
+
+event_loop::~event_loop()
+{
+	if (epfd >= 0)
+		close(epfd);
+}
+
+int event_loop::add(int fd, uint32_t events, handler h)
+{
+	struct epoll_event ev = {};
+
+	if (epfd < 0)
+		return -EBADF;
+
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		return -errno;
+
+	if ((size_t)fd >= handlers.size())
+		handlers.resize(fd + 1);
+	handlers[fd] = std::move(h);
+
+	return 0;
+}
+
+int event_loop::remove(int fd)
+{
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr))
+		return -errno;
+	handlers[fd] = nullptr;
+
+	return 0;
+}
+
+int event_loop::run()
+{
+	struct epoll_event events[16];
+
+	running = true;
+	while (running) {
+		int n = epoll_wait(epfd, events, 16, -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		for (int i = 0; i < n && running; i++) {
+			int fd = events[i].data.fd;
+			handler h;
+
+			/* A previous handler may have removed it */
+			if ((size_t)fd >= handlers.size() || !handlers[fd])
+				continue;
+			/*
+			 * Called on a copy, a handler may remove or replace
+			 * itself, and add() may move the others
+			 */
+			h = handlers[fd];
+			h(events[i].events);
+		}
+	}
+
+	return 0;
+}
+
+timer::~timer()
+{
+	if (fd < 0)
+		return;
+	loop->remove(fd);
+	close(fd);
+}
+
+int timer::open(event_loop &l, std::function<void()> cb, clockid_t clock)
+{
+	int err;
+
+	fd = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	loop = &l;
+	callback = std::move(cb);
+	err = loop->add(fd, EPOLLIN, [this](uint32_t) {
+		uint64_t expirations;
+
+		if (read(fd, &expirations, sizeof(expirations)) < 0)
+			return;
+		if (!periodic)
+			is_armed = false;
+		callback();
+	});
+	if (err) {
+		close(fd);
+		fd = -1;
+	}
+
+	return err;
+}
+
+int timer::arm(uint64_t delay_ms, uint64_t interval_ms)
+{
+	struct itimerspec its = {};
+
+	/* A zero it_value would disarm, round short delays up */
+	if (delay_ms || interval_ms) {
+		if (!delay_ms)
+			delay_ms = 1;
+		its.it_value.tv_sec = delay_ms / 1000;
+		its.it_value.tv_nsec = delay_ms % 1000 * 1000000;
+		its.it_interval.tv_sec = interval_ms / 1000;
+		its.it_interval.tv_nsec = interval_ms % 1000 * 1000000;
+	}
+
+	if (timerfd_settime(fd, 0, &its, nullptr))
+		return -errno;
+	is_armed = delay_ms || interval_ms;
+	periodic = interval_ms;
+
+	return 0;
+}
+
+int timer::arm_at(time_t when)
+{
+	struct itimerspec its = {};
+
+	its.it_value.tv_sec = when;
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, nullptr))
+		return -errno;
+	is_armed = true;
+	periodic = false;
+
+	return 0;
+}
+
+int add_signals(event_loop &loop, const std::vector<int> &signals,
+		std::function<void(int)> cb)
+{
+	sigset_t mask;
+	int fd, err;
+
+	sigemptyset(&mask);
+	for (int sig : signals)
+		sigaddset(&mask, sig);
+	if (sigprocmask(SIG_BLOCK, &mask, nullptr))
+		return -errno;
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	err = loop.add(fd, EPOLLIN, [fd, cb](uint32_t) {
+		struct signalfd_siginfo si;
+
+		while (read(fd, &si, sizeof(si)) == sizeof(si))
+			cb(si.ssi_signo);
+	});
+	if (err)
+		close(fd);
+
+	return err;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Single threaded epoll loop with timerfd based timers
+ */
+#ifndef HDDSAVER_EVENT_LOOP_H
+#define HDDSAVER_EVENT_LOOP_H
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <vector>
+
+namespace hddsaver {
+
+/* CLOCK_MONOTONIC in milliseconds */
+uint64_t now_ms();
+
+class event_loop {
+public:
+	using handler = std::function<void(uint32_t events)>;
+
+	event_loop();
+	~event_loop();
+	event_loop(const event_loop &) = delete;
+	event_loop &operator=(const event_loop &) = delete;
+
+	int add(int fd, uint32_t events, handler h);
+	int remove(int fd);
+
+	/* Runs until stop() is called, returns 0 or -errno */
+	int run();
+	void stop() { running = false; }
+
+private:
+	int epfd;
+	bool running = false;
+	std::vector<handler> handlers;	/* Indexed by fd */
+};
+
+/*
+ * A timerfd registered with a loop. Handlers are only called when the
+ * timer expired, a disarmed timer costs nothing.
+ */
+class timer {
+public:
+	timer() = default;
+	~timer();
+	timer(const timer &) = delete;
+	timer &operator=(const timer &) = delete;
+
+	int open(event_loop &loop, std::function<void()> cb,
+		 clockid_t clock = CLOCK_MONOTONIC);
+
+	/* Relative to now, interval 0 for a one shot timer */
+	int arm(uint64_t delay_ms, uint64_t interval_ms = 0);
+
+	/* Absolute expiry in seconds on the timer's clock */
+	int arm_at(time_t when);
+
+	int disarm() { return arm(0); }
+	bool armed() const { return is_armed; }
+
+private:
+	event_loop *loop = nullptr;
+	int fd = -1;
+	bool is_armed = false;
+	bool periodic = false;
+	std::function<void()> callback;
+};
+
+/* Blocks the given signals and delivers them through the loop */
+int add_signals(event_loop &loop, const std::vector<int> &signals,
+		std::function<void(int)> cb);
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Background I/O deferral by freezing cgroups
+ */
+#include "freezer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define CGROUP_ROOT	"/sys/fs/cgroup"
+
+freezer::~freezer()
+{
+	/* Nobody would thaw them after the daemon */
+	if (is_frozen)
+		set(false);
+	for (auto &g : groups)
+		if (g.fd >= 0)
+			close(g.fd);
+}
+
+void freezer::open(const std::vector<std::string> &cgroups)
+{
+	for (const auto &cg : cgroups) {
+		group g;
+
+		if (!cg.compare(0, strlen(CGROUP_ROOT "/"), CGROUP_ROOT "/"))
+			g.path = cg;
+		else
+			g.path = std::string(CGROUP_ROOT) +
+				 (cg[0] == '/' ? "" : "/") + cg;
+		g.path += "/cgroup.freeze";
+		groups.push_back(g);
+	}
+}
+
+int freezer::set(bool frozen)
+{
+	const char *val = frozen ? "1\n" : "0\n";
+	int n = 0;
+
+	is_frozen = frozen;
+	for (auto &g : groups) {
+		/* Once more with a fresh fd if the group was recreated */
+		for (int tries = 0; tries < 2; tries++) {
+			if (g.fd < 0)
+				g.fd = ::open(g.path.c_str(), O_WRONLY | O_CLOEXEC);
+			if (g.fd < 0)
+				break;
+			if (pwrite(g.fd, val, 2, 0) == 2) {
+				n++;
+				break;
+			}
+			close(g.fd);
+			g.fd = -1;
+		}
+	}
+
+	return n;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Background I/O deferral by freezing cgroups
+ */
+#ifndef HDDSAVER_FREEZER_H
+#define HDDSAVER_FREEZER_H
+
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+/*
+ * Freezes the processes of a few cgroup v2 groups (cgroup.freeze) while
+ * the HDD Saver power is off, so indexers, scrubbers and the like wait
+ * for the next wake instead of causing one each. Processes that join a
+ * frozen group, or a group below it, are frozen as well.
+ *
+ * Groups that do not exist yet are looked for again at each set(), a
+ * service's group comes and goes with the service.
+ */
+class freezer {
+public:
+	freezer() = default;
+	~freezer();
+	freezer(const freezer &) = delete;
+	freezer &operator=(const freezer &) = delete;
+
+	/* Paths below /sys/fs/cgroup, or relative to it */
+	void open(const std::vector<std::string> &cgroups);
+	bool empty() const { return groups.empty(); }
+	bool frozen() const { return is_frozen; }
+
+	/* Returns how many groups were set */
+	int set(bool frozen);
+
+private:
+	struct group {
+		std::string path;
+		int fd = -1;		/* cgroup.freeze */
+	};
+
+	std::vector<group> groups;
+	bool is_frozen = false;
+};
+
+} /* namespace hddsaver */
+
+#endif
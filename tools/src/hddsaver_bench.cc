@@ -0,0 +1,375 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-bench - time from "power on requested" to the first read
+ *
+ * Each cycle turns the rail off, waits for the drive to go, turns it on
+ * and reads the first 4 KiB of the drive until that succeeds. Meanwhile
+ * requester threads arrive at random moments of the spin up and read as
+ * well, their waits being the latency a queued request sees. With
+ * --standin the rail and the drive are simulated with a known spin up
+ * delay, so what remains is the cost of the control path.
+ */
+#include "rail.h"
+#include "standin.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <getopt.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace hddsaver;
+
+struct options {
+	std::string hwmon;
+	std::string disk;
+	std::string standin_dir;
+	std::string backing;
+	unsigned int cycles = 20;
+	unsigned int requesters = 4;
+	uint64_t spinup_us = 100000;
+	uint64_t jitter_us = 20000;
+	uint64_t retry_us = 200;
+	uint64_t settle_us = 0;
+};
+
+struct samples {
+	std::mutex lock;
+	std::vector<uint64_t> ttfb;	/* ns */
+	std::vector<uint64_t> store;
+	std::vector<uint64_t> overhead;
+	std::vector<uint64_t> queued;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_us(uint64_t us)
+{
+	struct timespec ts = { (time_t)(us / 1000000),
+			       (long)(us % 1000000 * 1000) };
+
+	nanosleep(&ts, nullptr);
+}
+
+/* O_DIRECT wants an aligned buffer, buf has room for one block */
+static char *block(std::vector<char> &buf)
+{
+	buf.resize(8192);
+
+	return (char *)(((uintptr_t)buf.data() + 4095) & ~(uintptr_t)4095);
+}
+
+/* Retries open and read of the first block until both succeed */
+static void read_first(const options &opt, char *buf)
+{
+	for (;;) {
+		int fd = open(opt.disk.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+		/* tmpfs and friends do not do O_DIRECT */
+		if (fd < 0 && errno == EINVAL)
+			fd = open(opt.disk.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			ssize_t len = pread(fd, buf, 4096, 0);
+
+			close(fd);
+			if (len >= 0)
+				return;
+		}
+		sleep_us(opt.retry_us);
+	}
+}
+
+/* A cycle in flight, requesters arrive relative to its start */
+struct cycle {
+	std::mutex lock;
+	std::condition_variable cv;
+	uint64_t generation = 0;
+	bool quit = false;
+	std::atomic<unsigned int> done{ 0 };
+};
+
+static void requester(const options &opt, cycle &c, samples &s,
+		      unsigned int id)
+{
+	std::vector<char> buf;
+	char *io = block(buf);
+	uint64_t seen = 0, x = id + 1, t0;
+
+	for (;;) {
+		std::unique_lock<std::mutex> l(c.lock);
+
+		c.cv.wait(l, [&] { return c.quit || c.generation != seen; });
+		if (c.quit)
+			return;
+		seen = c.generation;
+		l.unlock();
+
+		/* Somewhere during the spin up */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		sleep_us(x % (opt.spinup_us + opt.jitter_us + 1));
+
+		t0 = now_ns();
+		read_first(opt, io);
+		{
+			std::lock_guard<std::mutex> g(s.lock);
+
+			s.queued.push_back(now_ns() - t0);
+		}
+		c.done++;
+	}
+}
+
+static int wait_gone(const options &opt)
+{
+	struct stat st;
+	uint64_t t0 = now_ns();
+
+	while (!stat(opt.disk.c_str(), &st)) {
+		if (now_ns() - t0 > 120000000000ULL)
+			return -ETIMEDOUT;
+		sleep_us(10000);
+	}
+	sleep_us(opt.settle_us);
+
+	return 0;
+}
+
+static void print(const char *name, std::vector<uint64_t> &v)
+{
+	auto pct = [&v](double p) {
+		size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+
+		return v[i] / 1e6;
+	};
+
+	if (v.empty())
+		return;
+	std::sort(v.begin(), v.end());
+	printf("%-10s n %-6zu p50 %9.3f p99 %9.3f p99.9 %9.3f max %9.3f ms\n",
+	       name, v.size(), pct(0.5), pct(0.99), pct(0.999),
+	       v.back() / 1e6);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] --hwmon DIR --disk DEV\n"
+		"       %s [options] --standin DIR [--backing DEV]\n"
+		"  -H, --hwmon DIR       hwmon directory with hddsaver_power\n"
+		"  -d, --disk DEV        device to read, e.g. /dev/disk/by-id/...\n"
+		"  -S, --standin DIR     simulate the rail and the drive in DIR\n"
+		"  -b, --backing DEV     stand-in drive, loop or null_blk (a file in DIR)\n"
+		"  -n, --cycles N        power cycles (20)\n"
+		"  -r, --requesters N    concurrent readers per cycle (4)\n"
+		"      --spinup MS       stand-in spin up delay (100)\n"
+		"      --jitter MS       stand-in spin up jitter (20)\n"
+		"      --retry US        read retry interval (200)\n"
+		"      --settle MS       wait after the drive is gone (0)\n",
+		prog, prog);
+}
+
+enum {
+	OPT_SPINUP = 256,
+	OPT_JITTER,
+	OPT_RETRY,
+	OPT_SETTLE,
+};
+
+static int parse_options(int argc, char **argv, options &opt)
+{
+	static const struct option longopts[] = {
+		{ "hwmon",	required_argument, nullptr, 'H' },
+		{ "disk",	required_argument, nullptr, 'd' },
+		{ "standin",	required_argument, nullptr, 'S' },
+		{ "backing",	required_argument, nullptr, 'b' },
+		{ "cycles",	required_argument, nullptr, 'n' },
+		{ "requesters",	required_argument, nullptr, 'r' },
+		{ "spinup",	required_argument, nullptr, OPT_SPINUP },
+		{ "jitter",	required_argument, nullptr, OPT_JITTER },
+		{ "retry",	required_argument, nullptr, OPT_RETRY },
+		{ "settle",	required_argument, nullptr, OPT_SETTLE },
+		{ "help",	no_argument,	   nullptr, 'h' },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "H:d:S:b:n:r:h", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 'H':
+			opt.hwmon = optarg;
+			break;
+		case 'd':
+			opt.disk = optarg;
+			break;
+		case 'S':
+			opt.standin_dir = optarg;
+			break;
+		case 'b':
+			opt.backing = optarg;
+			break;
+		case 'n':
+			opt.cycles = strtoul(optarg, nullptr, 0);
+			break;
+		case 'r':
+			opt.requesters = strtoul(optarg, nullptr, 0);
+			break;
+		case OPT_SPINUP:
+			opt.spinup_us = strtoull(optarg, nullptr, 0) * 1000;
+			break;
+		case OPT_JITTER:
+			opt.jitter_us = strtoull(optarg, nullptr, 0) * 1000;
+			break;
+		case OPT_RETRY:
+			opt.retry_us = strtoull(optarg, nullptr, 0);
+			break;
+		case OPT_SETTLE:
+			opt.settle_us = strtoull(optarg, nullptr, 0) * 1000;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc || !opt.cycles)
+		return -EINVAL;
+	if (opt.standin_dir.empty() == (opt.hwmon.empty() || opt.disk.empty()))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* A 1 MiB file as the drive if nothing better was given */
+static int make_backing(options &opt)
+{
+	std::vector<char> buf(1 << 20, 0x5a);
+	int fd;
+
+	opt.backing = opt.standin_dir + "/backing";
+	fd = open(opt.backing.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0644);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+		close(fd);
+		return -EIO;
+	}
+	close(fd);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::thread> threads;
+	std::vector<char> buf;
+	char *io = block(buf);
+	standin sim;
+	samples s;
+	options opt;
+	cycle c;
+	rail power;
+	int err = 0;
+
+	if (parse_options(argc, argv, opt)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (!opt.standin_dir.empty()) {
+		if (mkdir(opt.standin_dir.c_str(), 0755) && errno != EEXIST)
+			err = -errno;
+		if (!err && opt.backing.empty())
+			err = make_backing(opt);
+		if (!err)
+			err = sim.open(opt.standin_dir, opt.backing,
+				       opt.spinup_us, opt.jitter_us);
+		opt.hwmon = sim.hwmon();
+		opt.disk = sim.disk();
+	}
+	if (!err)
+		err = power.open(opt.hwmon);
+	if (err) {
+		fprintf(stderr, "setup failed: %s\n", strerror(-err));
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < opt.requesters; i++)
+		threads.emplace_back(requester, std::cref(opt), std::ref(c),
+				     std::ref(s), i);
+
+	for (unsigned int n = 0; n < opt.cycles && !err; n++) {
+		uint64_t t0, t1, t2;
+
+		err = power.set(false);
+		if (!err)
+			err = wait_gone(opt);
+		if (err)
+			break;
+
+		c.done = 0;
+		t0 = now_ns();
+		err = power.set(true);
+		t1 = now_ns();
+		if (err)
+			break;
+		{
+			std::lock_guard<std::mutex> l(c.lock);
+
+			c.generation++;
+		}
+		c.cv.notify_all();
+
+		read_first(opt, io);
+		t2 = now_ns();
+
+		/* Let the requesters of this cycle finish */
+		while (c.done < opt.requesters)
+			sleep_us(1000);
+
+		s.ttfb.push_back(t2 - t0);
+		s.store.push_back(t1 - t0);
+		if (!opt.standin_dir.empty() &&
+		    t2 - t0 >= sim.last_delay() * 1000)
+			s.overhead.push_back(t2 - t0 - sim.last_delay() * 1000);
+	}
+
+	{
+		std::lock_guard<std::mutex> l(c.lock);
+
+		c.quit = true;
+	}
+	c.cv.notify_all();
+	for (auto &t : threads)
+		t.join();
+	if (err) {
+		fprintf(stderr, "cycle failed: %s\n", strerror(-err));
+		return 1;
+	}
+
+	print("ttfb", s.ttfb);
+	print("store", s.store);
+	print("overhead", s.overhead);
+	print("queued", s.queued);
+
+	return 0;
+}
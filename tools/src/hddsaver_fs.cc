@@ -0,0 +1,1129 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-fs - FUSE overlay of the HDD Saver array
+ *
+ * Mounted over the array's file system (the lower tree). While the
+ * drives are usable every call goes straight to the lower tree, which
+ * is not kept open between calls so it can still be unmounted when
+ * idle. While they are off, writes, creations, truncations, unlinks and
+ * renames of files are staged in a journal on an SSD, see stage.h.
+ * Attributes and directory listings seen while the drives were on answer
+ * lookups meanwhile. Anything else powers the drives on and waits.
+ *
+ * The journal is flushed at the next wake, whoever caused it, or when it
+ * grows past the high-water mark.
+ *
+ * With a read cache, see cache.h, the files opened often while the drives
+ * are on are copied to the SSD as well, and reads of them while the
+ * drives are off are served from there.
+ */
+#define FUSE_USE_VERSION 31
+
+#include "cache.h"
+#include "client.h"
+#include "rail.h"
+#include "stage.h"
+
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <getopt.h>
+#include <mutex>
+#include <set>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace hddsaver;
+
+struct options {
+	client_options power;
+	std::string journal;
+	uint64_t high_water = 256ULL << 20;
+	cache_options cache;
+	std::string stats;
+};
+
+struct fs_state {
+	options opt;
+	std::string lower;
+	client power;
+	stage journal;
+
+	/* Protects everything below, the journal, the cache and the lower tree */
+	read_cache cache;
+	std::mutex lock;
+	std::unordered_map<std::string, struct stat> attrs;
+	std::unordered_map<std::string, std::set<std::string>> listings;
+	struct statvfs vfs;
+	bool have_vfs = false;
+	uint64_t wakes = 0;
+
+	std::mutex flush_lock;
+	std::condition_variable flush_cond;
+	bool want_flush = false;
+	bool stopping = false;
+	std::thread flusher;
+};
+
+static fs_state fs;
+
+static void logmsg(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static std::string lower_path(const char *path)
+{
+	return fs.lower + path;
+}
+
+/* fuse_main() changes to / when it daemonizes */
+static std::string absolute(const std::string &path)
+{
+	char cwd[PATH_MAX];
+
+	if (path.empty() || path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+		return path;
+
+	return std::string(cwd) + "/" + path;
+}
+
+static void split_path(const std::string &path, std::string &dir,
+		       std::string &name)
+{
+	size_t slash = path.rfind('/');
+
+	dir = slash ? path.substr(0, slash) : "/";
+	name = path.substr(slash + 1);
+}
+
+/*
+ * What the lower tree looked like when the drives were last on: 0, or
+ * -ENOENT if the parent's listing lacks the name, -EAGAIN if unknown.
+ */
+static int memo_stat(const std::string &path, struct stat *st)
+{
+	std::string dir, name;
+	auto it = fs.attrs.find(path);
+
+	if (it != fs.attrs.end()) {
+		*st = it->second;
+		return 0;
+	}
+
+	split_path(path, dir, name);
+	auto l = fs.listings.find(dir);
+	if (l != fs.listings.end() && !l->second.count(name))
+		return -ENOENT;
+
+	return -EAGAIN;
+}
+
+static void memo_add(const std::string &path, const struct stat &st)
+{
+	std::string dir, name;
+
+	fs.attrs[path] = st;
+	fs.cache.invalidate(path, &st);
+	split_path(path, dir, name);
+	auto l = fs.listings.find(dir);
+	if (l != fs.listings.end())
+		l->second.insert(name);
+}
+
+static void memo_del(const std::string &path)
+{
+	std::string dir, name;
+
+	fs.attrs.erase(path);
+	fs.listings.erase(path);
+	fs.cache.invalidate(path, nullptr);
+	split_path(path, dir, name);
+	auto l = fs.listings.find(dir);
+	if (l != fs.listings.end())
+		l->second.erase(name);
+}
+
+static void memo_refresh(const std::string &path)
+{
+	struct stat st;
+
+	if (lstat(lower_path(path.c_str()).c_str(), &st))
+		memo_del(path);
+	else
+		memo_add(path, st);
+}
+
+/* Called with fs.lock held and the drives usable */
+static int flush_locked()
+{
+	uint64_t writes = fs.journal.stats().writes;
+	uint64_t bytes = fs.journal.stats().bytes;
+	std::vector<std::string> paths;
+	int err;
+
+	fs.journal.paths(paths);
+	err = fs.journal.flush(fs.lower);
+	if (err) {
+		logmsg("flushing %s failed: %s", fs.opt.journal.c_str(),
+		       strerror(-err));
+		return err;
+	}
+	logmsg("flushed %llu writes, %llu bytes",
+	       (unsigned long long)writes, (unsigned long long)bytes);
+
+	for (const auto &p : paths)
+		memo_refresh(p);
+
+	return 0;
+}
+
+/*
+ * Makes the lower tree usable for the caller: powers the drives on if
+ * needed, with fs.lock dropped meanwhile, and applies the journal first
+ * so the call sees what was staged. The hold lasts as long as guard.
+ */
+static int go_lower(std::unique_lock<std::mutex> &l,
+		    client::hold_guard &guard)
+{
+	int err;
+
+	if (!fs.power.ready()) {
+		if (fs.power.state() == power_state::off)
+			fs.wakes++;
+		l.unlock();
+		guard = fs.power.hold();
+		err = guard.ready().get();
+		l.lock();
+		if (err) {
+			logmsg("powering the drives on failed: %s",
+			       strerror(-err));
+			return -EIO;
+		}
+	}
+	if (!fs.journal.empty())
+		return flush_locked();
+
+	return 0;
+}
+
+static void kick_flush()
+{
+	std::lock_guard<std::mutex> g(fs.flush_lock);
+
+	fs.want_flush = true;
+	fs.flush_cond.notify_one();
+}
+
+/* Copies what the cache admitted, while the drives are on anyway */
+static void fill_cache()
+{
+	std::string path;
+	struct stat st;
+	int err;
+
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> g(fs.lock);
+
+			if (!fs.power.ready() || !fs.cache.next(path))
+				return;
+		}
+
+		/* Without fs.lock, copies can take a while */
+		err = fs.cache.copy(fs.lower, path, st);
+		std::lock_guard<std::mutex> g(fs.lock);
+		if (!err)
+			fs.cache.commit(path, st);
+	}
+}
+
+static void flusher()
+{
+	std::unique_lock<std::mutex> fl(fs.flush_lock);
+
+	for (;;) {
+		fs.flush_cond.wait(fl, [] {
+			return fs.want_flush || fs.stopping;
+		});
+		if (fs.stopping)
+			break;
+		fs.want_flush = false;
+		fl.unlock();
+
+		{
+			std::unique_lock<std::mutex> l(fs.lock);
+			client::hold_guard guard;
+
+			if (!fs.journal.empty())
+				go_lower(l, guard);
+		}
+		fill_cache();
+
+		fl.lock();
+	}
+}
+
+/* Prometheus text format, for the textfile collector of node_exporter */
+static void write_stats()
+{
+	const cache_stats &c = fs.cache.stats();
+	std::string tmp = fs.opt.stats + ".tmp";
+	uint64_t reads = c.hits + c.misses;
+	FILE *f;
+
+	if (fs.opt.stats.empty())
+		return;
+	f = fopen(tmp.c_str(), "we");
+	if (!f)
+		return;
+
+	fprintf(f,
+		"# HELP hddsaver_fs_wakes_total Power ons caused by hddsaver-fs\n"
+		"# TYPE hddsaver_fs_wakes_total counter\n"
+		"hddsaver_fs_wakes_total %llu\n"
+		"# HELP hddsaver_fs_staged_bytes Size of the staging journal\n"
+		"# TYPE hddsaver_fs_staged_bytes gauge\n"
+		"hddsaver_fs_staged_bytes %llu\n",
+		(unsigned long long)fs.wakes,
+		(unsigned long long)fs.journal.bytes());
+	if (fs.cache.is_open())
+		fprintf(f,
+			"# HELP hddsaver_fs_cache_reads_total Reads while the drives were off\n"
+			"# TYPE hddsaver_fs_cache_reads_total counter\n"
+			"hddsaver_fs_cache_reads_total{result=\"hit\"} %llu\n"
+			"hddsaver_fs_cache_reads_total{result=\"miss\"} %llu\n"
+			"# HELP hddsaver_fs_cache_hit_ratio Hits of the reads while the drives were off\n"
+			"# TYPE hddsaver_fs_cache_hit_ratio gauge\n"
+			"hddsaver_fs_cache_hit_ratio %.3f\n"
+			"# HELP hddsaver_fs_cache_hit_bytes_total Bytes read from the cache\n"
+			"# TYPE hddsaver_fs_cache_hit_bytes_total counter\n"
+			"hddsaver_fs_cache_hit_bytes_total %llu\n"
+			"# HELP hddsaver_fs_cache_avoided_wakes_total Periods off that cache hits kept off\n"
+			"# TYPE hddsaver_fs_cache_avoided_wakes_total counter\n"
+			"hddsaver_fs_cache_avoided_wakes_total %llu\n"
+			"# HELP hddsaver_fs_cache_bytes Size of the cached copies\n"
+			"# TYPE hddsaver_fs_cache_bytes gauge\n"
+			"hddsaver_fs_cache_bytes %llu\n"
+			"# HELP hddsaver_fs_cache_files Number of cached copies\n"
+			"# TYPE hddsaver_fs_cache_files gauge\n"
+			"hddsaver_fs_cache_files %llu\n"
+			"# HELP hddsaver_fs_cache_admitted_total Copies made\n"
+			"# TYPE hddsaver_fs_cache_admitted_total counter\n"
+			"hddsaver_fs_cache_admitted_total %llu\n"
+			"# HELP hddsaver_fs_cache_evicted_total Copies dropped for room\n"
+			"# TYPE hddsaver_fs_cache_evicted_total counter\n"
+			"hddsaver_fs_cache_evicted_total %llu\n",
+			(unsigned long long)c.hits, (unsigned long long)c.misses,
+			reads ? (double)c.hits / reads : 0.0,
+			(unsigned long long)c.hit_bytes,
+			(unsigned long long)c.avoided_wakes,
+			(unsigned long long)c.bytes, (unsigned long long)c.files,
+			(unsigned long long)c.admitted,
+			(unsigned long long)c.evicted);
+
+	if (fclose(f) || rename(tmp.c_str(), fs.opt.stats.c_str()))
+		unlink(tmp.c_str());
+}
+
+static void fill_staged(const staged_file *f, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = (f->dir ? S_IFDIR : S_IFREG) | (f->mode & 07777);
+	st->st_nlink = f->dir ? 2 : 1;
+	st->st_uid = f->uid;
+	st->st_gid = f->gid;
+	st->st_size = f->size;
+	st->st_blksize = 4096;
+	st->st_blocks = (f->size + 511) / 512;
+	st->st_atime = st->st_mtime = st->st_ctime = f->mtime;
+}
+
+/* Each call tries the journal while the drives are off, -EAGAIN if not */
+static int staged_getattr(const char *path, struct stat *st)
+{
+	const staged_file *f = fs.journal.find(path);
+	int err;
+
+	if (!f)
+		return memo_stat(path, st);
+	if (f->whiteout)
+		return -ENOENT;
+	if (f->created) {
+		fill_staged(f, st);
+		return 0;
+	}
+
+	err = memo_stat(f->base, st);
+	if (err)
+		return err == -ENOENT ? -EAGAIN : err;
+	st->st_size = f->size_over(st->st_size);
+	st->st_blocks = (st->st_size + 511) / 512;
+	st->st_mtime = st->st_ctime = f->mtime;
+
+	return 0;
+}
+
+static int fs_getattr(const char *path, struct stat *st,
+		      struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	int err;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, st);
+		if (err != -EAGAIN)
+			return err;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (lstat(lower_path(path).c_str(), st)) {
+		err = -errno;
+		if (err == -ENOENT)
+			memo_del(path);
+		return err;
+	}
+	memo_add(path, *st);
+
+	return 0;
+}
+
+static int staged_readdir(const char *path, std::set<std::string> &names)
+{
+	std::vector<std::pair<std::string, const staged_file *>> staged;
+	const staged_file *f = fs.journal.find(path);
+
+	if (f && f->whiteout)
+		return -ENOENT;
+	if (!f || !f->created) {
+		auto l = fs.listings.find(f ? f->base : path);
+
+		if (l == fs.listings.end())
+			return -EAGAIN;
+		names = l->second;
+	}
+
+	fs.journal.children(path, staged);
+	for (const auto &s : staged) {
+		if (s.second->whiteout)
+			names.erase(s.first);
+		else
+			names.insert(s.first);
+	}
+
+	return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t, struct fuse_file_info *, enum fuse_readdir_flags)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	std::set<std::string> names;
+	struct dirent *de;
+	DIR *dir;
+	int err = -EAGAIN;
+
+	if (!fs.power.ready())
+		err = staged_readdir(path, names);
+	if (err == -EAGAIN) {
+		err = go_lower(l, guard);
+		if (err)
+			return err;
+
+		dir = opendir(lower_path(path).c_str());
+		if (!dir)
+			return -errno;
+		while ((de = readdir(dir)) != nullptr)
+			if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+				names.insert(de->d_name);
+		closedir(dir);
+		fs.listings[path] = names;
+	} else if (err) {
+		return err;
+	}
+
+	filler(buf, ".", nullptr, 0, (enum fuse_fill_dir_flags)0);
+	filler(buf, "..", nullptr, 0, (enum fuse_fill_dir_flags)0);
+	for (const auto &name : names)
+		if (filler(buf, name.c_str(), nullptr, 0,
+			   (enum fuse_fill_dir_flags)0))
+			break;
+
+	return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	int err, fd;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, &st);
+		if (err != -EAGAIN)
+			return err;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	/* Only checks, the file is opened again by each call */
+	fd = open(lower_path(path).c_str(),
+		  fi->flags & ~(O_CREAT | O_EXCL | O_TRUNC));
+	if (fd < 0)
+		return -errno;
+	if (!fstat(fd, &st)) {
+		fs.cache.note_open(path, st);
+		if (fs.cache.pending())
+			kick_flush();
+	}
+	close(fd);
+
+	return 0;
+}
+
+/* Staged data first, then the copy in the read cache */
+static ssize_t staged_read(const char *path, char *buf, size_t size,
+			   off_t off)
+{
+	const staged_file *f = fs.journal.find(path);
+	std::string base = f ? f->base : path;
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	if (f && f->whiteout)
+		return -ENOENT;
+	st.st_size = 0;
+	if ((!f || !f->created) && memo_stat(base, &st))
+		return -EAGAIN;
+	if (f) {
+		len = fs.journal.read(path, buf, size, off, st.st_size, -1);
+		if (len != -EAGAIN || f->created)
+			return len;
+	}
+
+	fd = fs.cache.open_copy(base, st);
+	if (fd < 0)
+		return -EAGAIN;
+	if (f)
+		len = fs.journal.read(path, buf, size, off, st.st_size, fd);
+	else if ((len = pread(fd, buf, size, off)) < 0)
+		len = -errno;
+	close(fd);
+	if (len >= 0)
+		fs.cache.note_hit(base, len);
+
+	return len;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t off,
+		   struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	ssize_t len;
+	int err, fd;
+
+	if (!fs.power.ready()) {
+		len = staged_read(path, buf, size, off);
+		if (len != -EAGAIN)
+			return len;
+		fs.cache.note_miss(path,
+				   fs.power.state() == power_state::off);
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	fd = open(lower_path(path).c_str(), O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = pread(fd, buf, size, off);
+	err = errno;
+	close(fd);
+
+	return len < 0 ? -err : len;
+}
+
+static int fs_write(const char *path, const char *buf, size_t size,
+		    off_t off, struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	ssize_t len;
+	int err, fd;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, &st);
+		if (!err)
+			err = fs.journal.write(path, buf, size, off);
+		if (!err && fs.journal.bytes() >= fs.opt.high_water)
+			kick_flush();
+		if (err != -EAGAIN)
+			return err ? err : (int)size;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	fd = open(lower_path(path).c_str(), O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	len = pwrite(fd, buf, size, off);
+	err = errno;
+	close(fd);
+	if (len < 0)
+		return -err;
+	memo_refresh(path);
+
+	return len;
+}
+
+static int fs_truncate(const char *path, off_t size,
+		       struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	int err;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, &st);
+		if (!err)
+			err = S_ISREG(st.st_mode) ?
+			      fs.journal.truncate(path, size) : -EAGAIN;
+		if (err != -EAGAIN)
+			return err;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (truncate(lower_path(path).c_str(), size))
+		return -errno;
+	memo_refresh(path);
+
+	return 0;
+}
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	int err, fd;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, &st);
+		if (err == -ENOENT)
+			return fs.journal.create(path, mode, ctx->uid, ctx->gid);
+		if (!err)
+			return -EEXIST;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	fd = open(lower_path(path).c_str(), (fi->flags | O_CREAT) & ~O_TRUNC,
+		  mode);
+	if (fd < 0)
+		return -errno;
+	err = fchown(fd, ctx->uid, ctx->gid) ? -errno : 0;
+	close(fd);
+	memo_refresh(path);
+
+	return err;
+}
+
+static int fs_mkdir(const char *path, mode_t mode)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	int err;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, &st);
+		if (err == -ENOENT)
+			return fs.journal.mkdir(path, mode, ctx->uid, ctx->gid);
+		if (!err)
+			return -EEXIST;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (mkdir(lower_path(path).c_str(), mode))
+		return -errno;
+	err = chown(lower_path(path).c_str(), ctx->uid, ctx->gid) ? -errno : 0;
+	memo_refresh(path);
+
+	return err;
+}
+
+static int fs_unlink(const char *path)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	int err;
+
+	if (!fs.power.ready()) {
+		err = staged_getattr(path, &st);
+		if (!err)
+			err = S_ISDIR(st.st_mode) ? -EISDIR :
+			      fs.journal.unlink(path);
+		if (err != -EAGAIN)
+			return err;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (unlink(lower_path(path).c_str()))
+		return -errno;
+	memo_del(path);
+
+	return 0;
+}
+
+/* Only directories made while the drives were off are staged */
+static int fs_rmdir(const char *path)
+{
+	std::vector<std::pair<std::string, const staged_file *>> children;
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	const staged_file *f;
+	int err;
+
+	if (!fs.power.ready() && (f = fs.journal.find(path)) != nullptr &&
+	    f->created && f->dir) {
+		fs.journal.children(path, children);
+		for (const auto &c : children)
+			if (!c.second->whiteout)
+				return -ENOTEMPTY;
+		return fs.journal.unlink(path);
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (rmdir(lower_path(path).c_str()))
+		return -errno;
+	memo_del(path);
+
+	return 0;
+}
+
+static int fs_rename(const char *from, const char *to, unsigned int flags)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	struct stat st;
+	int err;
+
+	/* Files only, directories would move their whole subtree */
+	if (!fs.power.ready() && !flags) {
+		err = staged_getattr(from, &st);
+		if (!err && !S_ISREG(st.st_mode))
+			err = -EAGAIN;
+		if (!err) {
+			err = staged_getattr(to, &st);
+			if (err == -ENOENT || (!err && S_ISREG(st.st_mode)))
+				err = fs.journal.rename(from, to);
+			else if (!err)
+				err = -EAGAIN;
+		}
+		if (err != -EAGAIN)
+			return err;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (renameat2(AT_FDCWD, lower_path(from).c_str(), AT_FDCWD,
+		      lower_path(to).c_str(), flags))
+		return -errno;
+	memo_del(from);
+	memo_refresh(to);
+
+	return 0;
+}
+
+/* Staged files get their times when flushed */
+static int fs_utimens(const char *path, const struct timespec tv[2],
+		      struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	const staged_file *f;
+	int err;
+
+	if (!fs.power.ready() && (f = fs.journal.find(path)) != nullptr)
+		return f->whiteout ? -ENOENT : 0;
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (utimensat(AT_FDCWD, lower_path(path).c_str(), tv,
+		      AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	memo_refresh(path);
+
+	return 0;
+}
+
+static int fs_chmod(const char *path, mode_t mode, struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	int err = go_lower(l, guard);
+
+	if (err)
+		return err;
+	if (chmod(lower_path(path).c_str(), mode))
+		return -errno;
+	memo_refresh(path);
+
+	return 0;
+}
+
+static int fs_chown(const char *path, uid_t uid, gid_t gid,
+		    struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	int err = go_lower(l, guard);
+
+	if (err)
+		return err;
+	if (lchown(lower_path(path).c_str(), uid, gid))
+		return -errno;
+	memo_refresh(path);
+
+	return 0;
+}
+
+static int fs_readlink(const char *path, char *buf, size_t size)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	ssize_t len;
+	int err = go_lower(l, guard);
+
+	if (err)
+		return err;
+	len = readlink(lower_path(path).c_str(), buf, size - 1);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+static int fs_symlink(const char *target, const char *path)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	int err = go_lower(l, guard);
+
+	if (err)
+		return err;
+	if (symlink(target, lower_path(path).c_str()))
+		return -errno;
+	memo_refresh(path);
+
+	return 0;
+}
+
+static int fs_link(const char *from, const char *to)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	int err = go_lower(l, guard);
+
+	if (err)
+		return err;
+	if (link(lower_path(from).c_str(), lower_path(to).c_str()))
+		return -errno;
+	memo_refresh(from);
+	memo_refresh(to);
+
+	return 0;
+}
+
+static int fs_statfs(const char *, struct statvfs *st)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	client::hold_guard guard;
+	int err;
+
+	if (!fs.power.ready() && fs.have_vfs) {
+		*st = fs.vfs;
+		return 0;
+	}
+	err = go_lower(l, guard);
+	if (err)
+		return err;
+
+	if (statvfs(fs.lower.c_str(), st))
+		return -errno;
+	fs.vfs = *st;
+	fs.have_vfs = true;
+
+	return 0;
+}
+
+static int fs_fsync(const char *path, int, struct fuse_file_info *)
+{
+	std::unique_lock<std::mutex> l(fs.lock);
+	int fd, err;
+
+	/* Staged data is safe once the journal is */
+	if (fs.journal.find(path))
+		return fs.journal.sync();
+	if (!fs.power.ready())
+		return 0;
+
+	fd = open(lower_path(path).c_str(), O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	err = fsync(fd) ? -errno : 0;
+	close(fd);
+
+	return err;
+}
+
+/* Threads are started here, fuse_main() may have forked in between */
+static void *fs_init(struct fuse_conn_info *, struct fuse_config *cfg)
+{
+	int err;
+
+	cfg->use_ino = 0;
+	cfg->hard_remove = 1;
+
+	fs.power.on_change([](power_state state) {
+		{
+			std::lock_guard<std::mutex> g(fs.lock);
+
+			fs.cache.power_changed(state == power_state::off);
+			write_stats();
+		}
+		if (state == power_state::active)
+			kick_flush();
+	});
+	err = fs.power.open(fs.opt.power);
+	if (err) {
+		logmsg("no HDD Saver: %s", strerror(-err));
+		exit(1);
+	}
+	fs.flusher = std::thread(flusher);
+	if (!fs.journal.empty())
+		kick_flush();
+
+	return nullptr;
+}
+
+static void fs_destroy(void *)
+{
+	{
+		std::lock_guard<std::mutex> g(fs.flush_lock);
+
+		fs.stopping = true;
+		fs.flush_cond.notify_one();
+	}
+	if (fs.flusher.joinable())
+		fs.flusher.join();
+	fs.power.close();
+	logmsg("%llu wakes, %llu flushes, %llu bytes staged",
+	       (unsigned long long)fs.wakes,
+	       (unsigned long long)fs.journal.stats().flushes,
+	       (unsigned long long)fs.journal.stats().flushed_bytes);
+	if (fs.cache.is_open())
+		logmsg("%llu cache hits, %llu misses, %llu wakes avoided",
+		       (unsigned long long)fs.cache.stats().hits,
+		       (unsigned long long)fs.cache.stats().misses,
+		       (unsigned long long)fs.cache.stats().avoided_wakes);
+	write_stats();
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] LOWER MOUNTPOINT [FUSE options]\n"
+		"  -j, --journal FILE    staging journal, on an SSD (required)\n"
+		"  -w, --high-water MB   flush when the journal grows past MB (256)\n"
+		"  -c, --cache DIR       read cache, on an SSD (default: none)\n"
+		"  -C, --cache-size MB   size of the read cache (1024)\n"
+		"      --cache-max-file MB  largest file cached (64)\n"
+		"      --admit N         cache files opened in N periods on (2)\n"
+		"  -s, --stats FILE      write statistics to FILE, Prometheus format\n"
+		"  -H, --hwmon DIR       hwmon directory (default: autodetect)\n"
+		"  -d, --disks LIST      drives of the array (default: hddsaver_disks)\n"
+		"  -l, --lock PATH       hold lock file (" HOLD_LOCK_PATH ")\n",
+		prog);
+}
+
+enum {
+	OPT_CACHE_MAX = 256,
+	OPT_ADMIT,
+};
+
+static int parse_options(int argc, char **argv, options &opt)
+{
+	static const struct option longopts[] = {
+		{ "journal",	required_argument, nullptr, 'j' },
+		{ "high-water",	required_argument, nullptr, 'w' },
+		{ "cache",	required_argument, nullptr, 'c' },
+		{ "cache-size",	required_argument, nullptr, 'C' },
+		{ "cache-max-file", required_argument, nullptr, OPT_CACHE_MAX },
+		{ "admit",	required_argument, nullptr, OPT_ADMIT },
+		{ "stats",	required_argument, nullptr, 's' },
+		{ "hwmon",	required_argument, nullptr, 'H' },
+		{ "disks",	required_argument, nullptr, 'd' },
+		{ "lock",	required_argument, nullptr, 'l' },
+		{ "help",	no_argument,	   nullptr, 'h' },
+		{}
+	};
+	int c;
+
+	/* What follows LOWER is for FUSE */
+	while ((c = getopt_long(argc, argv, "+j:w:c:C:s:H:d:l:h", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 'j':
+			opt.journal = optarg;
+			break;
+		case 'w':
+			opt.high_water = strtoull(optarg, nullptr, 0) << 20;
+			break;
+		case 'c':
+			opt.cache.dir = optarg;
+			break;
+		case 'C':
+			opt.cache.size = strtoull(optarg, nullptr, 0) << 20;
+			break;
+		case OPT_CACHE_MAX:
+			opt.cache.max_file = strtoull(optarg, nullptr, 0) << 20;
+			break;
+		case OPT_ADMIT:
+			opt.cache.admit = strtoul(optarg, nullptr, 0);
+			break;
+		case 's':
+			opt.stats = optarg;
+			break;
+		case 'H':
+			opt.power.hwmon = optarg;
+			break;
+		case 'd':
+			opt.power.disks = split_list(optarg);
+			break;
+		case 'l':
+			opt.power.lock = optarg;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (opt.journal.empty() || argc - optind < 2)
+		return -EINVAL;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static struct fuse_operations ops;
+	std::vector<char *> fuse_argv;
+	char *real;
+	int err;
+
+	if (parse_options(argc, argv, fs.opt)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	real = realpath(argv[optind], nullptr);
+	if (!real) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fs.lower = real;
+	free(real);
+	if (fs.lower == "/")
+		fs.lower.clear();
+
+	err = fs.journal.open(fs.opt.journal);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", fs.opt.journal.c_str(),
+			strerror(-err));
+		return 1;
+	}
+	fs.opt.stats = absolute(fs.opt.stats);
+	fs.opt.cache.dir = absolute(fs.opt.cache.dir);
+	if (!fs.opt.cache.dir.empty()) {
+		err = fs.cache.open(fs.opt.cache);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", fs.opt.cache.dir.c_str(),
+				strerror(-err));
+			return 1;
+		}
+	}
+	if (!fs.journal.empty())
+		logmsg("%llu bytes staged in %s",
+		       (unsigned long long)fs.journal.stats().bytes,
+		       fs.opt.journal.c_str());
+
+	ops.getattr = fs_getattr;
+	ops.readlink = fs_readlink;
+	ops.mkdir = fs_mkdir;
+	ops.unlink = fs_unlink;
+	ops.rmdir = fs_rmdir;
+	ops.symlink = fs_symlink;
+	ops.rename = fs_rename;
+	ops.link = fs_link;
+	ops.chmod = fs_chmod;
+	ops.chown = fs_chown;
+	ops.truncate = fs_truncate;
+	ops.open = fs_open;
+	ops.read = fs_read;
+	ops.write = fs_write;
+	ops.statfs = fs_statfs;
+	ops.fsync = fs_fsync;
+	ops.readdir = fs_readdir;
+	ops.init = fs_init;
+	ops.destroy = fs_destroy;
+	ops.create = fs_create;
+	ops.utimens = fs_utimens;
+
+	fuse_argv.push_back(argv[0]);
+	for (int i = optind + 1; i < argc; i++)
+		fuse_argv.push_back(argv[i]);
+
+	return fuse_main(fuse_argv.size(), fuse_argv.data(), &ops, nullptr);
+}
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-hold - keeps the HDD Saver drives powered while a command runs
+ *
+ * Powers the drives on, waits until they are usable and runs the command
+ * under a hold, so neither hddsaverd nor another client cuts the power
+ * before it exits. Meant for backup jobs and the like.
+ *
+ * With --defer, a job that finds the drives off waits for them to come
+ * on for some other reason first, so it needs no wake of its own.
+ */
+#include "client.h"
+#include "rail.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <mutex>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace hddsaver;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] COMMAND [ARG]...\n"
+		"  -H, --hwmon DIR       hwmon directory (default: autodetect)\n"
+		"  -d, --disks LIST      drives to wait for (default: hddsaver_disks)\n"
+		"  -D, --defer SEC       if off, wait up to SEC for another wake first\n"
+		"  -l, --lock PATH       hold lock file (" HOLD_LOCK_PATH ")\n"
+		"  -t, --timeout SEC     give up if not ready after SEC seconds (60)\n",
+		prog);
+}
+
+static int parse_options(int argc, char **argv, client_options &opt,
+			 unsigned int &defer)
+{
+	static const struct option longopts[] = {
+		{ "hwmon",	required_argument, nullptr, 'H' },
+		{ "disks",	required_argument, nullptr, 'd' },
+		{ "defer",	required_argument, nullptr, 'D' },
+		{ "lock",	required_argument, nullptr, 'l' },
+		{ "timeout",	required_argument, nullptr, 't' },
+		{ "help",	no_argument,	   nullptr, 'h' },
+		{}
+	};
+	int c;
+
+	/* Options of the command are its own */
+	while ((c = getopt_long(argc, argv, "+H:d:D:l:t:h", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 'H':
+			opt.hwmon = optarg;
+			break;
+		case 'd':
+			opt.disks = split_list(optarg);
+			break;
+		case 'D':
+			defer = strtoul(optarg, nullptr, 0);
+			break;
+		case 'l':
+			opt.lock = optarg;
+			break;
+		case 't':
+			opt.ready_timeout_ms = strtoul(optarg, nullptr, 0) * 1000;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return optind < argc ? 0 : -EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+	client_options opt;
+	std::condition_variable changed;
+	std::mutex lock;
+	unsigned int defer = 0;
+	client c;
+	pid_t pid;
+	int err, status;
+
+	if (parse_options(argc, argv, opt, defer)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	c.on_change([&](power_state) {
+		std::lock_guard<std::mutex> g(lock);
+
+		changed.notify_all();
+	});
+	err = c.open(opt);
+	if (err) {
+		fprintf(stderr, "setup failed: %s\n", strerror(-err));
+		return 1;
+	}
+
+	if (defer && c.state() == power_state::off) {
+		std::unique_lock<std::mutex> l(lock);
+
+		if (!changed.wait_for(l, std::chrono::seconds(defer), [&c] {
+			return c.state() != power_state::off;
+		}))
+			fprintf(stderr, "deferred for %u s, powering on\n",
+				defer);
+	}
+
+	client::hold_guard hold = c.hold();
+	auto start = std::chrono::steady_clock::now();
+
+	err = hold.ready().get();
+	if (err) {
+		fprintf(stderr, "drives not ready: %s\n", strerror(-err));
+		return 1;
+	}
+	fprintf(stderr, "drives ready after %.1f s\n",
+		std::chrono::duration<double>(std::chrono::steady_clock::now() -
+					      start).count());
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!pid) {
+		execvp(argv[optind], argv + optind);
+		perror(argv[optind]);
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			return 1;
+		}
+	}
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+
+	return WEXITSTATUS(status);
+}
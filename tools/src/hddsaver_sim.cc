@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-sim - energy and latency of power policies on recorded traces
+ *
+ * Every combination of the given standby and off delays is replayed
+ * against the traces, spread over all CPUs. The trace is reduced to
+ * bursts once, so a variant costs time in the number of idle periods,
+ * not in the number of requests.
+ */
+#include "sim.h"
+#include "trace.h"
+#include "trace_file.h"
+#include "rail.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <thread>
+
+using namespace hddsaver;
+
+struct options {
+	power_model model;
+	std::vector<uint64_t> standby = { 0 };
+	std::vector<uint64_t> off = { 0 };
+	std::vector<std::string> disks;
+	unsigned int jobs = 0;
+	char action = 'D';
+};
+
+/* Comma separated seconds or first:last:step ranges, "0,60,600:7200:600" */
+static int parse_delays(const char *s, std::vector<uint64_t> &out)
+{
+	out.clear();
+	for (const auto &item : split_list(s)) {
+		unsigned long long first, last, step;
+		char *end;
+
+		if (sscanf(item.c_str(), "%llu:%llu:%llu", &first, &last,
+			   &step) == 3) {
+			if (!step || last < first)
+				return -EINVAL;
+			for (uint64_t v = first; v <= last; v += step)
+				out.push_back(v);
+			continue;
+		}
+
+		out.push_back(strtoull(item.c_str(), &end, 0));
+		if (*end)
+			return -EINVAL;
+	}
+
+	return out.empty() ? -EINVAL : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] TRACE...\n"
+		"  -s, --standby LIST     standby delays in seconds, 0 never (0)\n"
+		"  -o, --off LIST         power off delays in seconds, 0 never (0)\n"
+		"                         LIST items are seconds or first:last:step\n"
+		"  -d, --disks LIST       only requests of these devices\n"
+		"  -a, --action C         blkparse action to replay (D)\n"
+		"  -j, --jobs N           threads (all CPUs)\n"
+		"  -n, --drives N         drives on the connector (1)\n"
+		"      --watts-spin W     per drive (5.0)\n"
+		"      --watts-standby W  per drive (0.8)\n"
+		"      --watts-off W      per drive (0.0)\n"
+		"      --watts-spinup W   per drive while spinning up (20.0)\n"
+		"      --spinup SEC       standby to ready (8.0)\n"
+		"      --poweron SEC      power off to ready (15.0)\n"
+		"Traces are hddsaver-trace files, or blkparse or hddsaver-activity\n"
+		"output, - for stdin.\n",
+		prog);
+}
+
+enum {
+	OPT_WATTS_SPIN = 256,
+	OPT_WATTS_STANDBY,
+	OPT_WATTS_OFF,
+	OPT_WATTS_SPINUP,
+	OPT_SPINUP,
+	OPT_POWERON,
+};
+
+static int parse_options(int argc, char **argv, options &opt)
+{
+	static const struct option longopts[] = {
+		{ "standby",	   required_argument, nullptr, 's' },
+		{ "off",	   required_argument, nullptr, 'o' },
+		{ "disks",	   required_argument, nullptr, 'd' },
+		{ "action",	   required_argument, nullptr, 'a' },
+		{ "jobs",	   required_argument, nullptr, 'j' },
+		{ "drives",	   required_argument, nullptr, 'n' },
+		{ "watts-spin",	   required_argument, nullptr, OPT_WATTS_SPIN },
+		{ "watts-standby", required_argument, nullptr, OPT_WATTS_STANDBY },
+		{ "watts-off",	   required_argument, nullptr, OPT_WATTS_OFF },
+		{ "watts-spinup",  required_argument, nullptr, OPT_WATTS_SPINUP },
+		{ "spinup",	   required_argument, nullptr, OPT_SPINUP },
+		{ "poweron",	   required_argument, nullptr, OPT_POWERON },
+		{ "help",	   no_argument,	      nullptr, 'h' },
+		{}
+	};
+	power_model &m = opt.model;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "s:o:d:a:j:n:h", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 's':
+			if (parse_delays(optarg, opt.standby))
+				return -EINVAL;
+			break;
+		case 'o':
+			if (parse_delays(optarg, opt.off))
+				return -EINVAL;
+			break;
+		case 'd':
+			opt.disks = split_list(optarg);
+			break;
+		case 'a':
+			opt.action = optarg[0];
+			break;
+		case 'j':
+			opt.jobs = strtoul(optarg, nullptr, 0);
+			break;
+		case 'n':
+			m.drives = strtoul(optarg, nullptr, 0);
+			break;
+		case OPT_WATTS_SPIN:
+			m.watts_spin = strtod(optarg, nullptr);
+			break;
+		case OPT_WATTS_STANDBY:
+			m.watts_standby = strtod(optarg, nullptr);
+			break;
+		case OPT_WATTS_OFF:
+			m.watts_off = strtod(optarg, nullptr);
+			break;
+		case OPT_WATTS_SPINUP:
+			m.watts_spinup = strtod(optarg, nullptr);
+			break;
+		case OPT_SPINUP:
+			m.spinup = strtod(optarg, nullptr);
+			break;
+		case OPT_POWERON:
+			m.poweron = strtod(optarg, nullptr);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return optind < argc ? 0 : -EINVAL;
+}
+
+static int load(const char *path, trace &t, char action)
+{
+	FILE *f;
+	long skipped;
+
+	if (strcmp(path, "-") && is_trace_file(path)) {
+		trace_file tf;
+		int err = tf.open(path);
+
+		if (!err)
+			tf.read(0, UINT64_MAX, t);
+		return err;
+	}
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f)
+		return -errno;
+	skipped = read_text_trace(f, t, action);
+	if (f != stdin)
+		fclose(f);
+	if (skipped < 0)
+		return skipped;
+	if (skipped)
+		fprintf(stderr, "%s: %ld lines skipped\n", path, skipped);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<sim_result> results;
+	std::vector<policy> policies;
+	std::vector<std::thread> threads;
+	std::vector<bool> use_dev;
+	std::atomic<size_t> next{ 0 };
+	uint64_t merge = UINT64_MAX;
+	options opt;
+	trace t;
+	int err;
+
+	if (parse_options(argc, argv, opt)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		err = load(argv[i], t, opt.action);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(-err));
+			return 1;
+		}
+	}
+
+	/* Traces given one after another are replayed as one */
+	std::stable_sort(t.events.begin(), t.events.end(),
+			 [](const trace_event &a, const trace_event &b) {
+				 return a.ts < b.ts;
+			 });
+
+	for (const auto &name : t.devs)
+		use_dev.push_back(opt.disks.empty() ||
+				  std::find(opt.disks.begin(), opt.disks.end(),
+					    name) != opt.disks.end());
+
+	for (uint64_t s : opt.standby) {
+		for (uint64_t o : opt.off) {
+			policies.push_back({ s, o });
+			if (s)
+				merge = std::min(merge, s * 1000000000);
+			if (o)
+				merge = std::min(merge, o * 1000000000);
+		}
+	}
+
+	burst_trace bt(t, use_dev, merge,
+		       std::max(opt.model.spinup, opt.model.poweron) * 1e9);
+	t = trace();
+
+	if (!opt.jobs)
+		opt.jobs = std::max(1U, std::thread::hardware_concurrency());
+	opt.jobs = std::min<size_t>(opt.jobs, policies.size());
+
+	results.resize(policies.size());
+	for (unsigned int i = 0; i < opt.jobs; i++) {
+		threads.emplace_back([&] {
+			std::vector<uint32_t> hist;
+			size_t n;
+
+			while ((n = next++) < policies.size())
+				results[n] = simulate(bt, opt.model,
+						      policies[n], hist);
+		});
+	}
+	for (auto &th : threads)
+		th.join();
+
+	fprintf(stderr, "%llu requests in %zu bursts, %zu policies\n",
+		(unsigned long long)bt.requests(), bt.size(), policies.size());
+
+	printf("%-8s %-8s %10s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+	       "standby", "off", "kWh", "avg_W", "standby", "poweron",
+	       "unloads", "p50_s", "p99_s", "p99.9_s", "max_s");
+	for (size_t i = 0; i < policies.size(); i++) {
+		const sim_result &r = results[i];
+
+		printf("%-8llu %-8llu %10.3f %8.2f %8llu %8llu %8llu %8.2f %8.2f %8.2f %8.2f\n",
+		       (unsigned long long)policies[i].standby_delay,
+		       (unsigned long long)policies[i].off_delay,
+		       r.joules / 3.6e6,
+		       r.seconds ? r.joules / r.seconds : 0,
+		       (unsigned long long)r.standby_wakes,
+		       (unsigned long long)r.off_wakes,
+		       (unsigned long long)r.head_unloads,
+		       r.latency_p50, r.latency_p99, r.latency_p999,
+		       r.latency_max);
+	}
+
+	return 0;
+}
@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-stress - drives the HDD Saver logic against the NCT6791D model
+ *
+ * Worker threads switch the rail on and off at random and check that the
+ * cached state matches the model, contender threads use another logical
+ * device through the same ports like a second driver would. Faults and
+ * port latency come from the model. The exit status is 1 if an invariant
+ * broke:
+ *
+ *   rail_mismatch   hddsaver_status differs from LD 8 CR 0xf1 bit 0
+ *   clobbered_bits  other bits of CR 0xf1 changed
+ *   torn_accesses   a data port access used another thread's index
+ */
+#include "sio_logic.h"
+#include "sio_model.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <thread>
+#include <vector>
+
+using namespace hddsaver;
+
+#define LAT_BUCKETS	40
+
+struct options {
+	unsigned int threads = 4;
+	unsigned int contenders = 1;
+	uint64_t ops = 1000000;
+	uint64_t latency = 0;
+	uint64_t seed = 1;
+	sio_faults faults = {};
+	bool toggle = false;
+	bool no_lock = false;
+	bool no_region = false;
+};
+
+struct worker_stats {
+	uint64_t stores = 0;
+	uint64_t errors = 0;
+	uint64_t mismatches = 0;
+	uint64_t lat[LAT_BUCKETS] = {};
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t &x)
+{
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Under both locks nobody is between sio_enter() and the status update,
+ * unless the workers were told not to take them.
+ */
+static bool consistent(struct nct6775_data *data, nct6791d_model &model)
+{
+	std::lock_guard<std::mutex> l1(data->hddsaver_lock);
+	std::lock_guard<std::mutex> l2(data->update_lock);
+
+	return model.rail() == data->hddsaver_status;
+}
+
+static void worker(const options &opt, struct nct6775_data *data,
+		   nct6791d_model &model, worker_stats &ws, unsigned int id)
+{
+	uint64_t x = opt.seed * 0x9e3779b97f4a7c15ULL + id + 1;
+
+	for (uint64_t i = 0; i < opt.ops; i++) {
+		uint64_t r = next_rand(x), t0, ns;
+		bool val = r >> 63;
+		int err, bucket;
+
+		/* One in sixteen checks, the rest switch */
+		if ((r & 15) == 0) {
+			if (!consistent(data, model))
+				ws.mismatches++;
+			continue;
+		}
+
+		t0 = now_ns();
+		if (opt.toggle)
+			err = store_hddsaver_toggle(data, val);
+		else
+			err = nct6775_hddsaver_power(data, val);
+		ns = now_ns() - t0;
+
+		ws.stores++;
+		if (err)
+			ws.errors++;
+		bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+		ws.lat[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1]++;
+	}
+}
+
+static void contender(nct6791d_model &model, std::atomic<bool> &done)
+{
+	uint8_t val = 0;
+
+	while (!done) {
+		if (model.superio_enter())
+			continue;
+		model.superio_select(NCT6775_LD_HWM);
+		val = model.superio_inb(0x30) + 1;
+		model.superio_outb(0x30, val);
+		model.superio_exit();
+	}
+}
+
+/* Upper bound of the log2 bucket holding the p-th store */
+static uint64_t lat_percentile(const uint64_t *lat, uint64_t total, double p)
+{
+	uint64_t rank = p * total, seen = 0;
+
+	for (int i = 0; i < LAT_BUCKETS; i++) {
+		seen += lat[i];
+		if (seen > rank || seen == total)
+			return i ? 1ULL << i : 1;
+	}
+
+	return 1ULL << (LAT_BUCKETS - 1);
+}
+
+static int parse_faults(char *s, sio_faults &f)
+{
+	for (char *tok = strtok(s, ","); tok; tok = strtok(nullptr, ",")) {
+		char *eq = strchr(tok, '=');
+		double p;
+
+		if (!eq)
+			return -EINVAL;
+		*eq = '\0';
+		p = strtod(eq + 1, nullptr);
+		if (!strcmp(tok, "busy"))
+			f.busy = p;
+		else if (!strcmp(tok, "flip"))
+			f.flip = p;
+		else if (!strcmp(tok, "drop"))
+			f.drop = p;
+		else
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t, --threads N        threads switching the rail (4)\n"
+		"  -c, --contenders N     threads using LD 0x0b meanwhile (1)\n"
+		"  -n, --ops N            operations per thread (1000000)\n"
+		"  -l, --latency NS       per port access (0)\n"
+		"  -f, --faults LIST      busy=P,flip=P,drop=P probabilities\n"
+		"  -s, --seed N           (1)\n"
+		"      --toggle           store_hddsaver() of patch 0001\n"
+		"      --no-lock          skip update_lock and the HDD Saver lock\n"
+		"      --no-region        skip request_muxed_region()\n",
+		prog);
+}
+
+enum {
+	OPT_TOGGLE = 256,
+	OPT_NO_LOCK,
+	OPT_NO_REGION,
+};
+
+static int parse_options(int argc, char **argv, options &opt)
+{
+	static const struct option longopts[] = {
+		{ "threads",	required_argument, nullptr, 't' },
+		{ "contenders",	required_argument, nullptr, 'c' },
+		{ "ops",	required_argument, nullptr, 'n' },
+		{ "latency",	required_argument, nullptr, 'l' },
+		{ "faults",	required_argument, nullptr, 'f' },
+		{ "seed",	required_argument, nullptr, 's' },
+		{ "toggle",	no_argument,	   nullptr, OPT_TOGGLE },
+		{ "no-lock",	no_argument,	   nullptr, OPT_NO_LOCK },
+		{ "no-region",	no_argument,	   nullptr, OPT_NO_REGION },
+		{ "help",	no_argument,	   nullptr, 'h' },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "t:c:n:l:f:s:h", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 't':
+			opt.threads = strtoul(optarg, nullptr, 0);
+			break;
+		case 'c':
+			opt.contenders = strtoul(optarg, nullptr, 0);
+			break;
+		case 'n':
+			opt.ops = strtoull(optarg, nullptr, 0);
+			break;
+		case 'l':
+			opt.latency = strtoull(optarg, nullptr, 0);
+			break;
+		case 'f':
+			if (parse_faults(optarg, opt.faults))
+				return -EINVAL;
+			break;
+		case 's':
+			opt.seed = strtoull(optarg, nullptr, 0);
+			break;
+		case OPT_TOGGLE:
+			opt.toggle = true;
+			break;
+		case OPT_NO_LOCK:
+			opt.no_lock = true;
+			break;
+		case OPT_NO_REGION:
+			opt.no_region = true;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return optind == argc && opt.threads ? 0 : -EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::thread> workers, contenders;
+	std::vector<worker_stats> stats;
+	std::atomic<bool> done{ false };
+	struct nct6775_sio_data sio_data;
+	struct nct6775_data data;
+	nct6791d_model model;
+	worker_stats total;
+	uint64_t t0, elapsed, mismatch = 0, clobbered;
+	uint8_t gpio1;
+	options opt;
+	int err;
+
+	if (parse_options(argc, argv, opt)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	model.reset(true, false);
+	model.set_latency(opt.latency);
+	model.set_region(!opt.no_region);
+	model.seed(opt.seed);
+	gpio1 = model.gpio1();
+
+	nct6775_sio_data_init(&sio_data, &model);
+	data.driver_data = &sio_data;
+	data.no_lock = opt.no_lock;
+
+	/* Probe on a healthy chip, faults start with the workload */
+	err = nct6775_platform_probe_init(&data);
+	if (err || !data.have_hddsaver || data.hddsaver_status) {
+		fprintf(stderr, "probe failed\n");
+		return 1;
+	}
+	model.set_faults(opt.faults);
+
+	stats.resize(opt.threads);
+	t0 = now_ns();
+	for (unsigned int i = 0; i < opt.contenders; i++)
+		contenders.emplace_back(contender, std::ref(model),
+					std::ref(done));
+	for (unsigned int i = 0; i < opt.threads; i++)
+		workers.emplace_back(worker, std::cref(opt), &data,
+				     std::ref(model), std::ref(stats[i]), i);
+	for (auto &t : workers)
+		t.join();
+	elapsed = now_ns() - t0;
+	done = true;
+	for (auto &t : contenders)
+		t.join();
+
+	for (const auto &ws : stats) {
+		total.stores += ws.stores;
+		total.errors += ws.errors;
+		total.mismatches += ws.mismatches;
+		for (int i = 0; i < LAT_BUCKETS; i++)
+			total.lat[i] += ws.lat[i];
+	}
+	if (model.rail() != data.hddsaver_status)
+		mismatch = 1;
+	clobbered = (model.gpio1() ^ gpio1) & ~1;
+
+	printf("ops %llu in %.3f s, %.2f Mops/s\n",
+	       (unsigned long long)opt.ops * opt.threads, elapsed / 1e9,
+	       opt.ops * opt.threads * 1e3 / elapsed);
+	printf("stores %llu errors %llu\n",
+	       (unsigned long long)total.stores,
+	       (unsigned long long)total.errors);
+	printf("store_ns p50 <%llu p99 <%llu p99.9 <%llu max <%llu\n",
+	       (unsigned long long)lat_percentile(total.lat, total.stores, 0.5),
+	       (unsigned long long)lat_percentile(total.lat, total.stores, 0.99),
+	       (unsigned long long)lat_percentile(total.lat, total.stores, 0.999),
+	       (unsigned long long)lat_percentile(total.lat, total.stores, 1));
+	printf("port_ops %llu rail_changes %llu busy %llu flips %llu drops %llu\n",
+	       (unsigned long long)model.stats.port_ops,
+	       (unsigned long long)model.stats.rail_changes,
+	       (unsigned long long)model.stats.busy,
+	       (unsigned long long)model.stats.flips,
+	       (unsigned long long)model.stats.drops);
+	printf("rail_mismatch %llu clobbered_bits 0x%02llx torn_accesses %llu\n",
+	       (unsigned long long)(total.mismatches + mismatch),
+	       (unsigned long long)clobbered,
+	       (unsigned long long)model.stats.torn);
+
+	return total.mismatches || mismatch || clobbered || model.stats.torn;
+}
@@ -0,0 +1,530 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-sysfs-stress - concurrent readers and writers of hddsaver_power
+ *
+ * Readers read hddsaver_power and the other hwmon attributes, which take
+ * update_lock and refresh the register cache that every power switch
+ * invalidates. Writers switch the power at a given pace. Reported are
+ * ops/s and latency percentiles per kind of access, and two checks on
+ * what the readers saw:
+ *
+ *   unwritten  a state nobody wrote, and not the initial one
+ *   stale      with one writer and no write in flight during the read,
+ *              a state other than the last one written
+ *
+ * --sim runs against the NCT6791D model and the driver logic of
+ * sio_logic.cc instead of a real hwmon device.
+ */
+#include "rail.h"
+#include "sio_logic.h"
+#include "sio_model.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace hddsaver;
+
+class backend {
+public:
+	virtual ~backend() = default;
+
+	/* Per thread setup, fds are not shared between threads */
+	virtual int prepare(unsigned int threads) = 0;
+
+	/* 1 if on, 0 if off, -errno */
+	virtual int read_power(unsigned int tid) = 0;
+	virtual int write_power(unsigned int tid, bool on) = 0;
+	virtual int read_other(unsigned int tid, unsigned int nr) = 0;
+	virtual unsigned int nr_other() const = 0;
+};
+
+class sysfs_backend : public backend {
+public:
+	explicit sysfs_backend(const std::string &dir) : hwmon(dir) {}
+	~sysfs_backend() override;
+
+	int prepare(unsigned int threads) override;
+	int read_power(unsigned int tid) override;
+	int write_power(unsigned int tid, bool on) override;
+	int read_other(unsigned int tid, unsigned int nr) override;
+	unsigned int nr_other() const override { return others.size(); }
+
+private:
+	struct thread_fds {
+		int power = -1;
+		std::vector<int> others;
+	};
+
+	std::string hwmon;
+	std::vector<std::string> others;
+	std::vector<thread_fds> fds;
+};
+
+sysfs_backend::~sysfs_backend()
+{
+	for (auto &t : fds) {
+		if (t.power >= 0)
+			close(t.power);
+		for (int fd : t.others)
+			close(fd);
+	}
+}
+
+int sysfs_backend::prepare(unsigned int threads)
+{
+	DIR *dir = opendir(hwmon.c_str());
+	struct dirent *de;
+
+	if (!dir)
+		return -errno;
+	while ((de = readdir(dir)) != nullptr) {
+		size_t len = strlen(de->d_name);
+
+		if (len > 6 && !strcmp(de->d_name + len - 6, "_input"))
+			others.push_back(hwmon + "/" + de->d_name);
+	}
+	closedir(dir);
+
+	fds.resize(threads);
+	for (auto &t : fds) {
+		t.power = open((hwmon + "/hddsaver_power").c_str(),
+			       O_RDWR | O_CLOEXEC);
+		if (t.power < 0)
+			return -errno;
+		for (const auto &path : others) {
+			int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (fd < 0)
+				return -errno;
+			t.others.push_back(fd);
+		}
+	}
+
+	return 0;
+}
+
+int sysfs_backend::read_power(unsigned int tid)
+{
+	char buf[16];
+	int len = read_attr(fds[tid].power, buf, sizeof(buf));
+
+	if (len < 0)
+		return len;
+	if (!strncmp(buf, "On", 2))
+		return 1;
+	if (!strncmp(buf, "Off", 3))
+		return 0;
+
+	return -EINVAL;
+}
+
+int sysfs_backend::write_power(unsigned int tid, bool on)
+{
+	const char *val = on ? "on\n" : "off\n";
+
+	if (pwrite(fds[tid].power, val, strlen(val), 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int sysfs_backend::read_other(unsigned int tid, unsigned int nr)
+{
+	char buf[32];
+
+	return read_attr(fds[tid].others[nr], buf, sizeof(buf));
+}
+
+class sim_backend : public backend {
+public:
+	sim_backend(uint64_t latency_ns, unsigned int others);
+
+	int prepare(unsigned int) override { return 0; }
+	int read_power(unsigned int tid) override;
+	int write_power(unsigned int tid, bool on) override;
+	int read_other(unsigned int tid, unsigned int nr) override;
+	unsigned int nr_other() const override { return others; }
+
+private:
+	nct6791d_model model;
+	struct nct6775_sio_data sio_data;
+	struct nct6775_data data;
+	unsigned int others;
+};
+
+sim_backend::sim_backend(uint64_t latency_ns, unsigned int n)
+	: others(n)
+{
+	model.reset(true, false);
+	model.set_latency(latency_ns);
+	nct6775_sio_data_init(&sio_data, &model);
+	data.driver_data = &sio_data;
+	nct6775_platform_probe_init(&data);
+}
+
+int sim_backend::read_power(unsigned int)
+{
+	char buf[16];
+
+	show_hddsaver(&data, buf);
+
+	return buf[1] == 'n';
+}
+
+int sim_backend::write_power(unsigned int, bool on)
+{
+	return store_hddsaver(&data, on ? "on\n" : "off\n");
+}
+
+int sim_backend::read_other(unsigned int, unsigned int nr)
+{
+	return nct6775_show_reg(&data, nr);
+}
+
+/* Log-linear latency histogram, 8 steps per power of two */
+struct lat_hist {
+	uint64_t count = 0;
+	uint64_t bucket[64 * 8] = {};
+
+	void add(uint64_t ns)
+	{
+		int msb = ns ? 63 - __builtin_clzll(ns) : 0;
+		int sub = msb >= 3 ? (ns >> (msb - 3)) & 7 : ns & 7;
+
+		bucket[msb * 8 + sub]++;
+		count++;
+	}
+
+	void merge(const lat_hist &h)
+	{
+		count += h.count;
+		for (size_t i = 0; i < 64 * 8; i++)
+			bucket[i] += h.bucket[i];
+	}
+
+	/* Lower bound of the bucket holding the p-th sample */
+	uint64_t percentile(double p) const
+	{
+		uint64_t rank = p * count, seen = 0;
+
+		for (size_t i = 0; i < 64 * 8; i++) {
+			seen += bucket[i];
+			if (seen > rank || (count && seen == count)) {
+				int msb = i / 8, sub = i % 8;
+
+				return msb >= 3 ? (8ULL | sub) << (msb - 3) :
+						  (uint64_t)sub;
+			}
+		}
+
+		return 0;
+	}
+};
+
+struct thread_stats {
+	lat_hist power_read;
+	lat_hist other_read;
+	lat_hist write;
+	uint64_t errors = 0;
+	uint64_t unwritten = 0;
+	uint64_t stale = 0;
+};
+
+struct shared {
+	std::atomic<bool> stop{ false };
+	std::atomic<bool> written[2] = { { false }, { false } };
+	std::atomic<uint64_t> started{ 0 };
+	std::atomic<uint64_t> finished{ 0 };
+	std::atomic<int> last{ -1 };
+	int initial = -1;
+	bool single_writer = false;
+};
+
+struct options {
+	std::string hwmon;
+	bool sim = false;
+	bool force = false;
+	unsigned int readers = 4;
+	unsigned int writers = 1;
+	double other_ratio = 0.5;
+	uint64_t read_interval_us = 0;
+	uint64_t write_interval_us = 100000;
+	uint64_t seconds = 5;
+	uint64_t latency_ns = 1000;
+	unsigned int sim_others = 32;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_us(uint64_t us)
+{
+	struct timespec ts = { (time_t)(us / 1000000),
+			       (long)(us % 1000000 * 1000) };
+
+	if (us)
+		nanosleep(&ts, nullptr);
+}
+
+static void reader(const options &opt, backend &b, shared &sh,
+		   thread_stats &ts, unsigned int tid)
+{
+	uint64_t x = tid * 0x9e3779b97f4a7c15ULL + 1;
+	unsigned int others = b.nr_other();
+
+	while (!sh.stop) {
+		uint64_t s1, f1, s2, t0, r;
+		int val, last;
+
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		r = x;
+
+		if (others && (r % 1000) < opt.other_ratio * 1000) {
+			t0 = now_ns();
+			if (b.read_other(tid, (r >> 10) % others) < 0)
+				ts.errors++;
+			ts.other_read.add(now_ns() - t0);
+			sleep_us(opt.read_interval_us);
+			continue;
+		}
+
+		s1 = sh.started;
+		f1 = sh.finished;
+		last = sh.last;
+		t0 = now_ns();
+		val = b.read_power(tid);
+		ts.power_read.add(now_ns() - t0);
+		s2 = sh.started;
+
+		if (val < 0) {
+			ts.errors++;
+		} else {
+			if (val != sh.initial && !sh.written[val])
+				ts.unwritten++;
+			if (sh.single_writer && s1 == f1 && s2 == s1 &&
+			    last >= 0 && val != last)
+				ts.stale++;
+		}
+		sleep_us(opt.read_interval_us);
+	}
+}
+
+static void writer(const options &opt, backend &b, shared &sh,
+		   thread_stats &ts, unsigned int tid)
+{
+	bool on = tid & 1;
+
+	while (!sh.stop) {
+		uint64_t t0;
+
+		on = !on;
+		sh.written[on] = true;
+		sh.started++;
+		t0 = now_ns();
+		if (b.write_power(tid, on))
+			ts.errors++;
+		ts.write.add(now_ns() - t0);
+		sh.last = on;
+		sh.finished++;
+		sleep_us(opt.write_interval_us);
+	}
+}
+
+static void print(const char *name, const lat_hist &h, double seconds)
+{
+	if (!h.count)
+		return;
+	printf("%-11s %10llu ops %11.0f/s  p50 %8.1f p99 %8.1f p99.9 %8.1f max %9.1f us\n",
+	       name, (unsigned long long)h.count, h.count / seconds,
+	       h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3,
+	       h.percentile(0.999) / 1e3, h.percentile(1) / 1e3);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] --hwmon DIR --force\n"
+		"       %s [options] --sim\n"
+		"  -H, --hwmon DIR        hwmon directory with hddsaver_power\n"
+		"      --force            allow writers on a real device\n"
+		"      --sim              use the NCT6791D model instead\n"
+		"  -r, --readers N        (4)\n"
+		"  -w, --writers N        (1)\n"
+		"  -o, --other-ratio F    share of reads of other attributes (0.5)\n"
+		"      --read-interval US pause between reads (0)\n"
+		"      --write-interval US pause between writes (100000)\n"
+		"  -t, --seconds N        (5)\n"
+		"      --latency NS       model port access time (1000)\n"
+		"      --sim-others N     model attributes besides hddsaver_power (32)\n",
+		prog, prog);
+}
+
+enum {
+	OPT_FORCE = 256,
+	OPT_SIM,
+	OPT_READ_INTERVAL,
+	OPT_WRITE_INTERVAL,
+	OPT_LATENCY,
+	OPT_SIM_OTHERS,
+};
+
+static int parse_options(int argc, char **argv, options &opt)
+{
+	static const struct option longopts[] = {
+		{ "hwmon",	    required_argument, nullptr, 'H' },
+		{ "force",	    no_argument,       nullptr, OPT_FORCE },
+		{ "sim",	    no_argument,       nullptr, OPT_SIM },
+		{ "readers",	    required_argument, nullptr, 'r' },
+		{ "writers",	    required_argument, nullptr, 'w' },
+		{ "other-ratio",    required_argument, nullptr, 'o' },
+		{ "read-interval",  required_argument, nullptr, OPT_READ_INTERVAL },
+		{ "write-interval", required_argument, nullptr, OPT_WRITE_INTERVAL },
+		{ "seconds",	    required_argument, nullptr, 't' },
+		{ "latency",	    required_argument, nullptr, OPT_LATENCY },
+		{ "sim-others",	    required_argument, nullptr, OPT_SIM_OTHERS },
+		{ "help",	    no_argument,       nullptr, 'h' },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "H:r:w:o:t:h", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 'H':
+			opt.hwmon = optarg;
+			break;
+		case OPT_FORCE:
+			opt.force = true;
+			break;
+		case OPT_SIM:
+			opt.sim = true;
+			break;
+		case 'r':
+			opt.readers = strtoul(optarg, nullptr, 0);
+			break;
+		case 'w':
+			opt.writers = strtoul(optarg, nullptr, 0);
+			break;
+		case 'o':
+			opt.other_ratio = strtod(optarg, nullptr);
+			break;
+		case OPT_READ_INTERVAL:
+			opt.read_interval_us = strtoull(optarg, nullptr, 0);
+			break;
+		case OPT_WRITE_INTERVAL:
+			opt.write_interval_us = strtoull(optarg, nullptr, 0);
+			break;
+		case 't':
+			opt.seconds = strtoull(optarg, nullptr, 0);
+			break;
+		case OPT_LATENCY:
+			opt.latency_ns = strtoull(optarg, nullptr, 0);
+			break;
+		case OPT_SIM_OTHERS:
+			opt.sim_others = strtoul(optarg, nullptr, 0);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc || opt.sim == !opt.hwmon.empty())
+		return -EINVAL;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	std::unique_ptr<backend> b;
+	std::vector<std::thread> threads;
+	std::vector<thread_stats> stats;
+	thread_stats total;
+	unsigned int nthreads;
+	shared sh;
+	options opt;
+	uint64_t t0;
+	double elapsed;
+	int err;
+
+	if (parse_options(argc, argv, opt)) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (!opt.sim && opt.writers && !opt.force) {
+		fprintf(stderr, "writers switch the real drives, add --force\n");
+		return 2;
+	}
+
+	if (opt.sim)
+		b.reset(new sim_backend(opt.latency_ns, opt.sim_others));
+	else
+		b.reset(new sysfs_backend(opt.hwmon));
+
+	nthreads = opt.readers + opt.writers;
+	err = b->prepare(nthreads);
+	if (!err)
+		err = sh.initial = b->read_power(0);
+	if (err < 0) {
+		fprintf(stderr, "setup failed: %s\n", strerror(-err));
+		return 1;
+	}
+	sh.single_writer = opt.writers == 1;
+
+	stats.resize(nthreads);
+	t0 = now_ns();
+	for (unsigned int i = 0; i < nthreads; i++) {
+		if (i < opt.readers)
+			threads.emplace_back(reader, std::cref(opt),
+					     std::ref(*b), std::ref(sh),
+					     std::ref(stats[i]), i);
+		else
+			threads.emplace_back(writer, std::cref(opt),
+					     std::ref(*b), std::ref(sh),
+					     std::ref(stats[i]), i);
+	}
+	sleep_us(opt.seconds * 1000000);
+	sh.stop = true;
+	for (auto &t : threads)
+		t.join();
+	elapsed = (now_ns() - t0) / 1e9;
+
+	for (const auto &ts : stats) {
+		total.power_read.merge(ts.power_read);
+		total.other_read.merge(ts.other_read);
+		total.write.merge(ts.write);
+		total.errors += ts.errors;
+		total.unwritten += ts.unwritten;
+		total.stale += ts.stale;
+	}
+
+	print("power_read", total.power_read, elapsed);
+	print("other_read", total.other_read, elapsed);
+	print("write", total.write, elapsed);
+	printf("errors %llu unwritten %llu stale %llu%s\n",
+	       (unsigned long long)total.errors,
+	       (unsigned long long)total.unwritten,
+	       (unsigned long long)total.stale,
+	       opt.writers > 1 ? " (stale needs one writer)" : "");
+
+	return total.unwritten || total.stale;
+}
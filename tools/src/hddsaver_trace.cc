@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaver-trace - records, dumps and describes binary activity traces
+ *
+ *   hddsaver-activity sdb sdc | hddsaver-trace record --realtime sd.hst
+ *   blkparse -i sdb | hddsaver-trace record sdb.hst
+ *   hddsaver-trace dump --from 1700000000 --to 1700086400 sd.hst
+ *   hddsaver-trace info sd.hst
+ */
+#include "trace.h"
+#include "trace_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace hddsaver;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+/* Seconds with an optional fraction, as in the text traces, to ns */
+static uint64_t parse_seconds(const char *s)
+{
+	return strtod(s, nullptr) * 1e9;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* first is when the chunk got its first event, for the flush deadline */
+static int record_line(char *line, trace_writer &w, trace &t, char action,
+		       uint64_t offset, uint64_t &first)
+{
+	trace_event e;
+
+	if (parse_text_line(line, t, e, action) <= 0)
+		return 0;
+	if (!w.pending())
+		first = clock_ns(CLOCK_MONOTONIC);
+
+	return w.add(e.ts + offset, t.devs[e.dev]);
+}
+
+static int record(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "realtime",	no_argument,	   nullptr, 'r' },
+		{ "chunk",	required_argument, nullptr, 'c' },
+		{ "flush",	required_argument, nullptr, 'f' },
+		{ "action",	required_argument, nullptr, 'a' },
+		{}
+	};
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	struct sigaction sa = {};
+	uint64_t offset = 0, flush_ns = 600000000000ULL, first = 0, now;
+	size_t chunk = 65536, len = 0;
+	char buf[4096], *p, *nl;
+	char action = 'D';
+	trace_writer w;
+	trace t;
+	int c, err, timeout;
+	ssize_t n;
+
+	while ((c = getopt_long(argc, argv, "rc:f:a:", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 'r':
+			/* hddsaver-activity stamps with CLOCK_MONOTONIC */
+			offset = clock_ns(CLOCK_REALTIME) -
+				 clock_ns(CLOCK_MONOTONIC);
+			break;
+		case 'c':
+			chunk = strtoul(optarg, nullptr, 0);
+			break;
+		case 'f':
+			flush_ns = parse_seconds(optarg);
+			break;
+		case 'a':
+			action = optarg[0];
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind + 1 != argc)
+		return 2;
+
+	err = w.open(argv[optind], chunk);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		return 1;
+	}
+
+	/* No SA_RESTART, poll returns on SIGTERM and the chunk is kept */
+	sa.sa_handler = on_signal;
+	sigaction(SIGTERM, &sa, nullptr);
+	sigaction(SIGINT, &sa, nullptr);
+
+	while (!stop && !err) {
+		/* Bound what a crash loses on a quiet system */
+		timeout = -1;
+		if (w.pending()) {
+			now = clock_ns(CLOCK_MONOTONIC);
+			if (now - first >= flush_ns) {
+				err = w.flush();
+				continue;
+			}
+			timeout = std::min<uint64_t>((first + flush_ns - now +
+						      999999) / 1000000,
+						     INT_MAX);
+		}
+		n = poll(&pfd, 1, timeout);
+		if (n <= 0) {
+			if (n < 0 && errno != EINTR)
+				err = -errno;
+			continue;
+		}
+
+		n = read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len);
+		if (n < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				err = -errno;
+			continue;
+		}
+		if (!n) {
+			/* The last line may have no newline */
+			buf[len] = '\0';
+			if (len)
+				err = record_line(buf, w, t, action, offset,
+						  first);
+			break;
+		}
+		len += n;
+		for (p = buf; !err && (nl = (char *)memchr(p, '\n',
+							  buf + len - p));
+		     p = nl + 1) {
+			*nl = '\0';
+			err = record_line(p, w, t, action, offset, first);
+		}
+		/* A line that fills the buffer is no trace line */
+		len -= p - buf;
+		if (len == sizeof(buf) - 1)
+			len = 0;
+		memmove(buf, p, len);
+	}
+
+	if (!err)
+		err = w.close();
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int open_trace(const char *path, trace_file &f)
+{
+	int err = f.open(path);
+
+	if (err)
+		fprintf(stderr, "%s: %s\n", path, strerror(-err));
+
+	return err;
+}
+
+static int dump(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "from",	required_argument, nullptr, 'f' },
+		{ "to",		required_argument, nullptr, 't' },
+		{}
+	};
+	uint64_t from = 0, to = UINT64_MAX;
+	trace_file f;
+	trace t;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "f:t:", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case 'f':
+			from = parse_seconds(optarg);
+			break;
+		case 't':
+			to = parse_seconds(optarg);
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind + 1 != argc)
+		return 2;
+	if (open_trace(argv[optind], f))
+		return 1;
+
+	f.scan(from, to, t, [&t](uint64_t ts, uint32_t dev) {
+		printf("%llu.%09llu %s issue\n",
+		       (unsigned long long)ts / 1000000000,
+		       (unsigned long long)ts % 1000000000,
+		       t.devs[dev].c_str());
+	});
+
+	return 0;
+}
+
+static int info(int argc, char **argv)
+{
+	uint64_t events = 0;
+	trace_file f;
+	trace t;
+
+	if (argc != 2)
+		return 2;
+	if (open_trace(argv[1], f))
+		return 1;
+
+	for (const auto &c : f.chunks())
+		events += c.nr_events;
+	f.scan(0, UINT64_MAX, t, [](uint64_t, uint32_t) {});
+
+	printf("bytes %zu\nchunks %zu\nevents %llu\n", f.size(),
+	       f.chunks().size(), (unsigned long long)events);
+	if (events)
+		printf("bytes_per_event %.2f\n", (double)f.size() / events);
+	if (!f.chunks().empty())
+		printf("first %.9f\nlast %.9f\n",
+		       f.chunks().front().first_ts / 1e9,
+		       f.chunks().back().last_ts / 1e9);
+	for (const auto &dev : t.devs)
+		printf("dev %s\n", dev.c_str());
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 2;
+
+	if (argc >= 2 && !strcmp(argv[1], "record"))
+		ret = record(argc - 1, argv + 1);
+	else if (argc >= 2 && !strcmp(argv[1], "dump"))
+		ret = dump(argc - 1, argv + 1);
+	else if (argc >= 2 && !strcmp(argv[1], "info"))
+		ret = info(argc - 1, argv + 1);
+
+	if (ret == 2)
+		fprintf(stderr,
+			"Usage: %s record [--realtime] [--chunk BYTES] [--flush SEC] [--action C] FILE < TEXT\n"
+			"       %s dump [--from SEC] [--to SEC] FILE\n"
+			"       %s info FILE\n",
+			argv[0], argv[0], argv[0]);
+
+	return ret;
+}
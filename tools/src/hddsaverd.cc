@@ -0,0 +1,1332 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hddsaverd - turns the HDD Saver power off when the drives are idle
+ *
+ * One thread, one epoll loop. The hwmon attributes and /proc/diskstats
+ * stay open for the lifetime of the daemon and nothing is forked, so an
+ * idle machine only pays for one pread per poll interval while the
+ * drives are powered and for one state check a minute while they are not.
+ * With the eBPF activity source even the polling goes away: requests on
+ * the drives are pushed to the daemon and the only timer left while they
+ * are powered is the idle deadline.
+ *
+ * With --prefetch, the trees given are walked by a few threads right
+ * before each power off, so their metadata is cached while the drives
+ * are gone. The loop waits for the walk, and an idle power off only goes
+ * on once what came in meanwhile was looked at.
+ *
+ * With --defer, the cgroups given are frozen while the power is off and
+ * thawed together at the next power on, or at a deadline, when the
+ * daemon powers on for them.
+ *
+ * With --writeback, dirty data is written back within seconds while the
+ * drives are on and held in memory for longer while they are off, see
+ * writeback.h.
+ *
+ * With --smart, the SMART data of the drives is read in one batch while
+ * they spin anyway and served from memory, with its age, at any time.
+ *
+ * With --automount, the file system on the drives is unmounted before
+ * each power off, and the first access to its mount point waits in the
+ * kernel for the power, the drives and the mount instead of failing.
+ *
+ * With --volumes, the md arrays and LVM volume groups on the drives are
+ * stopped before each power off and brought back up after each power on,
+ * see volumes.h. These, and the jobs of --jobs, are the only processes
+ * the daemon starts.
+ *
+ * With --jobs, scrubs, self-tests, backups and the like run while the
+ * drives are on anyway, and the drives are only powered on for them when
+ * waiting longer would miss a deadline, see maint.h.
+ *
+ * Clients can ask for a wake latency on the control socket, for a
+ * lifetime. Idle drives then go to the deepest state that wakes in time
+ * for all of them: power off, standby with the power on, or none.
+ */
+#include "automount.h"
+#include "bpf_activity.h"
+#include "client.h"
+#include "control.h"
+#include "diskstats.h"
+#include "event_loop.h"
+#include "freezer.h"
+#include "maint.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "qos.h"
+#include "rail.h"
+#include "smart.h"
+#include "volumes.h"
+#include "writeback.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <getopt.h>
+#include <grp.h>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace hddsaver;
+
+#define OFF_CHECK_MS		60000
+#define ACTIVITY_THROTTLE_MS	1000
+#define READY_CHECK_MS		100
+#define READY_TIMEOUT_MS	120000
+#define EARLY_WAKE_MS		600000
+#define SMART_DELAY_MS		30000	/* After a power on, for the drives */
+#define RESCAN_MS		10000	/* Drives not back yet, look for them */
+#define OFF_LATENCY_MS		30000	/* Until a wake was seen */
+
+struct wake_time {
+	int hour;
+	int min;
+};
+
+struct options {
+	std::string hwmon;
+	std::vector<std::string> disks;
+	std::string socket = "/run/hddsaverd.sock";
+	mode_t socket_mode = 0600;
+	gid_t socket_group = -1;	/* -1 keeps the daemon's */
+	std::string lock = HOLD_LOCK_PATH;
+	std::string metrics;
+	double watts = 10;
+	std::vector<wake_time> wake_at;
+	unsigned int idle_off = 1800;	/* Seconds, 0 disables */
+	unsigned int poll_ms = 1000;
+	std::string source = "auto";
+	prefetch_options prefetch;
+	std::vector<std::string> defer;
+	unsigned int defer_max = 14400;	/* Seconds, 0 no deadline */
+	bool writeback = false;
+	writeback_options wb;
+	unsigned int smart = 0;		/* Refresh interval in seconds, 0 off */
+	std::string automount;
+	std::string volumes;		/* State file, empty if off */
+	std::string jobs;
+	std::string jobs_state = "/var/lib/hddsaver/jobs";
+	unsigned int spinup = 10;	/* Seconds from standby to ready */
+};
+
+struct daemon_state {
+	options opt;
+	event_loop loop;
+	rail power;
+	diskstats stats;
+	bpf_activity activity;
+	bool use_bpf = false;
+	std::vector<std::string> watched;
+	timer poll_timer;
+	timer wake_timer;
+	timer ready_timer;
+	timer defer_timer;
+	timer smart_timer;
+	timer mount_timer;
+	timer volume_timer;
+	timer maint_timer;
+	timer qos_timer;
+	control ctl;
+	metrics stats_out;
+	exporter exp;
+	prefetcher pre;
+	freezer frz;
+	writeback wb;
+	automount am;
+	volumes vol;
+	maintenance maint;
+	latency_qos qos;
+	bool held = false;		/* Idle, kept up by a latency request */
+	bool standby = false;		/* Spun down by the daemon */
+	uint64_t own_from = 0;		/* Commands of the daemon to the drives */
+	uint64_t own_until = 0;
+	uint64_t volume_start = 0;
+	uint64_t mount_start = 0;
+	bool mount_wake = false;	/* The mount powered the drives on */
+	bool rescanned = false;
+	uint64_t frozen_at = 0;
+	bool prefetched = false;	/* Before the current power off */
+	uint64_t walked_at = 0;		/* End of the last walk */
+	uint64_t off_at = 0;
+	int lock_fd = -1;
+	int sources_fd = -1;
+	uint64_t wake_start = 0;
+	int on = -1;
+	uint64_t last_io = 0;
+	uint64_t on_at = 0;
+	bool watch_warned = false;
+};
+
+static void logmsg(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static int load_disks(daemon_state &d)
+{
+	std::vector<std::string> disks = d.opt.disks;
+	int err;
+
+	if (disks.empty()) {
+		err = d.power.disks(disks);
+		if (err && err != -ENOENT)
+			return err;
+	}
+	if (disks.empty())
+		logmsg("no drives to watch, only scheduled and requested wakes");
+
+	d.watched = disks;
+	d.stats.watch(disks);
+	d.stats.poll();
+	if (d.use_bpf)
+		return d.activity.watch(disks);
+
+	return 0;
+}
+
+/*
+ * The filter has device numbers, a drive is only watched once it is
+ * there, which is some time after a power on. What is not watched may
+ * be busy, so the idle time starts once all of it is, or once the
+ * missing drives were waited for as long as for a wake.
+ */
+static void watch_drives(daemon_state &d)
+{
+	size_t n;
+	int err;
+
+	if (!d.use_bpf || d.on <= 0 ||
+	    d.activity.watching() == d.watched.size())
+		return;
+
+	err = d.activity.watch(d.watched);
+	if (err)
+		logmsg("watching the drives failed: %s", strerror(-err));
+	n = d.activity.watching();
+	if (n == d.watched.size() || now_ms() - d.on_at < READY_TIMEOUT_MS) {
+		d.last_io = now_ms();
+	} else if (!d.watch_warned) {
+		logmsg("watching %zu of %zu drives, the others are missing", n,
+		       d.watched.size());
+		d.watch_warned = true;
+	}
+}
+
+/*
+ * Polls I/O while the drives run, only the rail state while they do not.
+ * Activity events need no polling, just a wakeup at the idle deadline.
+ */
+static void rearm_poll(daemon_state &d)
+{
+	uint64_t idle_ms = d.opt.idle_off * 1000ULL, elapsed;
+
+	if (d.on <= 0 || (d.use_bpf && !idle_ms)) {
+		d.poll_timer.arm(OFF_CHECK_MS, OFF_CHECK_MS);
+	} else if (!d.use_bpf ||
+		   d.activity.watching() < d.watched.size()) {
+		/* Drives not watched yet are looked for every tick */
+		d.poll_timer.arm(d.opt.poll_ms, d.opt.poll_ms);
+	} else {
+		elapsed = now_ms() - d.last_io;
+		if (elapsed < idle_ms)
+			d.poll_timer.arm(idle_ms - elapsed);
+		else
+			d.poll_timer.arm(d.held ? OFF_CHECK_MS : 1);
+	}
+}
+
+/* Counts are kept by the driver (patch 0004), refreshed per power on */
+static void read_sources(daemon_state &d)
+{
+	char buf[1024];
+
+	if (d.sources_fd >= 0 && read_attr(d.sources_fd, buf, sizeof(buf)) >= 0)
+		d.stats_out.parse_sources(buf);
+}
+
+/* Background jobs wait while the drives are off, and all go at the next wake */
+static void set_deferred(daemon_state &d, bool defer, wake_reason why)
+{
+	if (d.frz.empty() || defer == d.frz.frozen())
+		return;
+
+	d.frz.set(defer);
+	if (defer) {
+		d.frozen_at = now_ms();
+		if (d.opt.defer_max)
+			d.defer_timer.arm(d.opt.defer_max * 1000ULL);
+		return;
+	}
+
+	d.defer_timer.disarm();
+	d.stats_out.defer_releases[why == REASON_DEFERRED]++;
+	d.stats_out.deferred_ms += now_ms() - d.frozen_at;
+	logmsg("released deferred jobs after %llu s",
+	       (unsigned long long)(now_ms() - d.frozen_at) / 1000);
+}
+
+/*
+ * Mean of the wakes seen so far, a guess before the first. The volumes
+ * and the automount come up after the drives, the longest of them counts.
+ */
+static uint64_t off_latency_ms(const daemon_state &d)
+{
+	const metrics &m = d.stats_out;
+	uint64_t ms = OFF_LATENCY_MS;
+
+	if (m.latency_count)
+		ms = (uint64_t)(m.latency_sum * 1000 / m.latency_count);
+	if (m.bringups)
+		ms = std::max(ms, m.bringup_ms / m.bringups);
+	if (m.mounts)
+		ms = std::max(ms, m.mount_ms / m.mounts);
+
+	return ms;
+}
+
+/*
+ * While the drives are on, jobs run once they and their volumes are
+ * there, and as soon as they may. While off, the timer is set to the
+ * latest power on that keeps the deadlines.
+ */
+static void run_jobs(daemon_state &d)
+{
+	time_t now = time(nullptr), t;
+
+	if (d.maint.empty())
+		return;
+	if (d.on > 0) {
+		if (d.ready_timer.armed() || d.volume_timer.armed()) {
+			d.maint_timer.disarm();
+			return;
+		}
+		d.maint.run(now);
+		t = d.maint.next_start(now);
+	} else {
+		t = d.maint.next_wake((off_latency_ms(d) + 999) / 1000);
+	}
+
+	if (t)
+		d.maint_timer.arm_at(std::max(t, now + 1));
+	else
+		d.maint_timer.disarm();
+}
+
+/* Polled until each array and group is complete, then started at once */
+static void volume_tick(daemon_state &d)
+{
+	uint64_t elapsed = now_ms() - d.volume_start;
+
+	if (d.vol.bring_up()) {
+		d.volume_timer.disarm();
+		d.stats_out.bringups++;
+		d.stats_out.bringup_ms += elapsed;
+		logmsg("volumes up after %.1f s", elapsed / 1000.0);
+		run_jobs(d);
+	} else if (elapsed >= READY_TIMEOUT_MS || d.on <= 0) {
+		d.volume_timer.disarm();
+		logmsg("not brought up: %s", d.vol.missing().c_str());
+	}
+}
+
+static void start_volumes(daemon_state &d)
+{
+	if (d.vol.empty() || d.volume_timer.armed())
+		return;
+
+	d.volume_start = now_ms();
+	d.volume_timer.arm(READY_CHECK_MS, READY_CHECK_MS);
+	volume_tick(d);
+}
+
+static void update_state(daemon_state &d, int on, wake_reason why)
+{
+	if (on == d.on)
+		return;
+
+	if (on && d.on == 0 && why == REASON_EXTERNAL &&
+	    now_ms() - d.off_at < EARLY_WAKE_MS)
+		d.stats_out.early_wakes[d.prefetched]++;
+	if (!on) {
+		d.off_at = now_ms();
+		d.stats_out.offs[d.prefetched]++;
+	}
+
+	d.on = on;
+	d.standby = false;
+	d.held = false;
+	d.stats_out.set_state(on, why, now_ms());
+	set_deferred(d, !on, why);
+	d.wb.set(on);
+	if (d.opt.smart && on)
+		d.smart_timer.arm(SMART_DELAY_MS, d.opt.smart * 1000ULL);
+	else if (d.opt.smart)
+		d.smart_timer.disarm();
+	if (on) {
+		/* The walk is done again before the next power off */
+		d.pre.release();
+		d.prefetched = false;
+		d.stats_out.pinned = 0;
+		read_sources(d);
+		/* Fresh counters, the drives just reappeared */
+		d.stats.poll();
+		d.last_io = d.on_at = now_ms();
+		d.watch_warned = false;
+		if (d.use_bpf)
+			d.activity.watch(d.watched);
+		watch_drives(d);
+		start_volumes(d);
+	}
+	rearm_poll(d);
+	run_jobs(d);
+}
+
+/*
+ * SMART reads and the like go through the block layer like any other
+ * request. What the daemon sends itself is not activity: the counters
+ * are taken again after it, and events issued meanwhile are dropped.
+ */
+static void own_commands(daemon_state &d, bool done)
+{
+	if (!done) {
+		d.own_from = now_ms();
+		return;
+	}
+
+	d.own_until = now_ms();
+	d.stats.poll();
+	/* The throttle would hide a request that follows right after */
+	if (d.use_bpf)
+		d.activity.unthrottle();
+}
+
+/*
+ * Only drives that are present and spinning are asked, what could not
+ * be read keeps the data of the last time.
+ */
+static void read_smart(daemon_state &d)
+{
+	struct stat st;
+	int err;
+
+	if (d.on <= 0)
+		return;
+
+	own_commands(d, false);
+	for (const auto &disk : d.watched) {
+		metrics::drive *drv = d.stats_out.find_drive(disk, true);
+
+		if (!drv || stat(("/sys/class/block/" + disk).c_str(), &st))
+			continue;
+		err = smart_read(disk, drv->smart);
+		if (err && err != -EAGAIN)
+			logmsg("reading SMART data of %s failed: %s",
+			       disk.c_str(), strerror(-err));
+	}
+	own_commands(d, true);
+}
+
+/* Time to the drives' return, for wakes the daemon did itself */
+static void check_ready(daemon_state &d)
+{
+	uint64_t elapsed = now_ms() - d.wake_start;
+	struct stat st;
+
+	for (const auto &disk : d.watched) {
+		if (stat(("/sys/class/block/" + disk).c_str(), &st)) {
+			if (elapsed >= READY_TIMEOUT_MS || d.on <= 0)
+				d.ready_timer.disarm();
+			return;
+		}
+	}
+	d.stats_out.observe_wake(elapsed);
+	d.ready_timer.disarm();
+	watch_drives(d);
+	rearm_poll(d);
+	if (d.opt.smart)
+		read_smart(d);
+	run_jobs(d);
+}
+
+/* Caches the metadata of the trees given, its reads are not activity */
+static void prefetch(daemon_state &d)
+{
+	prefetch_result res;
+	int err;
+
+	own_commands(d, false);
+	err = d.pre.walk(d.opt.prefetch, res);
+	own_commands(d, true);
+	d.walked_at = now_ms();
+	if (err) {
+		logmsg("prefetch failed: %s", strerror(-err));
+		return;
+	}
+	logmsg("prefetched %llu entries in %llu directories, %.1f s%s",
+	       (unsigned long long)res.entries, (unsigned long long)res.dirs,
+	       res.ms / 1000.0, res.truncated ? ", budget reached" : "");
+
+	d.prefetched = true;
+	d.stats_out.prefetch_walks++;
+	d.stats_out.prefetch_entries += res.entries;
+	d.stats_out.prefetch_ms += res.ms;
+	d.stats_out.pinned = d.pre.pinned();
+}
+
+/* Nothing dirty is left to wake the drives right after */
+static void drain(daemon_state &d)
+{
+	uint64_t start = now_ms();
+	int n = d.wb.drain(d.watched);
+
+	if (n < 0)
+		logmsg("syncing the file systems failed: %s", strerror(-n));
+	else if (n)
+		logmsg("synced %d file systems in %.1f s", n,
+		       (now_ms() - start) / 1000.0);
+}
+
+/* Stops what is on the drives, or brings back what went down and fails */
+static int tear_down(daemon_state &d)
+{
+	uint64_t start = now_ms();
+	std::string failed;
+	int err;
+
+	d.volume_timer.disarm();
+	err = d.vol.tear_down(failed);
+	if (!err) {
+		logmsg("volumes down in %.1f s", (now_ms() - start) / 1000.0);
+		return 0;
+	}
+
+	if (err == -EBUSY) {
+		logmsg("%s is in use", failed.c_str());
+		d.stats_out.refused++;
+	} else {
+		logmsg("stopping volumes failed: %s", strerror(-err));
+	}
+	start_volumes(d);
+
+	return err;
+}
+
+/* Clients holding the drives keep a shared lock, see client.h */
+static int set_power(daemon_state &d, bool on, wake_reason why)
+{
+	int err;
+
+	if (!on && d.maint.busy()) {
+		d.stats_out.refused++;
+		return -EBUSY;
+	}
+
+	/*
+	 * The walk blocks the loop, so it comes before the lock. An idle power
+	 * off goes back to the loop after it, and is done at the next tick
+	 * unless a hold, a command or I/O that came in meanwhile stops it.
+	 */
+	if (!on && d.on > 0 && !d.opt.prefetch.roots.empty() &&
+	    d.walked_at <= d.last_io) {
+		prefetch(d);
+		if (why == REASON_IDLE)
+			return -EAGAIN;
+	}
+
+	if (!on && d.lock_fd >= 0 && flock(d.lock_fd, LOCK_EX | LOCK_NB)) {
+		if (errno == EWOULDBLOCK) {
+			d.pre.release();
+			d.prefetched = false;
+			d.stats_out.refused++;
+			return -EBUSY;
+		}
+		logmsg("taking %s failed: %s", d.opt.lock.c_str(),
+		       strerror(errno));
+	}
+
+	/* Open files or working directories there hold the drives too */
+	if (!on && d.am.mounted()) {
+		err = d.am.unmount();
+		if (err) {
+			if (d.lock_fd >= 0)
+				flock(d.lock_fd, LOCK_UN);
+			d.pre.release();
+			d.prefetched = false;
+			if (err == -EBUSY) {
+				d.stats_out.refused++;
+				return err;
+			}
+			logmsg("unmounting %s failed: %s",
+			       d.am.path().c_str(), strerror(-err));
+			return err;
+		}
+	}
+
+	if (!on && d.on > 0 && d.wb.is_open())
+		drain(d);
+	if (!on && d.on > 0 && !d.vol.empty()) {
+		err = tear_down(d);
+		if (err) {
+			if (d.lock_fd >= 0)
+				flock(d.lock_fd, LOCK_UN);
+			d.pre.release();
+			d.prefetched = false;
+			return err;
+		}
+	}
+	err = d.power.set(on);
+	if (!on && d.lock_fd >= 0)
+		flock(d.lock_fd, LOCK_UN);
+	if (err) {
+		logmsg("turning power %s failed: %s", on ? "on" : "off",
+		       strerror(-err));
+		if (!on) {
+			d.pre.release();
+			d.prefetched = false;
+		}
+		return err;
+	}
+	logmsg("power %s (%s)", on ? "on" : "off", reason_name(why));
+	if (on && d.on == 0 && !d.watched.empty()) {
+		d.wake_start = now_ms();
+		d.ready_timer.arm(READY_CHECK_MS, READY_CHECK_MS);
+	}
+	update_state(d, on, why);
+
+	return 0;
+}
+
+/* A standby counts once every drive took it, the others are retried */
+static int set_standby(daemon_state &d, bool standby)
+{
+	int err, ret = 0;
+
+	own_commands(d, false);
+	for (const auto &disk : d.watched) {
+		err = ata_standby(disk, standby);
+		if (err) {
+			logmsg("spinning %s %s failed: %s", disk.c_str(),
+			       standby ? "down" : "up", strerror(-err));
+			ret = err;
+		}
+	}
+	own_commands(d, true);
+	if (standby && ret)
+		return ret;
+	d.standby = standby;
+	if (standby) {
+		d.stats_out.standbys++;
+		logmsg("drives in standby for a wake latency of %.1f s",
+		       d.stats_out.qos_limit_ms / 1000.0);
+	}
+
+	return ret;
+}
+
+/* The deepest state every latency request allows, for idle drives */
+static void idle_step(daemon_state &d)
+{
+	uint64_t limit = d.qos.limit(now_ms());
+	int err;
+
+	d.held = false;
+	if (limit >= off_latency_ms(d)) {
+		err = set_power(d, false, REASON_IDLE);
+		if (err == -EBUSY)
+			d.last_io = now_ms();	/* Held, try again in a full period */
+		else if (err == -EAGAIN)
+			rearm_poll(d);		/* Walked, look again right away */
+		return;
+	}
+
+	d.held = true;
+	/* A spin down would abort a self-test a job started */
+	if (d.standby || limit < d.opt.spinup * 1000ULL || d.maint.busy())
+		return;
+	/* Holders want the drives ready, not only powered */
+	if (d.lock_fd >= 0 && flock(d.lock_fd, LOCK_EX | LOCK_NB))
+		return;
+	if (set_standby(d, true))
+		d.last_io = now_ms();	/* Try again in a full period */
+	if (d.lock_fd >= 0)
+		flock(d.lock_fd, LOCK_UN);
+}
+
+/* A request was made, renewed, dropped or expired */
+static void qos_changed(daemon_state &d)
+{
+	uint64_t now = now_ms(), limit = d.qos.limit(now);
+	uint64_t next = d.qos.next_expiry();
+
+	d.stats_out.qos_limit_ms = limit == latency_qos::NO_LIMIT ? 0 : limit;
+	if (next)
+		d.qos_timer.arm(next > now ? next - now : 1);
+	else
+		d.qos_timer.disarm();
+
+	if (d.on == 0 && limit < off_latency_ms(d))
+		set_power(d, true, REASON_REQUEST);
+	else if (d.standby && limit < d.opt.spinup * 1000ULL)
+		set_standby(d, false);
+	else if (d.held)
+		idle_step(d);
+}
+
+/* Retried until the drives are back, the waiting lookups go on after */
+static void try_mount(daemon_state &d)
+{
+	uint64_t elapsed = now_ms() - d.mount_start;
+	int err = d.am.mount();
+
+	if (err == -EAGAIN && elapsed < READY_TIMEOUT_MS) {
+		if (!d.rescanned && elapsed >= RESCAN_MS) {
+			scsi_rescan();
+			d.rescanned = true;
+		}
+		return;
+	}
+
+	d.mount_timer.disarm();
+	if (err)
+		logmsg("mounting %s failed: %s", d.am.path().c_str(),
+		       strerror(-err));
+	else
+		logmsg("mounted %s after %.1f s", d.am.path().c_str(),
+		       elapsed / 1000.0);
+	if (!err && d.mount_wake) {
+		d.stats_out.mounts++;
+		d.stats_out.mount_ms += elapsed;
+	}
+	d.am.release(err);
+	d.last_io = now_ms();
+}
+
+/* Accesses while the mount is under way share its wake */
+static void start_mount(daemon_state &d)
+{
+	int err;
+
+	if (d.mount_timer.armed())
+		return;
+	d.mount_wake = d.on <= 0;
+	if (d.on <= 0) {
+		err = set_power(d, true, REASON_ACCESS);
+		if (err) {
+			d.am.release(err);
+			return;
+		}
+	}
+
+	d.mount_start = now_ms();
+	d.rescanned = false;
+	d.mount_timer.arm(READY_CHECK_MS, READY_CHECK_MS);
+	try_mount(d);
+}
+
+static void poll_tick(daemon_state &d)
+{
+	int on = d.power.state();
+
+	if (on < 0) {
+		logmsg("reading power state failed: %s", strerror(-on));
+		return;
+	}
+	update_state(d, on, REASON_EXTERNAL);
+	if (!on) {
+		/* Groups of services started since the power went off */
+		if (d.frz.frozen())
+			d.frz.set(true);
+		return;
+	}
+
+	watch_drives(d);
+	if (!d.use_bpf && d.stats.poll() > 0) {
+		d.last_io = now_ms();
+		d.standby = false;
+		d.held = false;
+	} else if (d.opt.idle_off &&
+		   now_ms() - d.last_io >= d.opt.idle_off * 1000ULL) {
+		idle_step(d);
+	}
+
+	/* The deadline moved with every event since it was armed */
+	if (d.use_bpf && d.on > 0)
+		rearm_poll(d);
+	run_jobs(d);
+}
+
+static time_t next_wake(const std::vector<wake_time> &wake_at)
+{
+	time_t now = time(nullptr), best = 0;
+
+	for (const auto &w : wake_at) {
+		struct tm tm;
+		time_t t;
+
+		localtime_r(&now, &tm);
+		tm.tm_hour = w.hour;
+		tm.tm_min = w.min;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+		if (t <= now) {
+			tm.tm_mday++;
+			tm.tm_hour = w.hour;
+			tm.tm_min = w.min;
+			tm.tm_isdst = -1;
+			t = mktime(&tm);
+		}
+		if (!best || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+static void arm_wake(daemon_state &d)
+{
+	if (!d.opt.wake_at.empty())
+		d.wake_timer.arm_at(next_wake(d.opt.wake_at));
+}
+
+/* "smart" gives a line per drive, "smart DISK" its attributes */
+static std::string smart_command(daemon_state &d, const std::string &cmd)
+{
+	uint64_t now = now_ms();
+	std::string out;
+	char buf[4096];
+
+	if (cmd.size() > 6) {
+		const metrics::drive *drv = d.stats_out.find_drive(cmd.substr(6),
+								    false);
+
+		if (!drv || !drv->smart.read_ms)
+			return "unknown drive";
+		snprintf(buf, sizeof(buf), "age %llu\n",
+			 (unsigned long long)(now - drv->smart.read_ms) / 1000);
+		out = buf;
+		if (smart_format(drv->smart, buf, sizeof(buf)))
+			out += buf;
+		out.pop_back();
+		return out;
+	}
+
+	for (unsigned int i = 0; i < d.stats_out.nr_drives; i++) {
+		const metrics::drive &drv = d.stats_out.drives[i];
+
+		if (!drv.smart.read_ms)
+			continue;
+		snprintf(buf, sizeof(buf), "%s age %llu temp %d %s\n",
+			 drv.name,
+			 (unsigned long long)(now - drv.smart.read_ms) / 1000,
+			 drv.smart.temperature,
+			 drv.smart.failing ? "failing" : "ok");
+		out += buf;
+	}
+	if (out.empty())
+		return "no data";
+	out.pop_back();
+
+	return out;
+}
+
+/* A line per job: name, seconds to the deadline and the state */
+static std::string jobs_command(daemon_state &d)
+{
+	time_t now = time(nullptr);
+	std::string out;
+	char buf[512];
+
+	for (const auto &j : d.maint.list()) {
+		snprintf(buf, sizeof(buf), "%s due %lld %s\n", j.name.c_str(),
+			 (long long)(j.deadline() - now),
+			 j.running ? "running" :
+			 now >= j.eligible() ? "ready" : "waiting");
+		out += buf;
+	}
+	if (out.empty())
+		return "no jobs";
+	out.pop_back();
+
+	return out;
+}
+
+/*
+ * "qos add NAME MS SEC" returns the id of a request for wakes of at most
+ * MS, for SEC. "qos renew ID SEC" and "qos del ID" change it, "qos"
+ * lists the requests after the limit and the state it allows.
+ */
+static std::string qos_command(daemon_state &d, const std::string &cmd)
+{
+	unsigned long long ms, sec;
+	uint64_t now = now_ms(), limit;
+	std::string out;
+	char name[64], buf[256];
+	unsigned int id;
+
+	if (sscanf(cmd.c_str(), "qos add %63s %llu %llu", name, &ms, &sec) == 3 &&
+	    sec) {
+		id = d.qos.add(name, ms, sec * 1000, now);
+		d.stats_out.qos_requests++;
+		qos_changed(d);
+		return std::to_string(id);
+	}
+	if (sscanf(cmd.c_str(), "qos renew %u %llu", &id, &sec) == 2 && sec) {
+		if (!d.qos.renew(id, sec * 1000, now))
+			return "unknown request";
+		qos_changed(d);
+		return "ok";
+	}
+	if (sscanf(cmd.c_str(), "qos del %u", &id) == 1) {
+		if (!d.qos.remove(id))
+			return "unknown request";
+		qos_changed(d);
+		return "ok";
+	}
+	if (cmd != "qos")
+		return "unknown command";
+
+	limit = d.qos.limit(now);
+	if (limit == latency_qos::NO_LIMIT)
+		snprintf(buf, sizeof(buf), "limit none off\n");
+	else
+		snprintf(buf, sizeof(buf), "limit %.1f %s\n", limit / 1000.0,
+			 limit >= off_latency_ms(d) ? "off" :
+			 limit >= d.opt.spinup * 1000ULL ? "standby" : "active");
+	out = buf;
+	for (const auto &r : d.qos.list()) {
+		snprintf(buf, sizeof(buf), "%u %s %.1f expires %llu\n", r.id,
+			 r.name.c_str(), r.max_ms / 1000.0,
+			 (unsigned long long)(r.expires - now) / 1000);
+		out += buf;
+	}
+	out.pop_back();
+
+	return out;
+}
+
+/*
+ * Other users than root and the daemon's own get everything but "on"
+ * and "off": the status, the SMART data, the jobs and latency requests.
+ */
+static std::string handle_command(daemon_state &d, const std::string &cmd,
+				  uid_t uid)
+{
+	char buf[64];
+
+	if (cmd == "on" || cmd == "off") {
+		if (uid && uid != geteuid())
+			return "permission denied";
+		switch (set_power(d, cmd == "on", REASON_REQUEST)) {
+		case 0:
+			return "ok";
+		case -EBUSY:
+			return "busy";
+		default:
+			return "error";
+		}
+	}
+
+	if (cmd == "smart" || !cmd.compare(0, 6, "smart "))
+		return smart_command(d, cmd);
+
+	if (cmd == "jobs")
+		return jobs_command(d);
+
+	if (cmd == "qos" || !cmd.compare(0, 4, "qos "))
+		return qos_command(d, cmd);
+
+	if (cmd == "status") {
+		if (d.on > 0)
+			snprintf(buf, sizeof(buf), "on idle %llu",
+				 (unsigned long long)(now_ms() - d.last_io) / 1000);
+		else
+			snprintf(buf, sizeof(buf), "off");
+		return buf;
+	}
+
+	return "unknown command";
+}
+
+static int parse_wake(const char *s, wake_time &w)
+{
+	if (sscanf(s, "%d:%d", &w.hour, &w.min) != 2 ||
+	    w.hour < 0 || w.hour > 23 || w.min < 0 || w.min > 59)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"      --automount DIR   unmount DIR (from fstab) while off, mount on access\n"
+		"  -H, --hwmon DIR       hwmon directory (default: autodetect)\n"
+		"  -d, --disks LIST      drives to watch (default: hddsaver_disks)\n"
+		"  -D, --defer CGROUP    freeze CGROUP while the power is off, repeatable\n"
+		"      --defer-max SEC   power on for deferred jobs after SEC, 0 never (14400)\n"
+		"  -J, --jobs FILE       run the maintenance jobs in FILE by their deadlines\n"
+		"      --jobs-state FILE  their last runs (/var/lib/hddsaver/jobs)\n"
+		"  -i, --idle-off SEC    power off after SEC idle seconds, 0 never (1800)\n"
+		"  -l, --lock PATH       no power off while clients hold it (" HOLD_LOCK_PATH ")\n"
+		"  -m, --metrics ADDR    serve metrics on loopback HOST:PORT or a socket path\n"
+		"  -p, --poll MS         I/O poll interval while powered (1000)\n"
+		"  -P, --prefetch DIR    cache the metadata below DIR before power off,\n"
+		"                        repeatable\n"
+		"      --prefetch-budget N  entries walked at most (65536)\n"
+		"      --prefetch-pin N  directories kept open while off (1024)\n"
+		"      --prefetch-threads N  walking threads (4)\n"
+		"  -s, --socket PATH     control socket (/run/hddsaverd.sock)\n"
+		"      --socket-mode MODE  its octal mode (0600)\n"
+		"      --socket-group GROUP  and its group\n"
+		"  -S, --source SRC      activity from bpf, diskstats or auto (auto)\n"
+		"  -V, --volumes FILE    stop and start the md arrays and LVM groups on\n"
+		"                        the drives, their members kept in FILE\n"
+		"      --smart SEC       read SMART data every SEC while the drives spin\n"
+		"      --spinup SEC      wake time from standby, for latency requests (10)\n"
+		"  -w, --wake-at HH:MM   power on every day at HH:MM, repeatable\n"
+		"  -W, --writeback       coordinate dirty page writeback with the power\n"
+		"      --writeback-age SEC  keep dirty data up to SEC while off (3600)\n"
+		"      --writeback-limit MB  and up to MB of it (256)\n"
+		"      --watts W         drives' power while spinning, for the metrics (10)\n",
+		prog);
+}
+
+enum {
+	OPT_WATTS = 256,
+	OPT_PREFETCH_BUDGET,
+	OPT_PREFETCH_PIN,
+	OPT_PREFETCH_THREADS,
+	OPT_DEFER_MAX,
+	OPT_WRITEBACK_AGE,
+	OPT_WRITEBACK_LIMIT,
+	OPT_SMART,
+	OPT_AUTOMOUNT,
+	OPT_JOBS_STATE,
+	OPT_SPINUP,
+	OPT_SOCKET_MODE,
+	OPT_SOCKET_GROUP,
+};
+
+static int parse_options(int argc, char **argv, options &opt)
+{
+	static const struct option longopts[] = {
+		{ "automount",	required_argument, nullptr, OPT_AUTOMOUNT },
+		{ "hwmon",	required_argument, nullptr, 'H' },
+		{ "disks",	required_argument, nullptr, 'd' },
+		{ "defer",	required_argument, nullptr, 'D' },
+		{ "defer-max",	required_argument, nullptr, OPT_DEFER_MAX },
+		{ "jobs",	required_argument, nullptr, 'J' },
+		{ "jobs-state",	required_argument, nullptr, OPT_JOBS_STATE },
+		{ "idle-off",	required_argument, nullptr, 'i' },
+		{ "lock",	required_argument, nullptr, 'l' },
+		{ "metrics",	required_argument, nullptr, 'm' },
+		{ "poll",	required_argument, nullptr, 'p' },
+		{ "prefetch",	required_argument, nullptr, 'P' },
+		{ "prefetch-budget", required_argument, nullptr, OPT_PREFETCH_BUDGET },
+		{ "prefetch-pin", required_argument, nullptr, OPT_PREFETCH_PIN },
+		{ "prefetch-threads", required_argument, nullptr, OPT_PREFETCH_THREADS },
+		{ "socket",	required_argument, nullptr, 's' },
+		{ "socket-mode", required_argument, nullptr, OPT_SOCKET_MODE },
+		{ "socket-group", required_argument, nullptr, OPT_SOCKET_GROUP },
+		{ "source",	required_argument, nullptr, 'S' },
+		{ "volumes",	required_argument, nullptr, 'V' },
+		{ "smart",	required_argument, nullptr, OPT_SMART },
+		{ "spinup",	required_argument, nullptr, OPT_SPINUP },
+		{ "wake-at",	required_argument, nullptr, 'w' },
+		{ "writeback",	no_argument,	   nullptr, 'W' },
+		{ "writeback-age", required_argument, nullptr, OPT_WRITEBACK_AGE },
+		{ "writeback-limit", required_argument, nullptr, OPT_WRITEBACK_LIMIT },
+		{ "watts",	required_argument, nullptr, OPT_WATTS },
+		{ "help",	no_argument,	   nullptr, 'h' },
+		{}
+	};
+	struct group *gr;
+	wake_time w;
+	char *end;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "H:d:D:J:i:l:m:p:P:s:S:V:w:Wh", longopts,
+				nullptr)) != -1) {
+		switch (c) {
+		case OPT_AUTOMOUNT:
+			opt.automount = optarg;
+			break;
+		case 'H':
+			opt.hwmon = optarg;
+			break;
+		case 'd':
+			opt.disks = split_list(optarg);
+			break;
+		case 'D':
+			opt.defer.push_back(optarg);
+			break;
+		case OPT_DEFER_MAX:
+			opt.defer_max = strtoul(optarg, nullptr, 0);
+			break;
+		case 'J':
+			opt.jobs = optarg;
+			break;
+		case OPT_JOBS_STATE:
+			opt.jobs_state = optarg;
+			break;
+		case 'i':
+			opt.idle_off = strtoul(optarg, nullptr, 0);
+			break;
+		case 'l':
+			opt.lock = optarg;
+			break;
+		case 'm':
+			opt.metrics = optarg;
+			break;
+		case 'p':
+			opt.poll_ms = strtoul(optarg, nullptr, 0);
+			if (!opt.poll_ms)
+				return -EINVAL;
+			break;
+		case 'P':
+			opt.prefetch.roots.push_back(optarg);
+			break;
+		case OPT_PREFETCH_BUDGET:
+			opt.prefetch.budget = strtoull(optarg, nullptr, 0);
+			break;
+		case OPT_PREFETCH_PIN:
+			opt.prefetch.pin = strtoul(optarg, nullptr, 0);
+			break;
+		case OPT_PREFETCH_THREADS:
+			opt.prefetch.threads = strtoul(optarg, nullptr, 0);
+			break;
+		case 's':
+			opt.socket = optarg;
+			break;
+		case OPT_SOCKET_MODE:
+			opt.socket_mode = strtoul(optarg, &end, 8);
+			if (*end || opt.socket_mode & ~0777)
+				return -EINVAL;
+			break;
+		case OPT_SOCKET_GROUP:
+			gr = getgrnam(optarg);
+			if (!gr)
+				return -EINVAL;
+			opt.socket_group = gr->gr_gid;
+			break;
+		case 'S':
+			opt.source = optarg;
+			if (opt.source != "auto" && opt.source != "bpf" &&
+			    opt.source != "diskstats")
+				return -EINVAL;
+			break;
+		case 'V':
+			opt.volumes = optarg;
+			break;
+		case 'w':
+			if (parse_wake(optarg, w))
+				return -EINVAL;
+			opt.wake_at.push_back(w);
+			break;
+		case OPT_SMART:
+			opt.smart = strtoul(optarg, nullptr, 0);
+			break;
+		case OPT_SPINUP:
+			opt.spinup = strtoul(optarg, nullptr, 0);
+			break;
+		case 'W':
+			opt.writeback = true;
+			break;
+		case OPT_WRITEBACK_AGE:
+			opt.wb.off_expire_cs = strtoul(optarg, nullptr, 0) * 100;
+			break;
+		case OPT_WRITEBACK_LIMIT:
+			opt.wb.off_limit = strtoull(optarg, nullptr, 0) << 20;
+			break;
+		case OPT_WATTS:
+			opt.watts = strtod(optarg, nullptr);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return optind == argc ? 0 : -EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+	daemon_state d;
+	int err;
+
+	if (parse_options(argc, argv, d.opt)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* The metadata cached by the walk would go with the unmount */
+	for (const auto &root : d.opt.prefetch.roots) {
+		const std::string &am = d.opt.automount;
+
+		if (am.empty() || root.compare(0, am.size(), am) ||
+		    (root.size() > am.size() && root[am.size()] != '/' &&
+		     am.back() != '/'))
+			continue;
+		logmsg("--prefetch %s is under --automount %s, which is "
+		       "unmounted before each power off", root.c_str(),
+		       am.c_str());
+		return 2;
+	}
+
+	if (d.opt.hwmon.empty())
+		d.opt.hwmon = find_hwmon();
+	if (d.opt.hwmon.empty()) {
+		logmsg("no hwmon device with hddsaver_power found");
+		return 1;
+	}
+
+	err = d.power.open(d.opt.hwmon);
+	if (!err && !d.opt.lock.empty()) {
+		d.lock_fd = open(d.opt.lock.c_str(), O_RDONLY | O_CREAT |
+				 O_CLOEXEC, 0644);
+		if (d.lock_fd < 0)
+			err = -errno;
+	}
+	if (!err)
+		err = d.stats.open();
+	if (!err && d.opt.source != "diskstats") {
+		err = d.activity.open(d.loop, ACTIVITY_THROTTLE_MS,
+				      [&d](const std::string &, int, uint64_t ts) {
+			ts /= 1000000;
+			if (ts >= d.own_from && ts <= d.own_until)
+				return;
+			d.last_io = now_ms();
+			d.standby = false;
+			d.held = false;
+		});
+		if (err && d.opt.source == "auto") {
+			logmsg("eBPF activity source unavailable (%s), polling %s",
+			       strerror(-err), "/proc/diskstats");
+			err = 0;
+		} else if (!err) {
+			d.use_bpf = true;
+		}
+	}
+	if (!err && d.opt.writeback)
+		err = d.wb.open(d.opt.wb);
+	if (!err)
+		err = load_disks(d);
+	if (!err)
+		err = d.ready_timer.open(d.loop, [&d] { check_ready(d); });
+	if (!err && !d.opt.volumes.empty()) {
+		err = d.volume_timer.open(d.loop, [&d] { volume_tick(d); });
+		if (!err)
+			err = d.vol.open(d.loop, d.opt.volumes, d.watched,
+					 [&d](const std::string &name, int status) {
+				if (status)
+					logmsg("bringing %s up failed: %s",
+					       name.c_str(), strerror(-status));
+			});
+	}
+	if (!err && !d.opt.jobs.empty()) {
+		d.stats_out.jobs = true;
+		err = d.maint_timer.open(d.loop, [&d] {
+			if (d.on != 0)
+				run_jobs(d);
+			else if (set_power(d, true, REASON_MAINTENANCE))
+				d.maint_timer.arm_at(time(nullptr) + 60);
+		}, CLOCK_REALTIME);
+		if (!err)
+			err = d.maint.open(d.loop, d.opt.jobs, d.opt.jobs_state,
+					   [&d](const maint_job &j) {
+				if (j.status) {
+					logmsg("job %s failed: %s", j.name.c_str(),
+					       strerror(-j.status));
+					d.stats_out.jobs_failed++;
+				} else {
+					logmsg("job %s done%s", j.name.c_str(),
+					       j.late ? ", late" : "");
+					d.stats_out.jobs_run[j.late]++;
+				}
+				run_jobs(d);
+			});
+	}
+	if (!err && d.opt.smart)
+		err = d.smart_timer.open(d.loop, [&d] { read_smart(d); });
+	if (!err && !d.opt.automount.empty()) {
+		err = d.mount_timer.open(d.loop, [&d] { try_mount(d); });
+		if (!err)
+			err = d.am.open(d.loop, d.opt.automount,
+					[&d] { start_mount(d); });
+		if (err)
+			logmsg("no automount at %s", d.opt.automount.c_str());
+	}
+	if (!err && !d.opt.defer.empty()) {
+		d.frz.open(d.opt.defer);
+		d.stats_out.defer = true;
+		err = d.defer_timer.open(d.loop, [&d] {
+			if (d.on != 0 || set_power(d, true, REASON_DEFERRED))
+				set_deferred(d, false, REASON_DEFERRED);
+		});
+	}
+	if (!err && !d.opt.metrics.empty()) {
+		d.stats_out.watts = d.opt.watts;
+		d.sources_fd = open((d.opt.hwmon + "/hddsaver_wake_sources").c_str(),
+				    O_RDONLY | O_CLOEXEC);
+		read_sources(d);
+		err = d.exp.open(d.loop, d.opt.metrics, d.stats_out);
+	}
+	if (!err)
+		err = d.qos_timer.open(d.loop, [&d] { qos_changed(d); });
+	if (!err)
+		err = d.poll_timer.open(d.loop, [&d] { poll_tick(d); });
+	if (!err)
+		err = d.wake_timer.open(d.loop, [&d] {
+			if (d.on <= 0)
+				set_power(d, true, REASON_SCHEDULE);
+			arm_wake(d);
+		}, CLOCK_REALTIME);
+	if (!err && !d.opt.socket.empty())
+		err = d.ctl.open(d.loop, d.opt.socket, d.opt.socket_mode,
+				 d.opt.socket_group,
+				 [&d](const std::string &cmd, uid_t uid) {
+					 return handle_command(d, cmd, uid);
+				 });
+	if (!err)
+		err = add_signals(d.loop, { SIGTERM, SIGINT, SIGHUP },
+				  [&d](int sig) {
+			if (sig == SIGHUP) {
+				logmsg("reloading drive list");
+				load_disks(d);
+			} else {
+				d.loop.stop();
+			}
+		});
+	if (err) {
+		logmsg("setup failed: %s", strerror(-err));
+		return 1;
+	}
+
+	logmsg("watching %s", d.power.path().c_str());
+	poll_tick(d);
+	arm_wake(d);
+
+	err = d.loop.run();
+	if (err) {
+		logmsg("event loop failed: %s", strerror(-err));
+		return 1;
+	}
+
+	return 0;
+}
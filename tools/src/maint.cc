@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Maintenance jobs packed into as few HDD Saver power ons as possible
+ */
+#include "maint.h"
+#include "process.h"
+#include "rail.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+/* 90s, 15m, 6h, 30d or plain seconds, -1 if invalid */
+static time_t parse_time(const char *s)
+{
+	char *end;
+	long long v = strtoll(s, &end, 10);
+
+	if (end == s || v < 0)
+		return -1;
+	switch (*end) {
+	case 'd':
+		v *= 24;
+		/* fall through */
+	case 'h':
+		v *= 60;
+		/* fall through */
+	case 'm':
+		v *= 60;
+		/* fall through */
+	case 's':
+		end++;
+		break;
+	}
+
+	return *end ? -1 : v;
+}
+
+static bool conflict(const maint_job &a, const maint_job &b)
+{
+	if (a.drives.empty() || b.drives.empty())
+		return true;
+
+	for (const auto &d : a.drives)
+		if (std::find(b.drives.begin(), b.drives.end(), d) !=
+		    b.drives.end())
+			return true;
+
+	return false;
+}
+
+maintenance::~maintenance()
+{
+	for (auto &j : jobs) {
+		if (j.pidfd < 0)
+			continue;
+		loop->remove(j.pidfd);
+		close(j.pidfd);
+	}
+}
+
+int maintenance::open(event_loop &l, const std::string &config,
+		      const std::string &path, done_fn on_done)
+{
+	char line[4096], *save, *tok[5];
+	time_t now = time(nullptr);
+	FILE *f;
+	int err;
+
+	loop = &l;
+	state = path;
+	done = std::move(on_done);
+
+	err = hold_timer.open(l, [this] { check(); }, CLOCK_REALTIME);
+	if (err)
+		return err;
+
+	f = fopen(config.c_str(), "re");
+	if (!f)
+		return -errno;
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line + strspn(line, " \t"), *cmd;
+		maint_job j;
+		int i;
+
+		p[strcspn(p, "\n")] = '\0';
+		if (!*p || *p == '#')
+			continue;
+		for (i = 0; i < 5; i++)
+			if (!(tok[i] = strtok_r(i ? nullptr : p, " \t", &save)))
+				break;
+		cmd = i == 5 ? save + strspn(save, " \t") : nullptr;
+		if (!cmd || !*cmd) {
+			err = -EINVAL;
+			break;
+		}
+
+		j.name = tok[0];
+		j.every = parse_time(tok[1]);
+		j.within = parse_time(tok[2]);
+		j.duration = parse_time(tok[3]);
+		if (j.every <= 0 || j.within < 0 || j.within > j.every ||
+		    j.duration < 0) {
+			err = -EINVAL;
+			break;
+		}
+		if (strcmp(tok[4], "-"))
+			j.drives = split_list(tok[4]);
+		j.command = cmd;
+		/* Due now if never run, at the end of its window */
+		j.last = now - j.every + j.within;
+		jobs.push_back(std::move(j));
+	}
+	fclose(f);
+	if (err)
+		return err;
+
+	/* "NAME LAST" per line, LAST in seconds since the epoch */
+	f = fopen(state.c_str(), "re");
+	if (!f)
+		return errno == ENOENT ? 0 : -errno;
+	while (fgets(line, sizeof(line), f)) {
+		char name[256];
+		long long last;
+
+		if (sscanf(line, "%255s %lld", name, &last) != 2)
+			continue;
+		for (auto &j : jobs)
+			if (j.name == name)
+				j.last = last;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+int maintenance::save() const
+{
+	std::string tmp = state + ".tmp";
+	FILE *f;
+
+	f = fopen(tmp.c_str(), "we");
+	if (!f)
+		return -errno;
+	for (const auto &j : jobs)
+		fprintf(f, "%s %lld\n", j.name.c_str(), (long long)j.last);
+	if (fclose(f) || rename(tmp.c_str(), state.c_str())) {
+		int err = -errno;
+
+		unlink(tmp.c_str());
+		return err;
+	}
+
+	return 0;
+}
+
+bool maintenance::busy() const
+{
+	return std::any_of(jobs.begin(), jobs.end(),
+			   [](const maint_job &j) { return j.running; });
+}
+
+void maintenance::run(time_t now)
+{
+	std::vector<size_t> order, failed;
+	std::vector<const maint_job *> waiting;
+	int err;
+
+	for (size_t i = 0; i < jobs.size(); i++)
+		if (!jobs[i].running && now >= jobs[i].eligible())
+			order.push_back(i);
+	std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+		return jobs[a].deadline() < jobs[b].deadline();
+	});
+
+	for (size_t i : order) {
+		maint_job &j = jobs[i];
+		bool wait = false;
+
+		/* Later deadlines do not get ahead of earlier ones waiting */
+		for (const auto &r : jobs)
+			wait |= r.running && conflict(r, j);
+		for (const auto *w : waiting)
+			wait |= conflict(*w, j);
+		if (wait) {
+			waiting.push_back(&j);
+			continue;
+		}
+
+		/* Out of our process group, so that they trigger the automount */
+		j.pid = spawn({ "/bin/sh", "-c", j.command }, err, true);
+		if (!err) {
+			j.pidfd = pidfd_open(j.pid);
+			if (j.pidfd < 0) {
+				err = j.pidfd;
+				j.pidfd = -1;
+			}
+		}
+		if (!err) {
+			err = loop->add(j.pidfd, EPOLLIN, [this, i](uint32_t) {
+				exited(jobs[i]);
+			});
+			if (err) {
+				close(j.pidfd);
+				j.pidfd = -1;
+			}
+		}
+		j.status = err;
+		if (err) {
+			/* Not held for, due again a period from now */
+			if (j.pid > 0)
+				waitpid(j.pid, nullptr, WNOHANG);
+			j.late = false;
+			j.last = now;
+			failed.push_back(i);
+			continue;
+		}
+		j.running = true;
+		j.started = now;
+	}
+
+	if (!failed.empty())
+		save();
+	for (size_t i : failed)
+		if (done)
+			done(jobs[i]);
+	check();
+}
+
+void maintenance::exited(maint_job &j)
+{
+	int status;
+
+	if (waitpid(j.pid, &status, 0) < 0)
+		j.status = -errno;
+	else
+		j.status = exit_status(status);
+	loop->remove(j.pidfd);
+	close(j.pidfd);
+	j.pidfd = -1;
+
+	check();
+}
+
+void maintenance::check()
+{
+	time_t now = time(nullptr), next = 0;
+	std::vector<size_t> ended;
+
+	for (size_t i = 0; i < jobs.size(); i++) {
+		maint_job &j = jobs[i];
+
+		if (!j.running || j.pidfd >= 0)
+			continue;
+		if (now < j.started + j.duration) {
+			if (!next || j.started + j.duration < next)
+				next = j.started + j.duration;
+			continue;
+		}
+		j.running = false;
+		j.late = now > j.deadline();
+		j.last = j.started;
+		ended.push_back(i);
+	}
+
+	if (next)
+		hold_timer.arm_at(next);
+	else
+		hold_timer.disarm();
+	if (ended.empty())
+		return;
+
+	save();
+	for (size_t i : ended)
+		if (done)
+			done(jobs[i]);
+}
+
+time_t maintenance::next_start(time_t now) const
+{
+	time_t best = 0;
+
+	for (const auto &j : jobs)
+		if (!j.running && j.eligible() > now &&
+		    (!best || j.eligible() < best))
+			best = j.eligible();
+
+	return best;
+}
+
+time_t maintenance::next_wake(time_t lead) const
+{
+	std::vector<size_t> group(jobs.size());
+	time_t best = 0;
+
+	if (busy() || jobs.empty())
+		return 0;
+
+	/* Groups of jobs that share drives, transitively */
+	std::iota(group.begin(), group.end(), 0);
+	for (size_t a = 0; a < jobs.size(); a++) {
+		for (size_t b = a + 1; b < jobs.size(); b++) {
+			size_t from = group[b];
+
+			if (from == group[a] || !conflict(jobs[a], jobs[b]))
+				continue;
+			for (auto &g : group)
+				if (g == from)
+					g = group[a];
+		}
+	}
+
+	for (size_t g = 0; g < jobs.size(); g++) {
+		std::vector<const maint_job *> members;
+		time_t start = LLONG_MAX, first = LLONG_MAX;
+
+		for (size_t i = 0; i < jobs.size(); i++)
+			if (group[i] == g)
+				members.push_back(&jobs[i]);
+		if (members.empty())
+			continue;
+
+		/* One after the other, the latest deadline last */
+		std::sort(members.begin(), members.end(),
+			  [](const maint_job *a, const maint_job *b) {
+			return a->deadline() > b->deadline();
+		});
+		for (const auto *j : members) {
+			start = std::min(start, j->deadline()) - j->duration;
+			first = std::min(first, j->eligible());
+		}
+		/* Nothing could run any earlier, and the drives take lead */
+		start = std::max(start, first) - lead;
+		if (!best || start < best)
+			best = start;
+	}
+
+	return best;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Maintenance jobs packed into as few HDD Saver power ons as possible
+ */
+#ifndef HDDSAVER_MAINT_H
+#define HDDSAVER_MAINT_H
+
+#include "event_loop.h"
+
+#include <ctime>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace hddsaver {
+
+struct maint_job {
+	std::string name;
+	time_t every = 0;		/* Seconds between runs */
+	time_t within = 0;		/* May run this much before it is due */
+	time_t duration = 0;		/* Drives held at least this long */
+	std::vector<std::string> drives;	/* Empty for all of them */
+	std::string command;		/* For /bin/sh -c */
+
+	time_t last = 0;		/* Start of the last run */
+	bool running = false;
+	time_t started = 0;
+	pid_t pid = 0;
+	int pidfd = -1;			/* -1 once the command exited */
+	int status = 0;			/* Of the last run, or -errno */
+	bool late = false;		/* The last run ended after the deadline */
+
+	time_t deadline() const { return last + every; }
+	time_t eligible() const { return deadline() - within; }
+};
+
+/*
+ * Runs scrubs, SMART self-tests, backups and the like within their
+ * deadlines while the drives are on, and tells when the drives must be
+ * powered on for one. Jobs are read from a file, one per line:
+ *
+ *	NAME EVERY WITHIN DURATION DRIVES COMMAND...
+ *
+ * with times as 90s, 15m, 6h or 30d, and DRIVES a comma separated list
+ * or "-" for all of them. A job may run once it is due within WITHIN,
+ * and must be done by EVERY after its last run. Commands that only
+ * start the work, like a scrub or a long self-test, are given its
+ * DURATION, for which the drives are held after they exit.
+ *
+ * Every job that may run is started whenever the drives are on anyway,
+ * earliest deadline first. Jobs on the same drives run one after the
+ * other, the others at the same time. A power on is only asked for at
+ * the latest time that still lets each group of jobs sharing drives end
+ * by its deadlines, so the jobs that became runnable until then share it.
+ */
+class maintenance {
+public:
+	using done_fn = std::function<void(const maint_job &job)>;
+
+	maintenance() = default;
+	~maintenance();
+	maintenance(const maintenance &) = delete;
+	maintenance &operator=(const maintenance &) = delete;
+
+	/* The last runs are kept in state, jobs never run are due now */
+	int open(event_loop &loop, const std::string &config,
+		 const std::string &state, done_fn done);
+	bool empty() const { return jobs.empty(); }
+	const std::vector<maint_job> &list() const { return jobs; }
+
+	/* A job holds the drives */
+	bool busy() const;
+
+	/* Starts what may run now, with the drives on */
+	void run(time_t now);
+
+	/*
+	 * When the drives must be powered on for the next jobs, given they
+	 * are ready lead seconds after, 0 if never
+	 */
+	time_t next_wake(time_t lead) const;
+
+	/* When the next job may run, after now, 0 if none */
+	time_t next_start(time_t now) const;
+
+private:
+	int save() const;
+	void exited(maint_job &j);
+	void check();
+
+	event_loop *loop = nullptr;
+	std::string state;
+	done_fn done;
+	std::vector<maint_job> jobs;
+	timer hold_timer;		/* End of the DURATION of a job */
+};
+
+} /* namespace hddsaver */
+
+#endif
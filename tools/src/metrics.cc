@@ -0,0 +1,633 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Prometheus/OpenMetrics exporter of hddsaverd
+ */
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+static const char *const reason_names[NR_REASONS] = {
+	"idle", "request", "schedule", "external", "deferred", "access",
+	"maintenance",
+};
+
+constexpr double metrics::buckets[];
+
+const char *reason_name(wake_reason why)
+{
+	return reason_names[why];
+}
+
+void metrics::set_state(int new_on, wake_reason why, uint64_t now)
+{
+	if (new_on == on)
+		return;
+
+	if (on == 0)
+		off_ms += now - since_ms;
+	if (on >= 0)
+		transitions[new_on][why]++;
+	on = new_on;
+	since_ms = now;
+}
+
+/* Buckets are cumulative, as exposed */
+void metrics::observe_wake(uint64_t ms)
+{
+	double s = ms / 1000.0;
+
+	for (unsigned int i = 0; i < NR_BUCKETS; i++)
+		if (s <= buckets[i])
+			latency_buckets[i]++;
+	latency_count++;
+	latency_sum += s;
+}
+
+/* The kernel keeps 16 sources, each line replaces the counts read last */
+void metrics::parse_sources(const char *buf)
+{
+	nr_sources = 0;
+	while (*buf && nr_sources < NR_SOURCES) {
+		source &src = sources[nr_sources];
+		const char *end = strchr(buf, '\n');
+		size_t len = end ? end - buf : strlen(buf);
+		char *comm;
+
+		src.wakes = strtoull(buf, &comm, 10);
+		if (comm != buf && *comm == ' ') {
+			comm++;
+			len -= comm - buf;
+			if (len >= sizeof(src.comm))
+				len = sizeof(src.comm) - 1;
+			memcpy(src.comm, comm, len);
+			src.comm[len] = '\0';
+			nr_sources++;
+		}
+		if (!end)
+			break;
+		buf = end + 1;
+	}
+}
+
+metrics::drive *metrics::find_drive(const std::string &name, bool add)
+{
+	for (unsigned int i = 0; i < nr_drives; i++)
+		if (name == drives[i].name)
+			return &drives[i];
+	if (!add || nr_drives == NR_DRIVES || name.size() >= sizeof(drives[0].name))
+		return nullptr;
+
+	drive &d = drives[nr_drives++];
+
+	strcpy(d.name, name.c_str());
+	d.smart = smart_data();
+
+	return &d;
+}
+
+namespace {
+
+struct writer {
+	char *buf;
+	size_t size;
+	size_t len = 0;
+	bool ok = true;
+
+	writer(char *b, size_t s) : buf(b), size(s) {}
+
+	void add(const char *fmt, ...) __attribute__((format(printf, 2, 3)))
+	{
+		va_list ap;
+		int n;
+
+		if (!ok)
+			return;
+		va_start(ap, fmt);
+		n = vsnprintf(buf + len, size - len, fmt, ap);
+		va_end(ap);
+		if (n < 0 || (size_t)n >= size - len)
+			ok = false;
+		else
+			len += n;
+	}
+
+	/* Label values, escaped as the exposition formats want */
+	void label(const char *s)
+	{
+		for (; *s && ok; s++) {
+			if (*s == '\\' || *s == '"')
+				add("\\%c", *s);
+			else if (*s == '\n')
+				add("\\n");
+			else
+				add("%c", *s);
+		}
+	}
+
+	/* OpenMetrics names counter families without the _total suffix */
+	void family(const char *name, const char *type, const char *help,
+		    bool openmetrics)
+	{
+		const char *suffix = "";
+
+		if (!openmetrics && !strcmp(type, "counter"))
+			suffix = "_total";
+		add("# HELP %s%s %s\n", name, suffix, help);
+		add("# TYPE %s%s %s\n", name, suffix, type);
+	}
+};
+
+} /* namespace */
+
+/* SMART data as last read, with its age */
+static void render_drives(writer &w, const metrics &m, bool openmetrics,
+			  uint64_t now)
+{
+	unsigned int i, j;
+
+	if (!m.nr_drives)
+		return;
+
+	w.family("hddsaver_drive_smart_age_seconds", "gauge",
+		 "Time since the SMART data was read", openmetrics);
+	for (i = 0; i < m.nr_drives; i++)
+		if (m.drives[i].smart.read_ms)
+			w.add("hddsaver_drive_smart_age_seconds{disk=\"%s\"} %.3f\n",
+			      m.drives[i].name,
+			      (now - m.drives[i].smart.read_ms) / 1000.0);
+	w.family("hddsaver_drive_temperature_celsius", "gauge",
+		 "Drive temperature from SMART", openmetrics);
+	for (i = 0; i < m.nr_drives; i++)
+		if (m.drives[i].smart.read_ms && m.drives[i].smart.temperature >= 0)
+			w.add("hddsaver_drive_temperature_celsius{disk=\"%s\"} %d\n",
+			      m.drives[i].name, m.drives[i].smart.temperature);
+	w.family("hddsaver_drive_smart_failing", "gauge",
+		 "1 if a SMART attribute is at or below its threshold",
+		 openmetrics);
+	for (i = 0; i < m.nr_drives; i++)
+		if (m.drives[i].smart.read_ms)
+			w.add("hddsaver_drive_smart_failing{disk=\"%s\"} %d\n",
+			      m.drives[i].name, m.drives[i].smart.failing);
+
+	w.family("hddsaver_drive_smart_value", "gauge",
+		 "Normalized SMART attribute values", openmetrics);
+	for (i = 0; i < m.nr_drives; i++)
+		for (j = 0; j < m.drives[i].smart.nr_attrs; j++) {
+			const smart_attr &a = m.drives[i].smart.attrs[j];
+
+			w.add("hddsaver_drive_smart_value{disk=\"%s\",id=\"%u\",name=\"%s\"} %u\n",
+			      m.drives[i].name, a.id, smart_attr_name(a.id),
+			      a.value);
+		}
+	w.family("hddsaver_drive_smart_raw", "gauge",
+		 "Raw SMART attribute values", openmetrics);
+	for (i = 0; i < m.nr_drives; i++)
+		for (j = 0; j < m.drives[i].smart.nr_attrs; j++) {
+			const smart_attr &a = m.drives[i].smart.attrs[j];
+
+			w.add("hddsaver_drive_smart_raw{disk=\"%s\",id=\"%u\",name=\"%s\"} %llu\n",
+			      m.drives[i].name, a.id, smart_attr_name(a.id),
+			      (unsigned long long)a.raw);
+		}
+}
+
+size_t metrics::render(char *buf, size_t size, bool openmetrics,
+		       uint64_t now) const
+{
+	writer w(buf, size);
+	uint64_t off = off_ms + (on == 0 ? now - since_ms : 0);
+
+	if (on >= 0) {
+		w.family("hddsaver_power", "gauge",
+			 "1 if the HDD Saver power is on", openmetrics);
+		w.add("hddsaver_power %d\n", on);
+		w.family("hddsaver_state_seconds", "gauge",
+			 "Time since the power last changed", openmetrics);
+		w.add("hddsaver_state_seconds %.3f\n", (now - since_ms) / 1000.0);
+	}
+
+	w.family("hddsaver_transitions", "counter",
+		 "Power changes by direction and reason", openmetrics);
+	for (int to = 0; to < 2; to++)
+		for (int r = 0; r < NR_REASONS; r++)
+			w.add("hddsaver_transitions_total{to=\"%s\",reason=\"%s\"} %llu\n",
+			      to ? "on" : "off", reason_name(wake_reason(r)),
+			      (unsigned long long)transitions[to][r]);
+
+	w.family("hddsaver_power_off_refused", "counter",
+		 "Power offs not done because a client held the drives",
+		 openmetrics);
+	w.add("hddsaver_power_off_refused_total %llu\n",
+	      (unsigned long long)refused);
+
+	w.family("hddsaver_power_offs", "counter",
+		 "Power offs, by whether a metadata prefetch came first",
+		 openmetrics);
+	for (int p = 0; p < 2; p++)
+		w.add("hddsaver_power_offs_total{prefetch=\"%s\"} %llu\n",
+		      p ? "yes" : "no", (unsigned long long)offs[p]);
+	w.family("hddsaver_early_wakes", "counter",
+		 "Wakes by drive access within 10 minutes of a power off",
+		 openmetrics);
+	for (int p = 0; p < 2; p++)
+		w.add("hddsaver_early_wakes_total{prefetch=\"%s\"} %llu\n",
+		      p ? "yes" : "no", (unsigned long long)early_wakes[p]);
+
+	if (prefetch_walks) {
+		w.family("hddsaver_prefetch_walks", "counter",
+			 "Metadata prefetches before power off", openmetrics);
+		w.add("hddsaver_prefetch_walks_total %llu\n",
+		      (unsigned long long)prefetch_walks);
+		w.family("hddsaver_prefetch_entries", "counter",
+			 "Directory entries read by the prefetches", openmetrics);
+		w.add("hddsaver_prefetch_entries_total %llu\n",
+		      (unsigned long long)prefetch_entries);
+		w.family("hddsaver_prefetch_seconds", "counter",
+			 "Time spent prefetching", openmetrics);
+		w.add("hddsaver_prefetch_seconds_total %.3f\n",
+		      prefetch_ms / 1000.0);
+		w.family("hddsaver_prefetch_pinned_dirs", "gauge",
+			 "Directories kept open while the power is off",
+			 openmetrics);
+		w.add("hddsaver_prefetch_pinned_dirs %llu\n",
+		      (unsigned long long)pinned);
+	}
+
+	if (defer) {
+		w.family("hddsaver_deferred_releases", "counter",
+			 "Releases of the deferred jobs, at a wake or at the deadline",
+			 openmetrics);
+		w.add("hddsaver_deferred_releases_total{cause=\"wake\"} %llu\n",
+		      (unsigned long long)defer_releases[0]);
+		w.add("hddsaver_deferred_releases_total{cause=\"deadline\"} %llu\n",
+		      (unsigned long long)defer_releases[1]);
+		w.family("hddsaver_deferred_seconds", "counter",
+			 "Time the deferred jobs were frozen", openmetrics);
+		w.add("hddsaver_deferred_seconds_total %.3f\n",
+		      deferred_ms / 1000.0);
+	}
+
+	if (bringups) {
+		w.family("hddsaver_volume_bringups", "counter",
+			 "Bring-ups of the arrays and volume groups after a power on",
+			 openmetrics);
+		w.add("hddsaver_volume_bringups_total %llu\n",
+		      (unsigned long long)bringups);
+		w.family("hddsaver_volume_bringup_seconds", "counter",
+			 "Time from power on until they were all up", openmetrics);
+		w.add("hddsaver_volume_bringup_seconds_total %.3f\n",
+		      bringup_ms / 1000.0);
+	}
+
+	if (mounts) {
+		w.family("hddsaver_automounts", "counter",
+			 "Automounts that powered the drives on", openmetrics);
+		w.add("hddsaver_automounts_total %llu\n",
+		      (unsigned long long)mounts);
+		w.family("hddsaver_automount_seconds", "counter",
+			 "Time from power on until mounted", openmetrics);
+		w.add("hddsaver_automount_seconds_total %.3f\n",
+		      mount_ms / 1000.0);
+	}
+
+	if (jobs) {
+		w.family("hddsaver_jobs_run", "counter",
+			 "Maintenance jobs run, within or after their deadline",
+			 openmetrics);
+		w.add("hddsaver_jobs_run_total{late=\"no\"} %llu\n",
+		      (unsigned long long)jobs_run[0]);
+		w.add("hddsaver_jobs_run_total{late=\"yes\"} %llu\n",
+		      (unsigned long long)jobs_run[1]);
+		w.family("hddsaver_jobs_failed", "counter",
+			 "Maintenance jobs that failed", openmetrics);
+		w.add("hddsaver_jobs_failed_total %llu\n",
+		      (unsigned long long)jobs_failed);
+	}
+
+	if (qos_requests) {
+		w.family("hddsaver_wake_latency_limit_seconds", "gauge",
+			 "Shortest wake the clients accept now, 0 for no limit",
+			 openmetrics);
+		w.add("hddsaver_wake_latency_limit_seconds %.3f\n",
+		      qos_limit_ms / 1000.0);
+		w.family("hddsaver_standbys", "counter",
+			 "Spin downs with the power left on, for the wake latency",
+			 openmetrics);
+		w.add("hddsaver_standbys_total %llu\n",
+		      (unsigned long long)standbys);
+	}
+
+	w.family("hddsaver_wake_latency_seconds", "histogram",
+		 "Time from power on until the drives reappeared", openmetrics);
+	for (unsigned int i = 0; i < NR_BUCKETS; i++)
+		w.add("hddsaver_wake_latency_seconds_bucket{le=\"%.1f\"} %llu\n",
+		      buckets[i], (unsigned long long)latency_buckets[i]);
+	w.add("hddsaver_wake_latency_seconds_bucket{le=\"+Inf\"} %llu\n",
+	      (unsigned long long)latency_count);
+	w.add("hddsaver_wake_latency_seconds_sum %.3f\n", latency_sum);
+	w.add("hddsaver_wake_latency_seconds_count %llu\n",
+	      (unsigned long long)latency_count);
+
+	if (nr_sources) {
+		w.family("hddsaver_wakes", "counter",
+			 "Power ons caused by each process, from hddsaver_wake_sources",
+			 openmetrics);
+		for (unsigned int i = 0; i < nr_sources; i++) {
+			w.add("hddsaver_wakes_total{source=\"");
+			w.label(sources[i].comm);
+			w.add("\"} %llu\n", (unsigned long long)sources[i].wakes);
+		}
+	}
+
+	render_drives(w, *this, openmetrics, now);
+
+	w.family("hddsaver_off_seconds", "counter",
+		 "Time the power was off", openmetrics);
+	w.add("hddsaver_off_seconds_total %.3f\n", off / 1000.0);
+	w.family("hddsaver_energy_saved_joules", "counter",
+		 "Estimated energy saved while the power was off", openmetrics);
+	w.add("hddsaver_energy_saved_joules_total %.1f\n",
+	      off / 1000.0 * watts);
+
+	if (openmetrics)
+		w.add("# EOF\n");
+
+	return w.ok ? w.len : 0;
+}
+
+exporter::~exporter()
+{
+	for (auto &c : clients) {
+		if (c.fd < 0)
+			continue;
+		loop->remove(c.fd);
+		close(c.fd);
+	}
+	if (fd < 0)
+		return;
+	loop->remove(fd);
+	close(fd);
+	if (!path.empty())
+		unlink(path.c_str());
+}
+
+static bool is_loopback(const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	if (sa->sa_family == AF_INET)
+		return (ntohl(sin->sin_addr.s_addr) >> 24) == 127;
+	if (sa->sa_family == AF_INET6)
+		return IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr);
+
+	return false;
+}
+
+/* Metrics are for this host only, other addresses are refused */
+static int listen_tcp(const std::string &addr)
+{
+	struct addrinfo hints = {}, *res;
+	size_t colon = addr.rfind(':');
+	std::string host, port;
+	int fd, one = 1, err;
+
+	if (colon == std::string::npos)
+		return -EINVAL;
+	host = addr.substr(0, colon);
+	port = addr.substr(colon + 1);
+	if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+		return -EINVAL;
+	if (!is_loopback(res->ai_addr)) {
+		freeaddrinfo(res);
+		return -EADDRNOTAVAIL;
+	}
+
+	fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    0);
+	if (fd < 0) {
+		err = -errno;
+		freeaddrinfo(res);
+		return err;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 4)) {
+		err = -errno;
+		freeaddrinfo(res);
+		close(fd);
+		return err;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+static int listen_unix(const std::string &path)
+{
+	struct sockaddr_un addr = {};
+	int fd, err;
+
+	if (path.size() >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	unlink(path.c_str());
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 4)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+int exporter::open(event_loop &l, const std::string &addr, const metrics &mt)
+{
+	bool is_path = addr.find('/') != std::string::npos;
+	int err;
+
+	fd = is_path ? listen_unix(addr) : listen_tcp(addr);
+	if (fd < 0)
+		return fd;
+
+	loop = &l;
+	m = &mt;
+	if (is_path)
+		path = addr;
+	err = deadline_timer.open(l, [this] { expire(); });
+	if (!err)
+		err = loop->add(fd, EPOLLIN,
+				[this](uint32_t) { accept_client(); });
+	if (err) {
+		close(fd);
+		fd = -1;
+	}
+
+	return err;
+}
+
+void exporter::accept_client()
+{
+	client *c = nullptr;
+	int cfd;
+
+	cfd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
+	for (auto &slot : clients) {
+		if (slot.fd < 0) {
+			c = &slot;
+			break;
+		}
+	}
+	if (!c || loop->add(cfd, EPOLLIN, [this, c](uint32_t) { receive(*c); })) {
+		close(cfd);
+		return;
+	}
+
+	c->fd = cfd;
+	c->deadline = now_ms() + CLIENT_TIMEOUT_MS;
+	c->len = 0;
+	if (!deadline_timer.armed())
+		deadline_timer.arm(CLIENT_TIMEOUT_MS);
+}
+
+/* Up to the end of the headers, one request per connection */
+void exporter::receive(client &c)
+{
+	ssize_t n = read(c.fd, c.req + c.len, sizeof(c.req) - 1 - c.len);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			drop(c);
+		return;
+	}
+	c.len += n;
+	c.req[c.len] = '\0';
+	if (n && c.len < sizeof(c.req) - 1 && !strstr(c.req, "\r\n\r\n") &&
+	    !strstr(c.req, "\n\n"))
+		return;
+
+	respond(c);
+}
+
+/* Formatted into the buffers of the connection, sent from there */
+void exporter::respond(client &c)
+{
+	static const char not_found[] =
+		"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	/* More drives and attributes than the buffer holds */
+	static const char too_large[] =
+		"HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	bool openmetrics;
+
+	if (!c.len) {
+		drop(c);
+		return;
+	}
+	c.body_len = 0;
+	c.sent = 0;
+	if (strncmp(c.req, "GET /metrics ", 13) &&
+	    strncmp(c.req, "GET / ", 6)) {
+		memcpy(c.head, not_found, sizeof(not_found) - 1);
+		c.head_len = sizeof(not_found) - 1;
+	} else {
+		openmetrics = strcasestr(c.req, "application/openmetrics-text");
+		c.body_len = m->render(c.body, sizeof(c.body), openmetrics,
+				       now_ms());
+		if (!c.body_len) {
+			memcpy(c.head, too_large, sizeof(too_large) - 1);
+			c.head_len = sizeof(too_large) - 1;
+		} else {
+			c.head_len = snprintf(c.head, sizeof(c.head),
+				"HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+				"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+				openmetrics ?
+				"application/openmetrics-text; version=1.0.0; charset=utf-8" :
+				"text/plain; version=0.0.4; charset=utf-8",
+				c.body_len);
+		}
+	}
+
+	loop->remove(c.fd);
+	if (loop->add(c.fd, EPOLLOUT, [this, p = &c](uint32_t) { send(*p); })) {
+		drop(c);
+		return;
+	}
+	send(c);
+}
+
+void exporter::send(client &c)
+{
+	size_t body_sent = c.sent > c.head_len ? c.sent - c.head_len : 0;
+	struct iovec iov[2];
+	ssize_t n;
+	int i = 0;
+
+	if (c.sent < c.head_len)
+		iov[i++] = { c.head + c.sent, c.head_len - c.sent };
+	iov[i++] = { c.body + body_sent, c.body_len - body_sent };
+	n = writev(c.fd, iov, i);
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0)
+		c.sent += n;
+	if (n < 0 || c.sent == c.head_len + c.body_len)
+		drop(c);
+}
+
+void exporter::drop(client &c)
+{
+	loop->remove(c.fd);
+	close(c.fd);
+	c.fd = -1;
+}
+
+/* Whatever did not finish by its deadline, the timer follows the next */
+void exporter::expire()
+{
+	uint64_t now = now_ms(), next = 0;
+
+	for (auto &c : clients) {
+		if (c.fd < 0)
+			continue;
+		if (c.deadline <= now) {
+			drop(c);
+			continue;
+		}
+		if (!next || c.deadline < next)
+			next = c.deadline;
+	}
+	if (next)
+		deadline_timer.arm(next - now);
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Prometheus/OpenMetrics exporter of hddsaverd
+ */
+#ifndef HDDSAVER_METRICS_H
+#define HDDSAVER_METRICS_H
+
+#include "event_loop.h"
+#include "smart.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace hddsaver {
+
+enum wake_reason {
+	REASON_IDLE,		/* Power off after the idle timeout */
+	REASON_REQUEST,		/* Control socket */
+	REASON_SCHEDULE,	/* --wake-at */
+	REASON_EXTERNAL,	/* Changed behind the daemon's back */
+	REASON_DEFERRED,	/* Deferred jobs waited long enough */
+	REASON_ACCESS,		/* A lookup below --automount */
+	REASON_MAINTENANCE,	/* --jobs due */
+	NR_REASONS,
+};
+
+const char *reason_name(wake_reason why);
+
+/*
+ * What the daemon saw happen, kept in fixed tables. Scrapes only format
+ * these, they never read an attribute, let alone the chip.
+ */
+struct metrics {
+	static constexpr unsigned int NR_BUCKETS = 9;
+	static constexpr unsigned int NR_SOURCES = 32;
+	static constexpr unsigned int NR_DRIVES = 8;
+	static constexpr double buckets[NR_BUCKETS] = {
+		1, 2, 5, 10, 15, 20, 30, 60, 120
+	};
+
+	struct source {
+		char comm[32];
+		uint64_t wakes;
+	};
+
+	/* Read while the drives were on, served from here while off */
+	struct drive {
+		char name[32];
+		smart_data smart;
+	};
+
+	double watts = 10;		/* Of the drives while spinning */
+	int on = -1;
+	uint64_t since_ms = 0;		/* Of the current state */
+	uint64_t off_ms = 0;		/* Before that */
+	uint64_t transitions[2][NR_REASONS] = {};	/* [on][reason] */
+	uint64_t refused = 0;		/* Power offs while held */
+
+	/* [prefetched], wakes by access soon after a power off */
+	uint64_t offs[2] = {};
+	uint64_t early_wakes[2] = {};
+
+	uint64_t prefetch_walks = 0;
+	uint64_t prefetch_entries = 0;
+	uint64_t prefetch_ms = 0;
+	uint64_t pinned = 0;
+
+	bool defer = false;		/* Jobs are deferred while off */
+	uint64_t defer_releases[2] = {};	/* [at the deadline] */
+	uint64_t deferred_ms = 0;
+
+	uint64_t bringups = 0;		/* Of the arrays and volume groups */
+	uint64_t bringup_ms = 0;	/* From power on until all were up */
+	uint64_t mounts = 0;		/* Automounts that powered the drives on */
+	uint64_t mount_ms = 0;
+
+	bool jobs = false;		/* Maintenance jobs are scheduled */
+	uint64_t jobs_run[2] = {};	/* [late] */
+	uint64_t jobs_failed = 0;
+
+	uint64_t qos_requests = 0;	/* Latency requests made */
+	uint64_t qos_limit_ms = 0;	/* Of the requests now, 0 none */
+	uint64_t standbys = 0;		/* Spin downs instead of power offs */
+
+	uint64_t latency_buckets[NR_BUCKETS] = {};
+	uint64_t latency_count = 0;
+	double latency_sum = 0;
+
+	source sources[NR_SOURCES] = {};
+	unsigned int nr_sources = 0;
+
+	drive drives[NR_DRIVES] = {};
+	unsigned int nr_drives = 0;
+
+	/* The entry of a drive, added if there is room, or nullptr */
+	drive *find_drive(const std::string &name, bool add);
+
+	void set_state(int on, wake_reason why, uint64_t now);
+	void observe_wake(uint64_t ms);
+
+	/* Parses hddsaver_wake_sources, "count comm" per line */
+	void parse_sources(const char *buf);
+
+	/* Returns the length, or 0 if size was too small */
+	size_t render(char *buf, size_t size, bool openmetrics,
+		      uint64_t now) const;
+};
+
+/*
+ * Serves GET /metrics over HTTP/1.0, one request per connection, on a
+ * loopback TCP port or a Unix socket. Clients are read and written from
+ * the loop as they are ready, and dropped at a deadline, so a slow
+ * scraper only holds its own connection. Each connection has its own
+ * preallocated buffers, nothing is allocated per scrape.
+ */
+class exporter {
+public:
+	exporter() = default;
+	~exporter();
+	exporter(const exporter &) = delete;
+	exporter &operator=(const exporter &) = delete;
+
+	/* addr is HOST:PORT with a loopback HOST, or a socket path */
+	int open(event_loop &loop, const std::string &addr, const metrics &m);
+
+private:
+	static constexpr size_t BUF_SIZE = 65536;
+	static constexpr size_t MAX_CLIENTS = 4;
+	static constexpr uint64_t CLIENT_TIMEOUT_MS = 5000;
+
+	struct client {
+		int fd = -1;		/* -1 if the slot is free */
+		uint64_t deadline;
+		size_t len;
+		char req[1024];
+		size_t head_len;
+		size_t body_len;
+		size_t sent;		/* Of head and body together */
+		char head[256];
+		char body[BUF_SIZE];
+	};
+
+	void accept_client();
+	void receive(client &c);
+	void respond(client &c);
+	void send(client &c);
+	void drop(client &c);
+	void expire();
+
+	event_loop *loop = nullptr;
+	const metrics *m = nullptr;
+	std::string path;
+	int fd = -1;
+	client clients[MAX_CLIENTS];
+	timer deadline_timer;
+};
+
+} /* namespace hddsaver */
+
+#endif
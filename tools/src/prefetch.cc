@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Metadata prefetch before the HDD Saver power goes off
+ */
+#include "prefetch.h"
+#include "event_loop.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace hddsaver {
+
+namespace {
+
+struct dir_item {
+	int64_t atime;			/* ns, roots come first */
+	dev_t dev;
+	std::string path;
+
+	bool operator<(const dir_item &o) const { return atime < o.atime; }
+};
+
+struct walk_state {
+	const prefetch_options &opt;
+	std::vector<int> &pins;
+
+	std::mutex lock;		/* Protects all but entries */
+	std::condition_variable cond;
+	std::priority_queue<dir_item> queue;
+	unsigned int busy = 0;		/* Workers scanning a directory */
+	bool stop = false;
+	uint64_t dirs = 0;
+	std::atomic<uint64_t> entries{0};
+
+	walk_state(const prefetch_options &o, std::vector<int> &p)
+		: opt(o), pins(p) {}
+};
+
+} /* namespace */
+
+static int64_t ns(const struct timespec &ts)
+{
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* stat()s every entry, the subdirectories found go to found */
+static void scan(walk_state &w, const dir_item &item,
+		 std::vector<dir_item> &found)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int fd;
+
+	fd = open(item.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(d)) != nullptr) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (w.entries.fetch_add(1) >= w.opt.budget) {
+			std::lock_guard<std::mutex> g(w.lock);
+
+			w.stop = true;
+			break;
+		}
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (S_ISDIR(st.st_mode) && st.st_dev == item.dev)
+			found.push_back({ ns(st.st_atim), item.dev,
+					  item.path + "/" + de->d_name });
+	}
+	closedir(d);
+}
+
+static void worker(walk_state &w)
+{
+	std::unique_lock<std::mutex> l(w.lock);
+	std::vector<dir_item> found;
+
+	for (;;) {
+		w.cond.wait(l, [&w] {
+			return w.stop || !w.queue.empty() || !w.busy;
+		});
+		if (w.stop || w.queue.empty())
+			break;
+
+		dir_item item = w.queue.top();
+
+		w.queue.pop();
+		w.busy++;
+		l.unlock();
+
+		found.clear();
+		scan(w, item, found);
+
+		l.lock();
+		w.busy--;
+		w.dirs++;
+		if (w.pins.size() < w.opt.pin) {
+			int fd = open(item.path.c_str(),
+				      O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+			if (fd >= 0)
+				w.pins.push_back(fd);
+		}
+		for (auto &f : found)
+			w.queue.push(std::move(f));
+		w.cond.notify_all();
+	}
+	w.cond.notify_all();
+}
+
+prefetcher::~prefetcher()
+{
+	release();
+}
+
+void prefetcher::release()
+{
+	for (int fd : pins)
+		close(fd);
+	pins.clear();
+}
+
+int prefetcher::walk(const prefetch_options &opt, prefetch_result &res)
+{
+	walk_state w(opt, pins);
+	std::vector<std::thread> threads;
+	uint64_t start = now_ms();
+	struct stat st;
+
+	release();
+	for (const auto &root : opt.roots) {
+		if (stat(root.c_str(), &st))
+			return -errno;
+		if (!S_ISDIR(st.st_mode))
+			return -ENOTDIR;
+		w.queue.push({ INT64_MAX, st.st_dev, root });
+	}
+
+	for (unsigned int i = 0; i < std::max(opt.threads, 1U); i++)
+		threads.emplace_back(worker, std::ref(w));
+	for (auto &t : threads)
+		t.join();
+
+	res.entries = std::min<uint64_t>(w.entries, opt.budget);
+	res.dirs = w.dirs;
+	res.ms = now_ms() - start;
+	res.truncated = w.stop;
+
+	return 0;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Metadata prefetch before the HDD Saver power goes off
+ */
+#ifndef HDDSAVER_PREFETCH_H
+#define HDDSAVER_PREFETCH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+struct prefetch_options {
+	std::vector<std::string> roots;
+	uint64_t budget = 65536;	/* Entries, about 1 KiB of cache each */
+	unsigned int pin = 1024;	/* Directories kept open while off */
+	unsigned int threads = 4;
+};
+
+struct prefetch_result {
+	uint64_t entries = 0;
+	uint64_t dirs = 0;
+	uint64_t ms = 0;
+	bool truncated = false;		/* Stopped at the budget */
+};
+
+/*
+ * Walks the trees below the roots so the dentry, inode and directory
+ * block caches hold them when the drives go away, and lookups there need
+ * no wake. Every entry is stat()ed, without following symlinks or
+ * leaving the root's file system.
+ *
+ * The walk takes the directories accessed last first, by their atime, so
+ * with a budget smaller than the trees the ones in use are covered and
+ * cold archives are not. The directories walked first stay open, with
+ * O_PATH, until release(), which keeps the kernel from reclaiming them.
+ * Their entries can still be reclaimed under memory pressure.
+ */
+class prefetcher {
+public:
+	prefetcher() = default;
+	~prefetcher();
+	prefetcher(const prefetcher &) = delete;
+	prefetcher &operator=(const prefetcher &) = delete;
+
+	/* Blocks until the walk is done */
+	int walk(const prefetch_options &opt, prefetch_result &res);
+
+	/* Closes the directories kept open */
+	void release();
+	size_t pinned() const { return pins.size(); }
+
+private:
+	std::vector<int> pins;
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Helper processes started by hddsaverd
+ */
+#include "process.h"
+
+#include <cerrno>
+#include <csignal>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace hddsaver {
+
+pid_t spawn(const std::vector<std::string> &args, int &err, bool group)
+{
+	std::vector<char *> argv;
+	posix_spawnattr_t attr;
+	sigset_t none, all;
+	short flags;
+	pid_t pid;
+
+	for (const auto &a : args)
+		argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	/* The loop blocks the signals it takes, children get them back */
+	sigemptyset(&none);
+	sigfillset(&all);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &all);
+	flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	if (group) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(&attr, 0);
+	}
+	posix_spawnattr_setflags(&attr, flags);
+	err = -posix_spawnp(&pid, argv[0], nullptr, &attr, argv.data(),
+			    environ);
+	posix_spawnattr_destroy(&attr);
+
+	return err ? -1 : pid;
+}
+
+int pidfd_open(pid_t pid)
+{
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+
+	return fd < 0 ? -errno : fd;
+}
+
+int exit_status(int status)
+{
+	if (WIFEXITED(status) && !WEXITSTATUS(status))
+		return 0;
+
+	return -EIO;
+}
+
+} /* namespace hddsaver */
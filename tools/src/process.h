@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Helper processes started by hddsaverd
+ */
+#ifndef HDDSAVER_PROCESS_H
+#define HDDSAVER_PROCESS_H
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace hddsaver {
+
+/*
+ * Looked up in PATH, -1 with err set if it could not be started. With
+ * group the process leads a process group of its own, and is not taken
+ * for the daemon by autofs.
+ */
+pid_t spawn(const std::vector<std::string> &args, int &err,
+	    bool group = false);
+
+/* A pidfd polls readable once the process exited, -errno on error */
+int pidfd_open(pid_t pid);
+
+/* 0 for a zero exit code, -EIO otherwise */
+int exit_status(int status);
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Wake latency constraints of the clients of hddsaverd
+ */
+#include "qos.h"
+
+#include <algorithm>
+
+namespace hddsaver {
+
+unsigned int latency_qos::add(const std::string &name, uint64_t max_ms,
+			      uint64_t lifetime_ms, uint64_t now)
+{
+	requests.push_back({ next_id, name, max_ms, now + lifetime_ms });
+
+	return next_id++;
+}
+
+bool latency_qos::renew(unsigned int id, uint64_t lifetime_ms, uint64_t now)
+{
+	for (auto &r : requests) {
+		if (r.id != id || r.expires <= now)
+			continue;
+		r.expires = now + lifetime_ms;
+		return true;
+	}
+
+	return false;
+}
+
+bool latency_qos::remove(unsigned int id)
+{
+	auto it = std::find_if(requests.begin(), requests.end(),
+			       [id](const qos_request &r) { return r.id == id; });
+
+	if (it == requests.end())
+		return false;
+	requests.erase(it);
+
+	return true;
+}
+
+uint64_t latency_qos::limit(uint64_t now)
+{
+	uint64_t min = NO_LIMIT;
+
+	requests.erase(std::remove_if(requests.begin(), requests.end(),
+				      [now](const qos_request &r) {
+		return r.expires <= now;
+	}), requests.end());
+
+	for (const auto &r : requests)
+		min = std::min(min, r.max_ms);
+
+	return min;
+}
+
+uint64_t latency_qos::next_expiry() const
+{
+	uint64_t first = 0;
+
+	for (const auto &r : requests)
+		if (!first || r.expires < first)
+			first = r.expires;
+
+	return first;
+}
+
+} /* namespace hddsaver */
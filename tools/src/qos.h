@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Wake latency constraints of the clients of hddsaverd
+ */
+#ifndef HDDSAVER_QOS_H
+#define HDDSAVER_QOS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+struct qos_request {
+	unsigned int id;
+	std::string name;
+	uint64_t max_ms;		/* Longest acceptable wake */
+	uint64_t expires;		/* now_ms() */
+};
+
+/*
+ * Like the PM QoS latency requests of the kernel: every client says how
+ * long a wake of the drives it can wait for, and the daemon keeps them
+ * in the deepest state whose wake is shorter than all of them. Requests
+ * have a lifetime, clients renew them, so a client that went away does
+ * not keep the drives up.
+ */
+class latency_qos {
+public:
+	static constexpr uint64_t NO_LIMIT = UINT64_MAX;
+
+	/* Returns the id of the request */
+	unsigned int add(const std::string &name, uint64_t max_ms,
+			 uint64_t lifetime_ms, uint64_t now);
+	bool renew(unsigned int id, uint64_t lifetime_ms, uint64_t now);
+	bool remove(unsigned int id);
+
+	/* Drops the expired requests, NO_LIMIT without any left */
+	uint64_t limit(uint64_t now);
+
+	/* When the first request expires, 0 without any */
+	uint64_t next_expiry() const;
+
+	const std::vector<qos_request> &list() const { return requests; }
+
+private:
+	std::vector<qos_request> requests;
+	unsigned int next_id = 1;
+};
+
+} /* namespace hddsaver */
+
+#endif
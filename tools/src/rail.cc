@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Access to the HDD Saver attributes of the nct6775 hwmon device
+ */
+#include "rail.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+std::string find_hwmon()
+{
+	const char *base = "/sys/class/hwmon";
+	std::string found;
+	DIR *dir = opendir(base);
+	struct dirent *de;
+
+	if (!dir)
+		return found;
+
+	while ((de = readdir(dir)) != nullptr) {
+		std::string path = std::string(base) + "/" + de->d_name;
+
+		if (de->d_name[0] == '.')
+			continue;
+		if (access((path + "/hddsaver_power").c_str(), F_OK) == 0) {
+			found = path;
+			break;
+		}
+	}
+	closedir(dir);
+
+	return found;
+}
+
+int read_attr(int fd, char *buf, size_t size)
+{
+	ssize_t len = pread(fd, buf, size - 1, 0);
+
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	return len;
+}
+
+std::vector<std::string> split_list(const char *s)
+{
+	std::vector<std::string> out;
+
+	while (*s) {
+		size_t len = strcspn(s, " ,\t\n");
+
+		if (len)
+			out.emplace_back(s, len);
+		s += len;
+		s += strspn(s, " ,\t\n");
+	}
+
+	return out;
+}
+
+std::string mountinfo_unescape(const char *s)
+{
+	std::string out;
+
+	for (; *s; s++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			out += char((s[1] - '0') << 6 | (s[2] - '0') << 3 |
+				    (s[3] - '0'));
+			s += 3;
+		} else {
+			out += *s;
+		}
+	}
+
+	return out;
+}
+
+rail::~rail()
+{
+	close();
+}
+
+int rail::open(const std::string &hwmon)
+{
+	close();
+
+	power_fd = ::open((hwmon + "/hddsaver_power").c_str(),
+			  O_RDWR | O_CLOEXEC);
+	if (power_fd < 0)
+		return -errno;
+
+	/* Older patches do not have it */
+	disks_fd = ::open((hwmon + "/hddsaver_disks").c_str(),
+			  O_RDONLY | O_CLOEXEC);
+	dir = hwmon;
+
+	return 0;
+}
+
+void rail::close()
+{
+	if (power_fd >= 0)
+		::close(power_fd);
+	if (disks_fd >= 0)
+		::close(disks_fd);
+	power_fd = disks_fd = -1;
+}
+
+int rail::state() const
+{
+	char buf[16];
+	int len = read_attr(power_fd, buf, sizeof(buf));
+
+	if (len < 0)
+		return len;
+	if (!strncmp(buf, "On", 2))
+		return 1;
+	if (!strncmp(buf, "Off", 3))
+		return 0;
+
+	return -EINVAL;
+}
+
+int rail::set(bool on)
+{
+	const char *val = on ? "on\n" : "off\n";
+	ssize_t len = pwrite(power_fd, val, strlen(val), 0);
+
+	return len < 0 ? -errno : 0;
+}
+
+int rail::disks(std::vector<std::string> &out) const
+{
+	char buf[512];
+	int len;
+
+	if (disks_fd < 0)
+		return -ENOENT;
+
+	len = read_attr(disks_fd, buf, sizeof(buf));
+	if (len < 0)
+		return len;
+	out = split_list(buf);
+
+	return 0;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Access to the HDD Saver attributes of the nct6775 hwmon device
+ */
+#ifndef HDDSAVER_RAIL_H
+#define HDDSAVER_RAIL_H
+
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+/* Returns the hwmon directory carrying hddsaver_power, or "" */
+std::string find_hwmon();
+
+/*
+ * The attribute files are opened once and accessed with pread/pwrite at
+ * offset 0, which makes sysfs run show/store again without a reopen.
+ */
+class rail {
+public:
+	rail() = default;
+	~rail();
+	rail(const rail &) = delete;
+	rail &operator=(const rail &) = delete;
+
+	int open(const std::string &hwmon);
+	void close();
+
+	/* 1 if the power is on, 0 if off, -errno on error */
+	int state() const;
+
+	/* Blocks while the driver flushes and spins down the drives */
+	int set(bool on);
+
+	/* Drives listed in hddsaver_disks, -ENOENT on unpatched kernels */
+	int disks(std::vector<std::string> &out) const;
+
+	const std::string &path() const { return dir; }
+
+private:
+	std::string dir;
+	int power_fd = -1;
+	int disks_fd = -1;
+};
+
+/* Reads a whole sysfs attribute into buf, returns its length or -errno */
+int read_attr(int fd, char *buf, size_t size);
+
+/* Splits on blanks and commas */
+std::vector<std::string> split_list(const char *s);
+
+/* Mount points are escaped as \ooo in mountinfo */
+std::string mountinfo_unescape(const char *s);
+
+} /* namespace hddsaver */
+
+#endif
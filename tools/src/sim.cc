@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Replay of activity traces against a model of the HDD Saver power states
+ *
+ * The model follows patch 0005: after standby_delay idle seconds the
+ * drives are spun down, after off_delay the rail is cut, with a spin down
+ * first if they were still spinning. The next request waits for the
+ * drives to spin up or to power up, and so do the requests right behind
+ * it. The requests are not shifted by that wait, the burst keeps its
+ * recorded timing.
+ */
+#include "sim.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace hddsaver {
+
+#define NSEC	1000000000ULL
+
+burst_trace::burst_trace(const trace &t, const std::vector<bool> &use_dev,
+			 uint64_t merge_ns, uint64_t window_ns)
+{
+	burst *b = nullptr;
+
+	for (const auto &e : t.events) {
+		if (e.dev < use_dev.size() && !use_dev[e.dev])
+			continue;
+		nr_requests++;
+
+		if (!b || e.ts - b->end >= merge_ns) {
+			bursts.push_back({ e.ts, e.ts, (uint32_t)offsets.size(),
+					   0 });
+			b = &bursts.back();
+		}
+		b->end = e.ts;
+		if (e.ts - b->start < window_ns) {
+			offsets.push_back((e.ts - b->start) / 1000);
+			b->count++;
+		}
+	}
+}
+
+/* Histogram bins are milliseconds of added latency, rounded up */
+static double percentile(const std::vector<uint32_t> &hist, uint64_t total,
+			 double p)
+{
+	uint64_t rank = (uint64_t)std::ceil(p * total), seen;
+
+	/* Bin 0 holds the requests that did not wait */
+	seen = total;
+	for (size_t i = 1; i < hist.size(); i++)
+		seen -= hist[i];
+	for (size_t i = 1; i < hist.size(); i++) {
+		if (seen >= rank)
+			return (i - 1) / 1e3;
+		seen += hist[i];
+	}
+
+	return (hist.size() - 1) / 1e3;
+}
+
+sim_result simulate(const burst_trace &bt, const power_model &m,
+		    const policy &p, std::vector<uint32_t> &hist)
+{
+	const uint64_t never = std::numeric_limits<uint64_t>::max();
+	uint64_t standby = p.standby_delay ? p.standby_delay * NSEC : never;
+	uint64_t off = p.off_delay ? p.off_delay * NSEC : never;
+	uint64_t spinup_us = m.spinup * 1e6, poweron_us = m.poweron * 1e6;
+	double spin_s = 0, standby_s = 0, off_s = 0, wake_s = 0;
+	sim_result r = {};
+
+	hist.assign((std::max(spinup_us, poweron_us) + 999) / 1000 + 1, 0);
+
+	for (size_t i = 0; i < bt.bursts.size(); i++) {
+		const auto &b = bt.bursts[i];
+		uint64_t gap, wake = 0;
+
+		spin_s += (b.end - b.start) / 1e9;
+		if (i == 0)
+			continue;
+
+		gap = b.start - bt.bursts[i - 1].end;
+		spin_s += std::min({ gap, standby, off }) / 1e9;
+		if (gap >= off) {
+			/* Spun down before the rail is cut, unless it was */
+			if (standby < off)
+				standby_s += (off - standby) / 1e9;
+			off_s += (gap - off) / 1e9;
+			r.off_wakes++;
+			r.head_unloads += m.drives;
+			wake = poweron_us;
+		} else if (gap >= standby) {
+			standby_s += (gap - standby) / 1e9;
+			r.standby_wakes++;
+			r.head_unloads += m.drives;
+			wake = spinup_us;
+		}
+		if (!wake)
+			continue;
+
+		wake_s += wake / 1e6;
+		for (uint32_t j = 0; j < b.count; j++) {
+			uint32_t offset = bt.offsets[b.first + j];
+
+			if (offset < wake)
+				hist[(wake - offset + 999) / 1000]++;
+		}
+	}
+
+	r.requests = bt.requests();
+	r.seconds = spin_s + standby_s + off_s;
+	r.joules = m.drives * (spin_s * m.watts_spin +
+			       standby_s * m.watts_standby +
+			       off_s * m.watts_off +
+			       wake_s * (m.watts_spinup - m.watts_spin));
+
+	r.latency_p50 = percentile(hist, r.requests, 0.50);
+	r.latency_p99 = percentile(hist, r.requests, 0.99);
+	r.latency_p999 = percentile(hist, r.requests, 0.999);
+	r.latency_max = percentile(hist, r.requests, 1.0);
+
+	return r;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Replay of activity traces against a model of the HDD Saver power states
+ */
+#ifndef HDDSAVER_SIM_H
+#define HDDSAVER_SIM_H
+
+#include "trace.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace hddsaver {
+
+/* Wattages are per drive */
+struct power_model {
+	unsigned int drives = 1;
+	double watts_spin = 5.0;	/* Spinning, idle or busy */
+	double watts_standby = 0.8;	/* Spun down, rail on */
+	double watts_off = 0.0;		/* Rail off */
+	double watts_spinup = 20.0;	/* While spinning up */
+	double spinup = 8.0;		/* Seconds from standby to ready */
+	double poweron = 15.0;		/* Seconds from rail off to ready */
+};
+
+/* The tiers of hddsaver_standby_delay and hddsaver_off_delay */
+struct policy {
+	uint64_t standby_delay;		/* Seconds, 0 never */
+	uint64_t off_delay;		/* Seconds, 0 never */
+};
+
+struct sim_result {
+	double joules;
+	double seconds;
+	uint64_t requests;
+	uint64_t standby_wakes;
+	uint64_t off_wakes;		/* Power cycles */
+	uint64_t head_unloads;		/* All drives */
+	double latency_p50;		/* Seconds added, in ms steps */
+	double latency_p99;
+	double latency_p999;
+	double latency_max;
+};
+
+/*
+ * A trace reduced to what a set of policies can tell apart. Requests
+ * closer together than the shortest delay of any policy never let the
+ * drives change state, so they are merged into bursts. Of each burst
+ * only the offsets of the requests that may wait for a spin up are kept.
+ */
+class burst_trace {
+public:
+	burst_trace(const trace &t, const std::vector<bool> &use_dev,
+		    uint64_t merge_ns, uint64_t window_ns);
+
+	uint64_t requests() const { return nr_requests; }
+	size_t size() const { return bursts.size(); }
+
+private:
+	friend sim_result simulate(const burst_trace &bt,
+				   const power_model &m, const policy &p,
+				   std::vector<uint32_t> &hist);
+
+	struct burst {
+		uint64_t start;		/* ns */
+		uint64_t end;
+		uint32_t first;		/* Into offsets */
+		uint32_t count;
+	};
+
+	std::vector<burst> bursts;
+	std::vector<uint32_t> offsets;	/* us after the burst start */
+	uint64_t nr_requests = 0;
+};
+
+/* hist is a latency histogram, reused between calls to avoid allocations */
+sim_result simulate(const burst_trace &bt, const power_model &m,
+		    const policy &p, std::vector<uint32_t> &hist);
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * The HDD Saver paths of nct6775-platform.c, on top of nct6791d_model
+ */
+#include "sio_logic.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+
+namespace hddsaver {
+
+static int sio_enter(struct nct6775_sio_data *sio_data)
+{
+	return sio_data->model->superio_enter();
+}
+
+static void sio_select(struct nct6775_sio_data *sio_data, int ld)
+{
+	sio_data->model->superio_select(ld);
+}
+
+static int sio_inb(struct nct6775_sio_data *sio_data, int reg)
+{
+	return sio_data->model->superio_inb(reg);
+}
+
+static void sio_outb(struct nct6775_sio_data *sio_data, int reg, int val)
+{
+	sio_data->model->superio_outb(reg, val);
+}
+
+static void sio_exit(struct nct6775_sio_data *sio_data)
+{
+	sio_data->model->superio_exit();
+}
+
+void nct6775_sio_data_init(struct nct6775_sio_data *sio_data,
+			   nct6791d_model *model)
+{
+	sio_data->model = model;
+	sio_data->sio_enter = sio_enter;
+	sio_data->sio_select = sio_select;
+	sio_data->sio_inb = sio_inb;
+	sio_data->sio_outb = sio_outb;
+	sio_data->sio_exit = sio_exit;
+}
+
+static void lock(struct nct6775_data *data)
+{
+	if (!data->no_lock)
+		data->update_lock.lock();
+}
+
+static void unlock(struct nct6775_data *data)
+{
+	if (!data->no_lock)
+		data->update_lock.unlock();
+}
+
+int nct6775_platform_probe_init(struct nct6775_data *data)
+{
+	struct nct6775_sio_data *sio_data = data->driver_data;
+	int err;
+	uint8_t cr2a, tmp;
+
+	err = sio_data->sio_enter(sio_data);
+	if (err)
+		return err;
+
+	cr2a = sio_data->sio_inb(sio_data, SIO_REG_CR2A);
+	data->have_hddsaver = cr2a & (1 << 6);
+	if (data->have_hddsaver) {
+		sio_data->sio_select(sio_data, NCT6775_LD_GPIO1);
+		tmp = sio_data->sio_inb(sio_data, NCT6775_REG_CR_GPIO1_DATA);
+		data->hddsaver_status = tmp & (1 << 0);
+	}
+
+	sio_data->sio_exit(sio_data);
+
+	return 0;
+}
+
+int store_hddsaver_toggle(struct nct6775_data *data, bool val)
+{
+	struct nct6775_sio_data *sio_data = data->driver_data;
+	int ret;
+	uint8_t tmp;
+
+	lock(data);
+	ret = sio_data->sio_enter(sio_data);
+	if (ret)
+		goto error;
+
+	if (val != data->hddsaver_status) {
+		sio_data->sio_select(sio_data, NCT6775_LD_GPIO1);
+		tmp = sio_data->sio_inb(sio_data, NCT6775_REG_CR_GPIO1_DATA);
+		sio_data->sio_outb(sio_data, NCT6775_REG_CR_GPIO1_DATA,
+				   tmp ^ (1 << 0));
+		data->hddsaver_status = val;
+	}
+	sio_data->sio_exit(sio_data);
+
+	data->valid = false;
+error:
+	unlock(data);
+	return ret;
+}
+
+static int nct6775_hddsaver_set_power(struct nct6775_data *data, bool on)
+{
+	struct nct6775_sio_data *sio_data = data->driver_data;
+	int err;
+	uint8_t tmp;
+
+	lock(data);
+	err = sio_data->sio_enter(sio_data);
+	if (err)
+		goto error;
+
+	sio_data->sio_select(sio_data, NCT6775_LD_GPIO1);
+	tmp = sio_data->sio_inb(sio_data, NCT6775_REG_CR_GPIO1_DATA);
+	if (on)
+		tmp |= 1 << 0;
+	else
+		tmp &= ~(1 << 0);
+	sio_data->sio_outb(sio_data, NCT6775_REG_CR_GPIO1_DATA, tmp);
+	sio_data->sio_exit(sio_data);
+
+	data->hddsaver_status = on;
+
+	data->valid = false;
+error:
+	unlock(data);
+	return err;
+}
+
+int nct6775_hddsaver_power(struct nct6775_data *data, bool on)
+{
+	int err = 0;
+
+	if (!data->no_lock)
+		data->hddsaver_lock.lock();
+	if (on != data->hddsaver_status)
+		err = nct6775_hddsaver_set_power(data, on);
+	if (!data->no_lock)
+		data->hddsaver_lock.unlock();
+
+	return err;
+}
+
+int show_hddsaver(struct nct6775_data *data, char *buf)
+{
+	return sprintf(buf, "%s\n", data->hddsaver_status ? "On" : "Off");
+}
+
+/* kstrtobool() */
+static int strtobool(const char *s, bool *res)
+{
+	switch (s[0]) {
+	case 'y': case 'Y': case '1':
+		*res = true;
+		return 0;
+	case 'n': case 'N': case '0':
+		*res = false;
+		return 0;
+	case 'o': case 'O':
+		if (s[1] == 'n' || s[1] == 'N') {
+			*res = true;
+			return 0;
+		}
+		if (s[1] == 'f' || s[1] == 'F') {
+			*res = false;
+			return 0;
+		}
+		break;
+	}
+
+	return -EINVAL;
+}
+
+int store_hddsaver(struct nct6775_data *data, const char *buf)
+{
+	bool val;
+	int err;
+
+	err = strtobool(buf, &val);
+	if (err)
+		return err;
+
+	return nct6775_hddsaver_power(data, val);
+}
+
+static uint64_t jiffies_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void nct6775_update_device(struct nct6775_data *data)
+{
+	uint64_t now = jiffies_ns();
+	unsigned int i;
+
+	lock(data);
+	if (now - data->last_updated > 1500000000 || !data->valid) {
+		for (i = 0; i < data->nr_hwm_regs && i < NCT6775_HWM_REGS; i++)
+			data->hwm[i] = data->driver_data->model->hwm_inb(i);
+		data->last_updated = now;
+		data->valid = true;
+	}
+	unlock(data);
+}
+
+int nct6775_show_reg(struct nct6775_data *data, int nr)
+{
+	nct6775_update_device(data);
+
+	return data->hwm[nr % NCT6775_HWM_REGS];
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * The HDD Saver paths of nct6775-platform.c, on top of nct6791d_model
+ *
+ * Kept line by line close to the driver so that a change to one can be
+ * carried over to the other and run through hddsaver-stress.
+ */
+#ifndef HDDSAVER_SIO_LOGIC_H
+#define HDDSAVER_SIO_LOGIC_H
+
+#include "sio_model.h"
+
+#include <mutex>
+
+namespace hddsaver {
+
+struct nct6775_sio_data {
+	nct6791d_model *model;
+
+	int (*sio_enter)(struct nct6775_sio_data *sio_data);
+	void (*sio_select)(struct nct6775_sio_data *sio_data, int ld);
+	int (*sio_inb)(struct nct6775_sio_data *sio_data, int reg);
+	void (*sio_outb)(struct nct6775_sio_data *sio_data, int reg, int val);
+	void (*sio_exit)(struct nct6775_sio_data *sio_data);
+};
+
+#define NCT6775_HWM_REGS	256
+
+struct nct6775_data {
+	struct nct6775_sio_data *driver_data = nullptr;
+	std::mutex update_lock;
+	std::mutex hddsaver_lock;	/* nct6775_hddsaver.lock */
+	bool have_hddsaver = false;
+	bool hddsaver_status = false;
+	bool valid = false;
+	bool no_lock = false;		/* Skip update_lock, to see races */
+
+	/* nct6775_update_device() cache */
+	uint64_t last_updated = 0;	/* ns */
+	unsigned int nr_hwm_regs = 128;	/* Read per refresh */
+	uint8_t hwm[NCT6775_HWM_REGS] = {};
+};
+
+void nct6775_sio_data_init(struct nct6775_sio_data *sio_data,
+			   nct6791d_model *model);
+
+/* The HDD Saver part of nct6775_platform_probe_init() */
+int nct6775_platform_probe_init(struct nct6775_data *data);
+
+/* store_hddsaver() of patch 0001, flips bit 0 if the cache differs */
+int store_hddsaver_toggle(struct nct6775_data *data, bool val);
+
+/* nct6775_hddsaver_power() of patch 0002, sets or clears bit 0 */
+int nct6775_hddsaver_power(struct nct6775_data *data, bool on);
+
+/* The sysfs side: "On\n" or "Off\n", and kstrtobool() input */
+int show_hddsaver(struct nct6775_data *data, char *buf);
+int store_hddsaver(struct nct6775_data *data, const char *buf);
+
+/*
+ * Refreshes the register cache under update_lock when it is older than
+ * 1.5 s or invalidated, as every other hwmon attribute does before it
+ * shows a value. Returns register nr.
+ */
+int nct6775_show_reg(struct nct6775_data *data, int nr);
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Userspace model of the NCT6791D Super-I/O configuration space
+ */
+#include "sio_model.h"
+
+#include <cerrno>
+#include <ctime>
+
+namespace hddsaver {
+
+nct6791d_model::nct6791d_model(int ioreg)
+	: base(ioreg)
+{
+	reset(true, false);
+}
+
+void nct6791d_model::reset(bool hddsaver_enabled, bool rail_on,
+			   uint8_t gpio1)
+{
+	std::lock_guard<std::mutex> lock(bus);
+
+	for (auto &l : ld)
+		for (auto &r : l)
+			r = 0;
+	for (auto &r : global)
+		r = 0;
+	global[SIO_REG_DEVID] = SIO_NCT6791_ID >> 8;
+	global[SIO_REG_DEVID + 1] = SIO_NCT6791_ID & 0xff;
+	global[SIO_REG_CR2A] = hddsaver_enabled ? 1 << 6 : 0;
+	ld[NCT6775_LD_GPIO1][NCT6775_REG_CR_GPIO1_DATA] =
+		(gpio1 & ~1) | (rail_on ? 1 : 0);
+	index = 0;
+	keys = 0;
+	config = false;
+}
+
+/* xorshift64*, one stream per thread */
+bool nct6791d_model::fault(double p)
+{
+	thread_local uint64_t state, owner_seed;
+	uint64_t x;
+
+	if (p <= 0)
+		return false;
+	if (owner_seed != seed_base || !state) {
+		owner_seed = seed_base;
+		state = seed_base * 0x9e3779b97f4a7c15ULL + ++seeds;
+		if (!state)
+			state = 1;
+	}
+	x = state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	state = x;
+
+	return (x * 0x2545f4914f6cdd1dULL >> 11) * (1.0 / (1ULL << 53)) < p;
+}
+
+void nct6791d_model::delay() const
+{
+	struct timespec ts, now;
+	uint64_t elapsed;
+
+	if (!latency_ns)
+		return;
+
+	/* ISA cycles hold the bus, spin instead of sleeping */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - ts.tv_sec) * 1000000000ULL +
+			  now.tv_nsec - ts.tv_nsec;
+	} while (elapsed < latency_ns);
+}
+
+uint8_t *nct6791d_model::reg(uint8_t i)
+{
+	if (i < 0x30)
+		return &global[i];
+
+	return &ld[global[SIO_REG_LDSEL] & 0x1f][i];
+}
+
+void nct6791d_model::outb(uint8_t val, int port)
+{
+	bool dropped = port == base + 1 && fault(faults.drop);
+	std::lock_guard<std::mutex> lock(bus);
+
+	stats.port_ops++;
+	delay();
+
+	if (port == base) {
+		/* Two keys in a row enter, anything else is an index */
+		if (val == 0x87) {
+			if (++keys == 2)
+				config = true;
+		} else {
+			keys = 0;
+			if (val == 0xaa)
+				config = false;
+		}
+		index = val;
+		index_owner = std::this_thread::get_id();
+		return;
+	}
+
+	if (port != base + 1 || !config)
+		return;
+	if (index_owner != std::this_thread::get_id())
+		stats.torn++;
+	if (dropped) {
+		stats.drops++;
+		return;
+	}
+
+	if (index == SIO_REG_DEVID || index == SIO_REG_DEVID + 1)
+		return;
+	if (index == NCT6775_REG_CR_GPIO1_DATA &&
+	    (global[SIO_REG_LDSEL] & 0x1f) == NCT6775_LD_GPIO1 &&
+	    ((*reg(index) ^ val) & 1))
+		stats.rail_changes++;
+	*reg(index) = val;
+}
+
+uint8_t nct6791d_model::inb(int port)
+{
+	bool flip = port == base + 1 && fault(faults.flip);
+	std::lock_guard<std::mutex> lock(bus);
+	uint8_t val;
+
+	stats.port_ops++;
+	delay();
+
+	/* Floating bus */
+	if (port != base + 1 || !config)
+		return 0xff;
+	if (index_owner != std::this_thread::get_id())
+		stats.torn++;
+
+	val = *reg(index);
+	if (flip)
+		val ^= 1 << (stats.flips++ % 8);
+
+	return val;
+}
+
+uint8_t nct6791d_model::hwm_inb(int r)
+{
+	std::lock_guard<std::mutex> lock(bus);
+
+	/* Address and data port */
+	stats.port_ops += 2;
+	delay();
+	delay();
+
+	return r + hwm_count++;
+}
+
+bool nct6791d_model::rail() const
+{
+	return gpio1() & 1;
+}
+
+uint8_t nct6791d_model::gpio1() const
+{
+	std::lock_guard<std::mutex> lock(bus);
+
+	return ld[NCT6775_LD_GPIO1][NCT6775_REG_CR_GPIO1_DATA];
+}
+
+int nct6791d_model::superio_enter()
+{
+	if (fault(faults.busy)) {
+		stats.busy++;
+		return -EBUSY;
+	}
+	if (use_region)
+		region.lock();
+
+	outb(0x87, base);
+	outb(0x87, base);
+
+	return 0;
+}
+
+void nct6791d_model::superio_exit()
+{
+	outb(0xaa, base);
+	outb(0x02, base);
+	outb(0x02, base + 1);
+
+	if (use_region)
+		region.unlock();
+}
+
+void nct6791d_model::superio_select(int l)
+{
+	outb(SIO_REG_LDSEL, base);
+	outb(l, base + 1);
+}
+
+int nct6791d_model::superio_inb(int r)
+{
+	outb(r, base);
+
+	return inb(base + 1);
+}
+
+void nct6791d_model::superio_outb(int r, int val)
+{
+	outb(r, base);
+	outb(val, base + 1);
+}
+
+} /* namespace hddsaver */
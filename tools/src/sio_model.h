@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Userspace model of the NCT6791D Super-I/O configuration space
+ *
+ * Only what the HDD Saver code touches is modelled: the index/data port
+ * pair, the 0x87 0x87 enter key and the 0xaa exit, the logical device
+ * select at CR 0x07, the chip ID, CR 0x2a and the per logical device
+ * registers, of which LD 8 CR 0xf1 bit 0 drives the HDD Saver rail.
+ *
+ * Like the real chip the model keeps one index register for everybody.
+ * Port accesses are atomic, sequences are not, and a data port access
+ * by another thread than the one that wrote the index is counted as a
+ * torn access. request_muxed_region() is modelled by a mutex taken in
+ * superio_enter(), faults and port latency are configurable. The
+ * hardware monitoring bank is only there to cost time on the same bus.
+ */
+#ifndef HDDSAVER_SIO_MODEL_H
+#define HDDSAVER_SIO_MODEL_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace hddsaver {
+
+#define SIO_REG_LDSEL		0x07
+#define SIO_REG_DEVID		0x20
+#define SIO_REG_CR2A		0x2a
+#define SIO_NCT6791_ID		0xc803
+#define NCT6775_LD_GPIO1	0x08
+#define NCT6775_LD_HWM		0x0b
+#define NCT6775_REG_CR_GPIO1_DATA	0xf1
+
+struct sio_faults {
+	double busy;		/* superio_enter() fails with -EBUSY */
+	double flip;		/* A data port read returns one bit flipped */
+	double drop;		/* A data port write is lost */
+};
+
+struct sio_stats {
+	std::atomic<uint64_t> port_ops{ 0 };
+	std::atomic<uint64_t> torn{ 0 };
+	std::atomic<uint64_t> busy{ 0 };
+	std::atomic<uint64_t> flips{ 0 };
+	std::atomic<uint64_t> drops{ 0 };
+	std::atomic<uint64_t> rail_changes{ 0 };
+};
+
+class nct6791d_model {
+public:
+	explicit nct6791d_model(int ioreg = 0x2e);
+
+	/* Power on state: CR 0x2a bit 6 is set by the BIOS option */
+	void reset(bool hddsaver_enabled, bool rail_on, uint8_t gpio1 = 0xa4);
+
+	void set_latency(uint64_t ns) { latency_ns = ns; }
+	void set_faults(const sio_faults &f) { faults = f; }
+	void set_region(bool on) { use_region = on; }
+	void seed(uint64_t s) { seed_base = s; }
+
+	/* Port I/O as seen by the driver */
+	void outb(uint8_t val, int port);
+	uint8_t inb(int port);
+
+	/* Backdoor for checkers, no port access and no faults */
+	bool rail() const;
+	uint8_t gpio1() const;
+
+	int ioreg() const { return base; }
+	sio_stats stats;
+
+	/* superio_* of nct6775-platform.c on top of the ports */
+	int superio_enter();
+	void superio_exit();
+	void superio_select(int ld);
+	int superio_inb(int reg);
+	void superio_outb(int reg, int val);
+
+	/* A hardware monitoring register behind the address/data ports */
+	uint8_t hwm_inb(int reg);
+
+private:
+	bool fault(double p);
+	void delay() const;
+
+	uint8_t *reg(uint8_t index);
+
+	int base;
+	mutable std::mutex bus;
+	std::mutex region;
+	bool use_region = true;
+
+	/* Chip state, under bus */
+	uint8_t global[0x30] = {};
+	uint8_t ld[0x20][0x100] = {};
+	uint8_t index = 0;
+	uint8_t hwm_count = 0;
+	int keys = 0;
+	bool config = false;
+	std::thread::id index_owner;
+
+	uint64_t latency_ns = 0;
+	sio_faults faults = {};
+	uint64_t seed_base = 1;
+	std::atomic<uint64_t> seeds{ 0 };
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * SMART attributes of the HDD Saver drives, read over SG_IO
+ */
+#include "smart.h"
+#include "event_loop.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <scsi/sg.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define ATA_16			0x85
+#define ATA_PROTO_NON_DATA	(3 << 1)
+#define ATA_PROTO_PIO_IN	(4 << 1)
+#define ATA_CK_COND		0x20
+#define ATA_T_DIR_IN		0x08
+#define ATA_BYT_BLOK		0x04
+#define ATA_T_LEN_COUNT		0x02
+#define ATA_STATUS_ERR		0x01
+
+#define SG_DRIVER_SENSE		0x08
+
+#define ATA_CMD_SMART		0xb0
+#define ATA_CMD_CHECK_POWER	0xe5
+#define ATA_CMD_STANDBY_NOW	0xe0
+#define ATA_CMD_IDLE_NOW	0xe1
+#define SMART_READ_DATA		0xd0
+#define SMART_READ_THRESHOLDS	0xd1
+
+#define SG_TIMEOUT_MS		10000
+
+static const struct {
+	uint8_t id;
+	const char *name;
+} attr_names[] = {
+	{ 1, "Raw_Read_Error_Rate" },
+	{ 3, "Spin_Up_Time" },
+	{ 4, "Start_Stop_Count" },
+	{ 5, "Reallocated_Sector_Ct" },
+	{ 7, "Seek_Error_Rate" },
+	{ 9, "Power_On_Hours" },
+	{ 10, "Spin_Retry_Count" },
+	{ 11, "Calibration_Retry_Count" },
+	{ 12, "Power_Cycle_Count" },
+	{ 187, "Reported_Uncorrect" },
+	{ 188, "Command_Timeout" },
+	{ 190, "Airflow_Temperature_Cel" },
+	{ 192, "Power-Off_Retract_Count" },
+	{ 193, "Load_Cycle_Count" },
+	{ 194, "Temperature_Celsius" },
+	{ 196, "Reallocated_Event_Count" },
+	{ 197, "Current_Pending_Sector" },
+	{ 198, "Offline_Uncorrectable" },
+	{ 199, "UDMA_CRC_Error_Count" },
+	{ 200, "Multi_Zone_Error_Rate" },
+};
+
+const char *smart_attr_name(uint8_t id)
+{
+	for (const auto &a : attr_names)
+		if (a.id == id)
+			return a.name;
+
+	return "Unknown_Attribute";
+}
+
+/*
+ * ATA PASS-THROUGH (16), sense is filled for the non-data commands with
+ * the ATA status return descriptor, and -EIO if the drive failed them
+ */
+static int ata_cmd(int fd, uint8_t cmd, uint8_t feature, void *buf,
+		   unsigned char *sense, size_t sense_len)
+{
+	unsigned char cdb[16] = {};
+	sg_io_hdr_t io = {};
+
+	cdb[0] = ATA_16;
+	if (buf) {
+		cdb[1] = ATA_PROTO_PIO_IN;
+		cdb[2] = ATA_T_DIR_IN | ATA_BYT_BLOK | ATA_T_LEN_COUNT;
+	} else {
+		cdb[1] = ATA_PROTO_NON_DATA;
+		cdb[2] = ATA_CK_COND;
+	}
+	cdb[4] = feature;
+	cdb[6] = 1;
+	if (cmd == ATA_CMD_SMART) {
+		cdb[10] = 0x4f;
+		cdb[12] = 0xc2;
+	}
+	cdb[14] = cmd;
+
+	io.interface_id = 'S';
+	io.cmd_len = sizeof(cdb);
+	io.cmdp = cdb;
+	io.dxfer_direction = buf ? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
+	io.dxferp = buf;
+	io.dxfer_len = buf ? 512 : 0;
+	io.sbp = sense;
+	io.mx_sb_len = sense_len;
+	io.timeout = SG_TIMEOUT_MS;
+
+	if (ioctl(fd, SG_IO, &io))
+		return -errno;
+	/* CK_COND makes a good non-data command end with a check condition */
+	if (buf)
+		return io.status || io.host_status || io.driver_status ?
+		       -EIO : 0;
+	if (io.host_status || io.driver_status & ~SG_DRIVER_SENSE ||
+	    io.sb_len_wr < 22 || (sense[0] & 0x7f) != 0x72 ||
+	    sense[8] != 0x09 || sense[8 + 13] & ATA_STATUS_ERR)
+		return -EIO;
+
+	return 0;
+}
+
+/* 0 in standby, 1 spinning, from the ATA status return descriptor */
+static int power_mode(int fd)
+{
+	unsigned char sense[32] = {};
+	int err;
+
+	err = ata_cmd(fd, ATA_CMD_CHECK_POWER, 0, nullptr, sense,
+		      sizeof(sense));
+	if (err)
+		return err;
+
+	/* Idle or active, lower counts are standby modes */
+	return sense[8 + 5] >= 0x80;
+}
+
+int smart_read(const std::string &disk, smart_data &out)
+{
+	unsigned char data[512], thresh[512];
+	int fd, err;
+
+	fd = open(("/dev/" + disk).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	err = power_mode(fd);
+	if (err == 0)
+		err = -EAGAIN;
+	else if (err > 0)
+		err = ata_cmd(fd, ATA_CMD_SMART, SMART_READ_DATA, data,
+			      nullptr, 0);
+	if (!err)
+		err = ata_cmd(fd, ATA_CMD_SMART, SMART_READ_THRESHOLDS, thresh,
+			      nullptr, 0);
+	close(fd);
+	if (err)
+		return err;
+
+	/* 30 entries of 12 bytes from offset 2, in both */
+	out.nr_attrs = 0;
+	out.temperature = -1;
+	out.failing = false;
+	for (unsigned int i = 0; i < smart_data::MAX_ATTRS; i++) {
+		const unsigned char *a = data + 2 + i * 12;
+		smart_attr &s = out.attrs[out.nr_attrs];
+
+		if (!a[0])
+			continue;
+		s.id = a[0];
+		s.value = a[3];
+		s.worst = a[4];
+		s.raw = 0;
+		for (int b = 5; b >= 0; b--)
+			s.raw = s.raw << 8 | a[5 + b];
+		s.thresh = 0;
+		for (unsigned int j = 0; j < smart_data::MAX_ATTRS; j++)
+			if (thresh[2 + j * 12] == s.id)
+				s.thresh = thresh[2 + j * 12 + 1];
+
+		if (s.thresh && s.value <= s.thresh)
+			out.failing = true;
+		if (s.id == 194 || (s.id == 190 && out.temperature < 0))
+			out.temperature = s.raw & 0xff;
+		out.nr_attrs++;
+	}
+	out.read_ms = now_ms();
+
+	return 0;
+}
+
+int ata_standby(const std::string &disk, bool standby)
+{
+	unsigned char sense[32] = {};
+	int fd, err;
+
+	fd = open(("/dev/" + disk).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	err = ata_cmd(fd, standby ? ATA_CMD_STANDBY_NOW : ATA_CMD_IDLE_NOW, 0,
+		      nullptr, sense, sizeof(sense));
+	close(fd);
+
+	return err;
+}
+
+size_t smart_format(const smart_data &d, char *buf, size_t size)
+{
+	size_t len;
+	int n;
+
+	n = snprintf(buf, size, "ID# %-24s VALUE WORST THRESH RAW_VALUE\n",
+		     "ATTRIBUTE_NAME");
+	if (n < 0 || (size_t)n >= size)
+		return 0;
+	len = n;
+
+	for (unsigned int i = 0; i < d.nr_attrs; i++) {
+		const smart_attr &a = d.attrs[i];
+
+		n = snprintf(buf + len, size - len,
+			     "%3u %-24s %5u %5u %6u %llu\n", a.id,
+			     smart_attr_name(a.id), a.value, a.worst, a.thresh,
+			     (unsigned long long)a.raw);
+		if (n < 0 || (size_t)n >= size - len)
+			return 0;
+		len += n;
+	}
+
+	return len;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * SMART attributes of the HDD Saver drives, read over SG_IO
+ */
+#ifndef HDDSAVER_SMART_H
+#define HDDSAVER_SMART_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace hddsaver {
+
+struct smart_attr {
+	uint8_t id;
+	uint8_t value;
+	uint8_t worst;
+	uint8_t thresh;
+	uint64_t raw;			/* 48 bits */
+};
+
+struct smart_data {
+	static constexpr unsigned int MAX_ATTRS = 30;
+
+	smart_attr attrs[MAX_ATTRS];
+	unsigned int nr_attrs = 0;
+	int temperature = -1;		/* Celsius, -1 if not reported */
+	bool failing = false;		/* An attribute at or below threshold */
+	uint64_t read_ms = 0;		/* now_ms() when read, 0 never */
+};
+
+/* Name of the common attribute ids, "Unknown_Attribute" for the rest */
+const char *smart_attr_name(uint8_t id);
+
+/*
+ * Reads the attributes and thresholds of an ATA drive (/dev/NAME) with
+ * ATA PASS-THROUGH. -EAGAIN if the drive is in standby, it is not spun
+ * up for this.
+ */
+int smart_read(const std::string &disk, smart_data &out);
+
+/*
+ * Spins an ATA drive down now (STANDBY IMMEDIATE), or up again (IDLE
+ * IMMEDIATE). The power stays on either way.
+ */
+int ata_standby(const std::string &disk, bool standby);
+
+/* One attribute per line, like smartctl -A. Returns the length, or 0 */
+size_t smart_format(const smart_data &d, char *buf, size_t size);
+
+} /* namespace hddsaver */
+
+#endif
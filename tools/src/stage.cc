@@ -0,0 +1,649 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Write staging journal for the files on the HDD Saver drives
+ */
+#include "stage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <set>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define STAGE_MAGIC		"HDDSJNL1"
+#define STAGE_REC_MAGIC		0x43455253	/* "SREC" */
+#define STAGE_MAX_PATH		4096
+
+uint64_t staged_file::size_over(uint64_t base_size) const
+{
+	if (created || sized)
+		return size;
+
+	return std::max(std::min(base_size, base_limit), size);
+}
+
+/* Newer data wins, older extents are cut around it */
+void staged_file::put(uint64_t off, uint64_t len, uint64_t jofs)
+{
+	uint64_t end = off + len;
+	auto it = extents.lower_bound(off);
+
+	if (it != extents.begin()) {
+		auto prev = std::prev(it);
+		uint64_t pend = prev->first + prev->second.len;
+
+		if (pend > off) {
+			if (pend > end)
+				extents[end] = { pend - end,
+						 prev->second.jofs + (end - prev->first) };
+			prev->second.len = off - prev->first;
+		}
+	}
+
+	it = extents.lower_bound(off);
+	while (it != extents.end() && it->first < end) {
+		uint64_t iend = it->first + it->second.len;
+
+		if (iend > end) {
+			extent tail = { iend - end,
+					it->second.jofs + (end - it->first) };
+
+			extents.erase(it);
+			extents[end] = tail;
+			break;
+		}
+		it = extents.erase(it);
+	}
+	extents[off] = { len, jofs };
+}
+
+void staged_file::trim(uint64_t len)
+{
+	auto it = extents.lower_bound(len);
+
+	extents.erase(it, extents.end());
+	if (extents.empty())
+		return;
+
+	it = std::prev(extents.end());
+	if (it->first + it->second.len > len)
+		it->second.len = len - it->first;
+}
+
+/* FNV-1a over words, good enough to find a torn record */
+static uint64_t checksum(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *c = (const unsigned char *)p;
+	uint64_t w;
+
+	for (; len >= 8; c += 8, len -= 8) {
+		memcpy(&w, c, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	while (len--)
+		h = (h ^ *c++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+stage::~stage()
+{
+	close();
+}
+
+int stage::open(const std::string &p)
+{
+	char magic[8];
+	ssize_t len;
+	int err;
+
+	close();
+	fd = ::open(p.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+	path = p;
+
+	len = pread(fd, magic, sizeof(magic), 0);
+	if (len == 0) {
+		if (pwrite(fd, STAGE_MAGIC, 8, 0) != 8 || fdatasync(fd)) {
+			err = errno ? -errno : -EIO;
+			close();
+			return err;
+		}
+		end = 8;
+		return 0;
+	}
+	if (len != sizeof(magic) || memcmp(magic, STAGE_MAGIC, 8)) {
+		close();
+		return -EINVAL;
+	}
+
+	return recover();
+}
+
+void stage::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	end = 0;
+	files.clear();
+	ops.clear();
+	applied = 0;
+	st = stage_stats();
+}
+
+int stage::recover()
+{
+	std::string p, to;
+	rec_header h;
+	uint64_t pos = 8, sum;
+	struct stat sb;
+
+	if (fstat(fd, &sb))
+		return -errno;
+
+	while (pos + sizeof(h) <= (uint64_t)sb.st_size) {
+		bool rename;
+		size_t extra;
+
+		if (pread(fd, &h, sizeof(h), pos) != sizeof(h) ||
+		    h.magic != STAGE_REC_MAGIC || !h.path_len ||
+		    h.path_len >= STAGE_MAX_PATH)
+			break;
+		rename = h.type == REC_RENAME;
+		if (rename && (!h.len || h.len >= STAGE_MAX_PATH))
+			break;
+		extra = rename ? h.len : 0;
+		if (pos + sizeof(h) + h.path_len + h.len > (uint64_t)sb.st_size)
+			break;
+
+		p.resize(h.path_len + extra);
+		if (pread(fd, &p[0], p.size(), pos + sizeof(h)) !=
+		    (ssize_t)p.size())
+			break;
+
+		/* Data is summed from the journal, a record at a time */
+		sum = h.sum;
+		h.sum = 0;
+		{
+			uint64_t s = checksum(0xcbf29ce484222325ULL, &h, sizeof(h));
+			uint64_t off = pos + sizeof(h) + h.path_len + extra;
+			char buf[65536];
+
+			s = checksum(s, p.data(), h.path_len);
+			s = checksum(s, p.data() + h.path_len, extra);
+			for (uint64_t left = rename ? 0 : h.len; left; ) {
+				size_t n = std::min<uint64_t>(left, sizeof(buf));
+
+				if (pread(fd, buf, n, off) != (ssize_t)n)
+					break;
+				s = checksum(s, buf, n);
+				off += n;
+				left -= n;
+			}
+			if ((uint32_t)(s ^ (s >> 32)) != sum)
+				break;
+		}
+
+		to = p.substr(h.path_len);
+		p.resize(h.path_len);
+		apply(h, p, to, pos + sizeof(h) + h.path_len);
+		pos += sizeof(h) + h.path_len + h.len;
+	}
+
+	/* A torn record from a crash is dropped */
+	if (pos < (uint64_t)sb.st_size && ftruncate(fd, pos))
+		return -errno;
+	end = pos;
+
+	return 0;
+}
+
+staged_file &stage::entry(const std::string &p)
+{
+	auto it = files.find(p);
+
+	if (it != files.end())
+		return it->second;
+
+	staged_file &f = files[p];
+
+	f.base = p;
+
+	return f;
+}
+
+void stage::apply(const rec_header &h, const std::string &p,
+		  const std::string &to, uint64_t data_ofs)
+{
+	staged_file *f;
+
+	switch (h.type) {
+	case REC_CREATE:
+	case REC_MKDIR:
+		f = &files[p];
+		*f = staged_file();
+		f->created = f->sized = true;
+		f->dir = h.type == REC_MKDIR;
+		f->mode = h.mode;
+		f->uid = h.uid;
+		f->gid = h.gid;
+		f->mtime = h.time;
+		ops.push_back({ rec_type(h.type), p, "", h.mode, h.uid, h.gid });
+		break;
+	case REC_WRITE:
+		f = &entry(p);
+		f->put(h.offset, h.len, data_ofs);
+		f->size = std::max(f->size, h.offset + h.len);
+		f->mtime = h.time;
+		st.writes++;
+		st.bytes += h.len;
+		break;
+	case REC_TRUNCATE:
+		f = &entry(p);
+		f->trim(h.offset);
+		f->size = h.offset;
+		f->sized = true;
+		if (!f->created)
+			f->base_limit = std::min(f->base_limit, h.offset);
+		f->mtime = h.time;
+		break;
+	case REC_UNLINK:
+		f = &files[p];
+		*f = staged_file();
+		f->whiteout = true;
+		ops.push_back({ REC_UNLINK, p, "", 0, 0, 0 });
+		break;
+	case REC_RENAME: {
+		staged_file moved = entry(p);
+
+		files[to] = std::move(moved);
+		f = &files[p];
+		*f = staged_file();
+		f->whiteout = true;
+		ops.push_back({ REC_RENAME, p, to, 0, 0, 0 });
+		break;
+	}
+	case REC_APPLIED:
+		applied = std::min<size_t>(h.offset, ops.size());
+		break;
+	}
+}
+
+/* One pwritev per record, the index only learns of it once written */
+int stage::append(rec_header &h, const char *p, const void *data)
+{
+	bool rename = h.type == REC_RENAME;
+	size_t path_len = strlen(p);
+	struct iovec iov[3];
+	uint64_t s;
+	ssize_t total, len;
+
+	if (fd < 0)
+		return -EBADF;
+	if (!path_len || path_len >= STAGE_MAX_PATH ||
+	    (rename && h.len >= STAGE_MAX_PATH))
+		return -ENAMETOOLONG;
+
+	h.magic = STAGE_REC_MAGIC;
+	h.sum = 0;
+	h.pad = 0;
+	h.path_len = path_len;
+	h.time = time(nullptr);
+
+	s = checksum(0xcbf29ce484222325ULL, &h, sizeof(h));
+	s = checksum(s, p, path_len);
+	s = checksum(s, data, h.len);
+	h.sum = s ^ (s >> 32);
+
+	iov[0] = { &h, sizeof(h) };
+	iov[1] = { (void *)p, path_len };
+	iov[2] = { (void *)data, h.len };
+	total = sizeof(h) + path_len + h.len;
+	len = pwritev(fd, iov, 3, end);
+	if (len != total) {
+		/* Nothing half written may stay in front of the next record */
+		if (ftruncate(fd, end))
+			return -EIO;
+		return len < 0 ? -errno : -ENOSPC;
+	}
+
+	apply(h, p, rename ? std::string((const char *)data, h.len) : "",
+	      end + sizeof(h) + path_len);
+	end += total;
+
+	return 0;
+}
+
+int stage::create(const char *p, mode_t mode, uid_t uid, gid_t gid)
+{
+	rec_header h = {};
+
+	h.type = REC_CREATE;
+	h.mode = mode;
+	h.uid = uid;
+	h.gid = gid;
+
+	return append(h, p, nullptr);
+}
+
+int stage::mkdir(const char *p, mode_t mode, uid_t uid, gid_t gid)
+{
+	rec_header h = {};
+
+	h.type = REC_MKDIR;
+	h.mode = mode;
+	h.uid = uid;
+	h.gid = gid;
+
+	return append(h, p, nullptr);
+}
+
+int stage::write(const char *p, const void *buf, size_t len, uint64_t off)
+{
+	rec_header h = {};
+
+	h.type = REC_WRITE;
+	h.offset = off;
+	h.len = len;
+
+	return append(h, p, buf);
+}
+
+int stage::truncate(const char *p, uint64_t size)
+{
+	rec_header h = {};
+
+	h.type = REC_TRUNCATE;
+	h.offset = size;
+
+	return append(h, p, nullptr);
+}
+
+int stage::unlink(const char *p)
+{
+	rec_header h = {};
+
+	h.type = REC_UNLINK;
+
+	return append(h, p, nullptr);
+}
+
+/* Directories with staged children are not moved, callers wake instead */
+int stage::rename(const char *from, const char *to)
+{
+	const staged_file *f = find(from);
+	rec_header h = {};
+
+	if (f && f->dir)
+		return -EXDEV;
+
+	h.type = REC_RENAME;
+	h.len = strlen(to);
+
+	return append(h, from, to);
+}
+
+int stage::sync()
+{
+	return fdatasync(fd) ? -errno : 0;
+}
+
+const staged_file *stage::find(const char *p) const
+{
+	auto it = files.find(p);
+
+	return it == files.end() ? nullptr : &it->second;
+}
+
+void stage::paths(std::vector<std::string> &out) const
+{
+	for (const auto &it : files)
+		out.push_back(it.first);
+}
+
+void stage::children(const char *dir,
+		     std::vector<std::pair<std::string,
+					   const staged_file *>> &out) const
+{
+	std::string prefix = dir;
+
+	if (prefix.empty() || prefix.back() != '/')
+		prefix += '/';
+
+	for (auto it = files.lower_bound(prefix);
+	     it != files.end() && !it->first.compare(0, prefix.size(), prefix);
+	     ++it) {
+		if (it->first.find('/', prefix.size()) == std::string::npos)
+			out.emplace_back(it->first.substr(prefix.size()),
+					 &it->second);
+	}
+}
+
+ssize_t stage::read(const char *p, void *buf, size_t len, uint64_t off,
+		    uint64_t base_size, int base_fd) const
+{
+	const staged_file *f = find(p);
+	char *out = (char *)buf;
+	uint64_t size, pos, stop, base_end;
+
+	if (!f || f->whiteout)
+		return -ENOENT;
+
+	size = f->size_over(base_size);
+	if (off >= size)
+		return 0;
+	stop = std::min<uint64_t>(off + len, size);
+	base_end = f->created ? 0 : std::min(base_size, f->base_limit);
+
+	for (pos = off; pos < stop; ) {
+		auto it = f->extents.upper_bound(pos);
+		uint64_t next = it == f->extents.end() ? stop :
+				std::min<uint64_t>(it->first, stop);
+		ssize_t n;
+
+		/* Inside the extent starting at or before pos */
+		if (it != f->extents.begin()) {
+			auto e = std::prev(it);
+			uint64_t eend = e->first + e->second.len;
+
+			if (eend > pos) {
+				n = std::min(eend, stop) - pos;
+				if (pread(fd, out + (pos - off), n,
+					  e->second.jofs + (pos - e->first)) != n)
+					return -EIO;
+				pos += n;
+				continue;
+			}
+		}
+
+		/* A gap up to the next extent, base data or zeros */
+		if (pos < base_end) {
+			uint64_t upto = std::min(next, base_end);
+
+			if (base_fd < 0)
+				return -EAGAIN;
+			n = pread(base_fd, out + (pos - off), upto - pos, pos);
+			if (n < 0)
+				return -errno;
+			if ((uint64_t)n < upto - pos)
+				memset(out + (pos - off) + n, 0, upto - pos - n);
+			pos = upto;
+			continue;
+		}
+		memset(out + (pos - off), 0, next - pos);
+		pos = next;
+	}
+
+	return stop - off;
+}
+
+int stage::flush_file(const std::string &lower, const std::string &p,
+		      const staged_file &f)
+{
+	std::string full = lower + p;
+	char buf[65536];
+	int out, err = 0;
+
+	out = ::open(full.c_str(), O_WRONLY | O_CLOEXEC);
+	if (out < 0)
+		return -errno;
+
+	if (!f.created && f.base_limit != UINT64_MAX &&
+	    ftruncate(out, f.base_limit))
+		err = -errno;
+
+	/* In file order, one sequential pass */
+	for (auto it = f.extents.begin(); !err && it != f.extents.end(); ++it) {
+		uint64_t done = 0;
+
+		while (done < it->second.len) {
+			size_t n = std::min<uint64_t>(it->second.len - done,
+						      sizeof(buf));
+
+			if (pread(fd, buf, n, it->second.jofs + done) !=
+			    (ssize_t)n ||
+			    pwrite(out, buf, n, it->first + done) != (ssize_t)n) {
+				err = errno ? -errno : -EIO;
+				break;
+			}
+			done += n;
+		}
+	}
+
+	if (!err && f.sized && ftruncate(out, f.size))
+		err = -errno;
+	if (!err && fsync(out))
+		err = -errno;
+	::close(out);
+
+	return err;
+}
+
+/* The first count ops are in the lower tree, durably */
+int stage::checkpoint(int lower_fd, size_t count)
+{
+	rec_header h = {};
+	int err;
+
+	if (count == applied)
+		return 0;
+	if (syncfs(lower_fd))
+		return -errno;
+
+	h.type = REC_APPLIED;
+	h.offset = count;
+	err = append(h, "/", nullptr);
+	if (!err && fdatasync(fd))
+		err = -errno;
+
+	return err;
+}
+
+/*
+ * Each change on its own may be redone: creations truncate and get all
+ * their data written again, the rest tolerates being done already. Two
+ * changes of the same path may not, a rename of a to b replayed after a
+ * later creation of a would move the new a over b. So the replay is
+ * checkpointed in the journal before it touches a path again, and a
+ * flush after a failure or a crash only redoes changes of distinct paths.
+ */
+int stage::flush(const std::string &lower)
+{
+	std::set<std::string> touched;
+	int err = 0, out, lower_fd;
+
+	lower_fd = ::open(lower.empty() ? "/" : lower.c_str(),
+			  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (lower_fd < 0)
+		return -errno;
+
+	for (size_t i = applied; !err && i < ops.size(); i++) {
+		const ns_op &op = ops[i];
+		std::string full = lower + op.path;
+
+		if (touched.count(op.path) ||
+		    (!op.to.empty() && touched.count(op.to))) {
+			err = checkpoint(lower_fd, i);
+			if (err)
+				break;
+			touched.clear();
+		}
+		touched.insert(op.path);
+		if (!op.to.empty())
+			touched.insert(op.to);
+
+		switch (op.type) {
+		case REC_CREATE:
+			out = ::open(full.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+				     O_CLOEXEC, op.mode);
+			if (out < 0) {
+				err = -errno;
+				break;
+			}
+			if (fchown(out, op.uid, op.gid))
+				err = -errno;
+			::close(out);
+			break;
+		case REC_MKDIR:
+			if ((::mkdir(full.c_str(), op.mode) && errno != EEXIST) ||
+			    chown(full.c_str(), op.uid, op.gid))
+				err = -errno;
+			break;
+		case REC_UNLINK:
+			if (::unlink(full.c_str()) && errno != ENOENT &&
+			    (errno != EISDIR || rmdir(full.c_str())))
+				err = -errno;
+			break;
+		case REC_RENAME:
+			/* Done by a flush that crashed before its checkpoint */
+			if (::rename(full.c_str(), (lower + op.to).c_str()) &&
+			    (errno != ENOENT ||
+			     access((lower + op.to).c_str(), F_OK)))
+				err = -errno;
+			break;
+		default:
+			break;
+		}
+	}
+	/* A data pass that fails does not redo the namespace changes */
+	if (!err)
+		err = checkpoint(lower_fd, ops.size());
+	::close(lower_fd);
+	if (err)
+		return err;
+
+	for (const auto &it : files) {
+		const staged_file &f = it.second;
+
+		if (f.whiteout || f.dir)
+			continue;
+		if (!f.created && !f.sized && f.extents.empty())
+			continue;
+		err = flush_file(lower, it.first, f);
+		if (err)
+			return err;
+	}
+
+	/* Only now is the journal no longer needed */
+	if (ftruncate(fd, 8) || fdatasync(fd))
+		return -errno;
+	st.flushes++;
+	st.flushed_bytes += st.bytes;
+	st.writes = st.bytes = 0;
+	end = 8;
+	files.clear();
+	ops.clear();
+	applied = 0;
+
+	return 0;
+}
+
+} /* namespace hddsaver */
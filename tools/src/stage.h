@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Write staging journal for the files on the HDD Saver drives
+ *
+ * While the drives are off, writes and namespace changes are appended to
+ * a journal on another drive (an SSD) and indexed in memory per path.
+ * Reads of staged data are served from the journal. At the next wake
+ * flush() replays the namespace changes in order, then writes the data
+ * of each file in one sequential pass and empties the journal. How far
+ * the replay got is recorded in the journal, so a flush that failed or
+ * crashed does not redo a change that a later one depends on.
+ *
+ * Records carry a checksum. open() rebuilds the index from the journal
+ * and drops a torn tail, so staged data survives a crash or a reboot.
+ * Not thread safe, callers serialize.
+ */
+#ifndef HDDSAVER_STAGE_H
+#define HDDSAVER_STAGE_H
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace hddsaver {
+
+struct staged_file {
+	struct extent {
+		uint64_t len;
+		uint64_t jofs;		/* Of the data in the journal */
+	};
+
+	bool created = false;		/* No base file, holes read as zeros */
+	bool dir = false;
+	bool whiteout = false;		/* Unlinked */
+	bool sized = false;		/* size is exact, not a lower bound */
+	std::string base;		/* Base file in the lower tree, or "" */
+	uint64_t base_limit = UINT64_MAX; /* Base data beyond was truncated */
+	uint64_t size = 0;
+	mode_t mode = 0;
+	uid_t uid = 0;
+	gid_t gid = 0;
+	time_t mtime = 0;
+	std::map<uint64_t, extent> extents;
+
+	/* With base_size from the lower tree, ignored if created or sized */
+	uint64_t size_over(uint64_t base_size) const;
+
+	void put(uint64_t off, uint64_t len, uint64_t jofs);
+	void trim(uint64_t len);
+};
+
+struct stage_stats {
+	uint64_t writes = 0;		/* Since the last flush */
+	uint64_t bytes = 0;
+	uint64_t flushes = 0;		/* Since open() */
+	uint64_t flushed_bytes = 0;
+};
+
+class stage {
+public:
+	stage() = default;
+	~stage();
+	stage(const stage &) = delete;
+	stage &operator=(const stage &) = delete;
+
+	/* Creates the journal, or recovers what it holds */
+	int open(const std::string &path);
+	void close();
+
+	bool empty() const { return files.empty() && ops.empty(); }
+	uint64_t bytes() const { return end; }
+	const stage_stats &stats() const { return st; }
+
+	int create(const char *path, mode_t mode, uid_t uid, gid_t gid);
+	int mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid);
+	int write(const char *path, const void *buf, size_t len, uint64_t off);
+	int truncate(const char *path, uint64_t size);
+	int unlink(const char *path);
+	int rename(const char *from, const char *to);
+
+	/* Makes the journal durable, for fsync() of staged files */
+	int sync();
+
+	/* nullptr if the path has nothing staged */
+	const staged_file *find(const char *path) const;
+
+	/* Every path with something staged, whiteouts included */
+	void paths(std::vector<std::string> &out) const;
+
+	/* Staged entries directly below dir */
+	void children(const char *dir,
+		      std::vector<std::pair<std::string,
+					    const staged_file *>> &out) const;
+
+	/*
+	 * Reads staged data. Ranges that only the base file has are read
+	 * from base_fd, -EAGAIN if that is needed and base_fd is -1.
+	 */
+	ssize_t read(const char *path, void *buf, size_t len, uint64_t off,
+		     uint64_t base_size, int base_fd) const;
+
+	/* Applies everything to the lower tree and empties the journal */
+	int flush(const std::string &lower);
+
+private:
+	enum rec_type : uint8_t {
+		REC_CREATE = 1,
+		REC_MKDIR,
+		REC_WRITE,
+		REC_TRUNCATE,
+		REC_UNLINK,
+		REC_RENAME,
+		REC_APPLIED,		/* offset ops are in the lower tree */
+	};
+
+	struct rec_header {
+		uint32_t magic;
+		uint32_t sum;		/* Of the record, with sum 0 */
+		uint8_t type;
+		uint8_t pad;
+		uint16_t path_len;
+		uint32_t mode;
+		uint32_t uid;
+		uint32_t gid;
+		uint64_t offset;
+		uint64_t len;		/* Data, or the new path of a rename */
+		int64_t time;
+	};
+
+	/* Namespace changes, replayed in order */
+	struct ns_op {
+		rec_type type;
+		std::string path;
+		std::string to;
+		mode_t mode;
+		uid_t uid;
+		gid_t gid;
+	};
+
+	int append(rec_header &h, const char *path, const void *data);
+	int recover();
+	void apply(const rec_header &h, const std::string &path,
+		   const std::string &to, uint64_t data_ofs);
+	staged_file &entry(const std::string &path);
+	int flush_file(const std::string &lower, const std::string &path,
+		       const staged_file &f);
+	int checkpoint(int lower_fd, size_t count);
+
+	std::string path;
+	int fd = -1;
+	uint64_t end = 0;
+	std::map<std::string, staged_file> files;
+	std::vector<ns_op> ops;
+	size_t applied = 0;		/* Of ops, by a flush that failed */
+	stage_stats st;
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Stand-in for the HDD Saver rail and a drive behind it
+ */
+#include "standin.h"
+#include "rail.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+standin::~standin()
+{
+	close();
+}
+
+int standin::open(const std::string &d, const std::string &b,
+		  uint64_t spinup, uint64_t jitter, uint64_t seed)
+{
+	std::string power = d + "/hddsaver_power";
+	int err;
+
+	if (mkdir(d.c_str(), 0755) && errno != EEXIST)
+		return -errno;
+	dir = d;
+	backing = b;
+	spinup_us = spinup;
+	jitter_us = jitter;
+	rng = seed ? seed : 1;
+	unlink(disk().c_str());
+
+	power_fd = ::open(power.c_str(), O_RDWR | O_CREAT | O_TRUNC |
+			  O_CLOEXEC, 0644);
+	if (power_fd < 0)
+		return -errno;
+	if (write(power_fd, "Off\n", 4) != 4)
+		return -EIO;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inotify_fd < 0 || stop_fd < 0)
+		return -errno;
+	if (inotify_add_watch(inotify_fd, power.c_str(), IN_MODIFY) < 0)
+		return -errno;
+
+	err = ready.open(loop, [this] {
+		if (symlink(backing.c_str(), disk().c_str()))
+			on = false;
+	});
+	if (!err)
+		err = loop.add(inotify_fd, EPOLLIN, [this](uint32_t) {
+			char buf[4096];
+
+			while (read(inotify_fd, buf, sizeof(buf)) > 0)
+				;
+			changed();
+		});
+	if (!err)
+		err = loop.add(stop_fd, EPOLLIN, [this](uint32_t) {
+			loop.stop();
+		});
+	if (err)
+		return err;
+
+	thread = std::thread(&standin::run, this);
+
+	return 0;
+}
+
+void standin::close()
+{
+	uint64_t one = 1;
+
+	if (thread.joinable()) {
+		if (write(stop_fd, &one, sizeof(one)) < 0)
+			return;
+		thread.join();
+	}
+	if (!dir.empty())
+		unlink(disk().c_str());
+	for (int *fd : { &power_fd, &inotify_fd, &stop_fd }) {
+		if (*fd >= 0)
+			::close(*fd);
+		*fd = -1;
+	}
+}
+
+void standin::run()
+{
+	loop.run();
+}
+
+/* The attribute is a plain file here, "on", "1", "off" and "0" count */
+void standin::changed()
+{
+	char buf[16];
+	uint64_t x, ms;
+	bool val;
+
+	if (read_attr(power_fd, buf, sizeof(buf)) <= 0)
+		return;
+	if (!strncmp(buf, "on", 2) || buf[0] == '1')
+		val = true;
+	else if (!strncmp(buf, "off", 3) || buf[0] == '0')
+		val = false;
+	else
+		return;
+
+	if (val == on)
+		return;
+	on = val;
+
+	if (!on) {
+		ready.disarm();
+		unlink(disk().c_str());
+		return;
+	}
+
+	x = rng;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	rng = x;
+	/* The timer has millisecond steps, report what it will do */
+	ms = (spinup_us + (jitter_us ? x % jitter_us : 0) + 999) / 1000;
+	ms = ms ? ms : 1;
+	delay_us = ms * 1000;
+	ready.arm(ms);
+}
+
+} /* namespace hddsaver */
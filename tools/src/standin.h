@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Stand-in for the HDD Saver rail and a drive behind it
+ *
+ * A directory with a plain hddsaver_power file plays the hwmon device.
+ * Writing "on" to it makes the drive appear after a spin up delay, as a
+ * symlink named "disk" to a backing device (a loop or null_blk device,
+ * or any file), writing "off" makes it disappear at once. The rail is
+ * watched with inotify from a thread of its own, so the stand-in adds
+ * the same kind of wakeup latency a real uevent would.
+ */
+#ifndef HDDSAVER_STANDIN_H
+#define HDDSAVER_STANDIN_H
+
+#include "event_loop.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace hddsaver {
+
+class standin {
+public:
+	standin() = default;
+	~standin();
+	standin(const standin &) = delete;
+	standin &operator=(const standin &) = delete;
+
+	/* dir is created if needed, the rail starts off */
+	int open(const std::string &dir, const std::string &backing,
+		 uint64_t spinup_us, uint64_t jitter_us, uint64_t seed = 1);
+	void close();
+
+	const std::string &hwmon() const { return dir; }
+	std::string disk() const { return dir + "/disk"; }
+
+	/* Spin up delay drawn for the last power on, us */
+	uint64_t last_delay() const { return delay_us; }
+
+private:
+	void changed();
+	void run();
+
+	std::string dir;
+	std::string backing;
+	uint64_t spinup_us = 0;
+	uint64_t jitter_us = 0;
+	uint64_t rng = 1;
+	std::atomic<uint64_t> delay_us{ 0 };
+
+	event_loop loop;
+	timer ready;
+	int power_fd = -1;
+	int inotify_fd = -1;
+	int stop_fd = -1;
+	bool on = false;
+	std::thread thread;
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Block I/O activity traces
+ */
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace hddsaver {
+
+uint32_t trace::dev_index(const std::string &name)
+{
+	for (size_t i = 0; i < devs.size(); i++)
+		if (devs[i] == name)
+			return i;
+	devs.push_back(name);
+
+	return devs.size() - 1;
+}
+
+/* "123.456789" to ns, without going through a double */
+static bool parse_ts(const char *s, uint64_t *ts)
+{
+	uint64_t sec = 0, ns = 0;
+	int digits = 0;
+
+	if (*s < '0' || *s > '9')
+		return false;
+	while (*s >= '0' && *s <= '9')
+		sec = sec * 10 + (*s++ - '0');
+	if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++) {
+			if (digits++ < 9)
+				ns = ns * 10 + (*s - '0');
+		}
+	}
+	if (*s)
+		return false;
+	for (; digits < 9; digits++)
+		ns *= 10;
+	*ts = sec * 1000000000 + ns;
+
+	return true;
+}
+
+int parse_text_line(char *line, trace &t, trace_event &e, char blk_action)
+{
+	char *field[7];
+	int n = 0;
+
+	for (char *tok = strtok(line, " \t\n"); tok && n < 7;
+	     tok = strtok(nullptr, " \t\n"))
+		field[n++] = tok;
+
+	if (n >= 7 && strchr(field[0], ',') && parse_ts(field[3], &e.ts)) {
+		if (field[5][0] != blk_action || field[5][1])
+			return 0;
+		e.dev = t.dev_index(field[0]);
+	} else if (n >= 2 && parse_ts(field[0], &e.ts)) {
+		/* Issue and complete are blkparse's D and C */
+		if (n >= 3 && strcmp(field[2], blk_action == 'D' ? "issue" :
+				     blk_action == 'C' ? "complete" : ""))
+			return 0;
+		e.dev = t.dev_index(field[1]);
+	} else {
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+long read_text_trace(FILE *f, trace &t, char blk_action)
+{
+	char *line = nullptr;
+	size_t size = 0;
+	long skipped = 0;
+	bool sorted = true;
+
+	while (getline(&line, &size, f) > 0) {
+		trace_event e;
+		int ret = parse_text_line(line, t, e, blk_action);
+
+		if (ret <= 0) {
+			if (ret)
+				skipped++;
+			continue;
+		}
+
+		if (!t.events.empty() && e.ts < t.events.back().ts)
+			sorted = false;
+		t.events.push_back(e);
+	}
+	free(line);
+	if (ferror(f))
+		return -EIO;
+
+	/* blkparse merges per CPU streams, slightly out of order */
+	if (!sorted)
+		std::stable_sort(t.events.begin(), t.events.end(),
+				 [](const trace_event &a, const trace_event &b) {
+					 return a.ts < b.ts;
+				 });
+
+	return skipped;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Block I/O activity traces
+ */
+#ifndef HDDSAVER_TRACE_H
+#define HDDSAVER_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+struct trace_event {
+	uint64_t ts;		/* ns */
+	uint32_t dev;		/* Index into trace::devs */
+};
+
+struct trace {
+	std::vector<trace_event> events;	/* Sorted by ts */
+	std::vector<std::string> devs;
+
+	uint32_t dev_index(const std::string &name);
+};
+
+/*
+ * Reads text traces, one request per line, in either of two formats:
+ *
+ *   blkparse:           8,16  1  1  0.000000000  1234  D  R 123 + 8 [cp]
+ *   hddsaver-activity:  1234.000000000 sdb issue
+ *
+ * Of blkparse only the action given (D by default) is used, and of
+ * hddsaver-activity the matching kind, issue for D and complete for C.
+ * Returns the number of lines that were skipped or -errno.
+ */
+long read_text_trace(FILE *f, trace &t, char blk_action = 'D');
+
+/* One line of the above, 1 if it is a request, 0 if not, -EINVAL if junk */
+int parse_text_line(char *line, trace &t, trace_event &e,
+		    char blk_action = 'D');
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Compact binary activity traces
+ */
+#include "trace_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define MAX_CHUNK_DEVS	255
+
+trace_writer::~trace_writer()
+{
+	close();
+}
+
+/* Picks up after the last whole chunk of an existing file */
+int trace_writer::resume_from(const std::string &path, size_t size)
+{
+	trace_file f;
+	int err;
+
+	err = f.open(path);
+	if (err)
+		return err;
+	if (f.used() < size && ftruncate(fd, f.used()))
+		return -errno;
+	if (!f.chunks().empty()) {
+		last_ts = f.chunks().back().last_ts;
+		resume = true;
+	}
+
+	return 0;
+}
+
+int trace_writer::open(const std::string &path, size_t size)
+{
+	struct trace_file_header fh = {};
+	struct stat st;
+	int err = 0;
+
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+		    0644);
+	if (fd < 0)
+		return -errno;
+	last_ts = offset = 0;
+	resume = false;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+	} else if (!st.st_size) {
+		memcpy(fh.magic, TRACE_FILE_MAGIC, sizeof(fh.magic));
+		fh.version = TRACE_FILE_VERSION;
+		if (write(fd, &fh, sizeof(fh)) != sizeof(fh))
+			err = -EIO;
+	} else {
+		err = resume_from(path, st.st_size);
+	}
+	if (err) {
+		::close(fd);
+		fd = -1;
+		return err;
+	}
+
+	chunk_size = size;
+	events.reserve(size + 32);
+
+	return 0;
+}
+
+int trace_writer::close()
+{
+	int err;
+
+	if (fd < 0)
+		return 0;
+	err = flush();
+	if (::close(fd) && !err)
+		err = -errno;
+	fd = -1;
+
+	return err;
+}
+
+void trace_writer::put_varint(uint64_t v)
+{
+	while (v >= 0x80) {
+		events.push_back(v | 0x80);
+		v >>= 7;
+	}
+	events.push_back(v);
+}
+
+int trace_writer::add(uint64_t ts, const std::string &dev)
+{
+	uint64_t delta;
+	size_t d;
+	int err;
+
+	for (d = 0; d < devs.size(); d++)
+		if (devs[d] == dev)
+			break;
+	if (d == devs.size() && d == MAX_CHUNK_DEVS) {
+		err = flush();
+		if (err)
+			return err;
+		d = 0;
+	}
+	if (d == devs.size()) {
+		size_t len = std::min<size_t>(dev.size(), 255);
+
+		devs.push_back(dev);
+		names.push_back(len);
+		names.insert(names.end(), dev.begin(), dev.begin() + len);
+	}
+
+	/* Kept for the whole run, so its events stay as far apart */
+	if (resume) {
+		if (ts < last_ts)
+			offset = last_ts - ts;
+		resume = false;
+	}
+	ts += offset;
+
+	/* last_ts is what the reader will reconstruct, in whole us */
+	if (!hdr.events)
+		hdr.first_ts = hdr.last_ts = std::max(ts, last_ts);
+	delta = ts > hdr.last_ts ? (ts - hdr.last_ts) / 1000 : 0;
+	hdr.last_ts += delta * 1000;
+	last_ts = hdr.last_ts;
+	hdr.events++;
+
+	if (d < 15) {
+		put_varint(delta << 4 | d);
+	} else {
+		put_varint(delta << 4 | 15);
+		put_varint(d);
+	}
+
+	if (names.size() + events.size() >= chunk_size)
+		return flush();
+
+	return 0;
+}
+
+int trace_writer::flush()
+{
+	struct iovec iov[3];
+	ssize_t len, total;
+	off_t end;
+	int err = 0;
+
+	if (!hdr.events)
+		return 0;
+
+	hdr.magic = TRACE_CHUNK_MAGIC;
+	hdr.size = names.size() + events.size();
+	hdr.devs = devs.size();
+
+	iov[0] = { &hdr, sizeof(hdr) };
+	iov[1] = { names.data(), names.size() };
+	iov[2] = { events.data(), events.size() };
+	total = sizeof(hdr) + hdr.size;
+	end = lseek(fd, 0, SEEK_END);
+	len = end < 0 ? -1 : writev(fd, iov, 3);
+	if (len != total) {
+		/* A torn chunk would end the file for the reader */
+		err = len < 0 ? -errno : -ENOSPC;
+		if (end >= 0 && ftruncate(fd, end))
+			err = -EIO;
+	}
+
+	hdr = {};
+	devs.clear();
+	names.clear();
+	events.clear();
+
+	return err;
+}
+
+bool is_trace_file(const std::string &path)
+{
+	struct trace_file_header fh;
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	bool ret;
+
+	if (fd < 0)
+		return false;
+	ret = read(fd, &fh, sizeof(fh)) == sizeof(fh) &&
+	      !memcmp(fh.magic, TRACE_FILE_MAGIC, sizeof(fh.magic));
+	::close(fd);
+
+	return ret;
+}
+
+trace_file::~trace_file()
+{
+	close();
+}
+
+int trace_file::open(const std::string &path)
+{
+	const struct trace_file_header *fh;
+	const uint8_t *p, *end;
+	struct stat st;
+	int fd, err = 0;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		err = -errno;
+	} else if ((size_t)st.st_size < sizeof(*fh)) {
+		err = -EINVAL;
+	} else {
+		map = (uint8_t *)mmap(nullptr, st.st_size, PROT_READ,
+				      MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			map = nullptr;
+			err = -errno;
+		}
+	}
+	::close(fd);
+	if (err)
+		return err;
+	map_size = st.st_size;
+
+	fh = (const struct trace_file_header *)map;
+	if (memcmp(fh->magic, TRACE_FILE_MAGIC, sizeof(fh->magic)) ||
+	    fh->version != TRACE_FILE_VERSION) {
+		close();
+		return -EINVAL;
+	}
+
+	/* Scans decode chunks front to back */
+	madvise(map, map_size, MADV_SEQUENTIAL);
+
+	end = map + map_size;
+	used_size = sizeof(*fh);
+	for (p = map + sizeof(*fh); p + sizeof(chunk_header) <= end; ) {
+		chunk_header h;
+		chunk c;
+
+		memcpy(&h, p, sizeof(h));
+		p += sizeof(h);
+		if (h.magic != TRACE_CHUNK_MAGIC || h.size > (size_t)(end - p))
+			break;
+
+		c.first_ts = h.first_ts;
+		c.last_ts = h.last_ts;
+		c.names = p;
+		c.end = p + h.size;
+		c.nr_events = h.events;
+		c.nr_devs = h.devs;
+		p = c.end;
+		used_size = p - map;
+
+		/* Devices are looked up by a u8 index when scanning */
+		if (c.nr_devs > 256)
+			continue;
+		c.events = c.names;
+		for (unsigned int d = 0; d < c.nr_devs && c.events; d++) {
+			if (c.events >= c.end || c.events[0] >= c.end - c.events)
+				c.events = nullptr;
+			else
+				c.events += 1 + c.events[0];
+		}
+		if (!c.events)
+			continue;
+
+		/* Appended by a later run whose clock was behind */
+		if (!index.empty() && c.first_ts < index.back().last_ts)
+			continue;
+		index.push_back(c);
+	}
+
+	return 0;
+}
+
+void trace_file::close()
+{
+	if (map)
+		munmap(map, map_size);
+	map = nullptr;
+	map_size = 0;
+	used_size = 0;
+	index.clear();
+}
+
+void trace_file::read(uint64_t from, uint64_t to, trace &t) const
+{
+	scan(from, to, t, [&t](uint64_t ts, uint32_t dev) {
+		t.events.push_back({ ts, dev });
+	});
+}
+
+} /* namespace hddsaver */
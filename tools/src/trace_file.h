@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Compact binary activity traces
+ *
+ * A file is a 16 byte header followed by self contained chunks:
+ *
+ *   header:  "HDDSTRC1", u32 version, u32 reserved
+ *   chunk:   struct chunk_header, device names, events
+ *
+ * Device names are a u8 length and the name, in the order of the
+ * chunk's device indexes. An event is a varint of the microseconds
+ * since the previous event (since first_ts for the first one) shifted
+ * left by 4, ored with the device index, or with 15 and followed by a
+ * varint of the index if it does not fit. Bursts of requests take one
+ * or two bytes per event.
+ *
+ * Chunks are written whole with a single append, a torn chunk at the
+ * end of the file is ignored by the reader, and so are chunks that start
+ * before the previous one ended. Integers are in host byte order.
+ */
+#ifndef HDDSAVER_TRACE_FILE_H
+#define HDDSAVER_TRACE_FILE_H
+
+#include "trace.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+#define TRACE_FILE_MAGIC	"HDDSTRC1"
+#define TRACE_FILE_VERSION	1
+#define TRACE_CHUNK_MAGIC	0x4b4e4843	/* "CHNK" */
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct chunk_header {
+	uint32_t magic;
+	uint32_t size;		/* Of names and events */
+	uint64_t first_ts;	/* ns */
+	uint64_t last_ts;
+	uint32_t events;
+	uint16_t devs;
+	uint16_t reserved;
+};
+
+/* Buffers one chunk in memory and appends it when full or on flush() */
+class trace_writer {
+public:
+	trace_writer() = default;
+	~trace_writer();
+	trace_writer(const trace_writer &) = delete;
+	trace_writer &operator=(const trace_writer &) = delete;
+
+	/*
+	 * Creates the file or appends to it. A torn chunk at the end is
+	 * dropped, and a run whose clock is behind the last event in the
+	 * file (after a reboot) has its timestamps moved to continue there.
+	 */
+	int open(const std::string &path, size_t chunk_size = 65536);
+	int close();
+
+	/*
+	 * Timestamps going backwards are stored as equal to the previous
+	 * one, so that chunks stay in time order for the reader's search.
+	 */
+	int add(uint64_t ts, const std::string &dev);
+	int flush();
+
+	size_t pending() const { return hdr.events; }
+
+private:
+	int resume_from(const std::string &path, size_t size);
+	void put_varint(uint64_t v);
+
+	int fd = -1;
+	size_t chunk_size = 0;
+	chunk_header hdr = {};
+	uint64_t last_ts = 0;		/* Of the previous event, any chunk */
+	uint64_t offset = 0;		/* Added to the timestamps of this run */
+	bool resume = false;		/* Appending, offset set at the first add */
+	std::vector<std::string> devs;
+	std::vector<uint8_t> names;
+	std::vector<uint8_t> events;
+};
+
+/*
+ * Read only mapping of a trace file. Opening walks the chunk headers,
+ * not the events, and scan() only decodes the chunks overlapping the
+ * requested window.
+ */
+class trace_file {
+public:
+	struct chunk {
+		uint64_t first_ts;
+		uint64_t last_ts;
+		const uint8_t *names;
+		const uint8_t *events;	/* Up to end */
+		const uint8_t *end;
+		uint32_t nr_events;
+		uint16_t nr_devs;
+	};
+
+	trace_file() = default;
+	~trace_file();
+	trace_file(const trace_file &) = delete;
+	trace_file &operator=(const trace_file &) = delete;
+
+	int open(const std::string &path);
+	void close();
+
+	const std::vector<chunk> &chunks() const { return index; }
+	size_t size() const { return map_size; }
+
+	/* Up to the end of the last whole chunk, less than size() if torn */
+	size_t used() const { return used_size; }
+
+	/*
+	 * Calls f(ts, dev) for every event with from <= ts < to, dev being
+	 * the index of the device in t.devs, added there on first use.
+	 */
+	template<typename F>
+	void scan(uint64_t from, uint64_t to, trace &t, F &&f) const;
+
+	/* Appends the events of the window to t */
+	void read(uint64_t from, uint64_t to, trace &t) const;
+
+private:
+	uint8_t *map = nullptr;
+	size_t map_size = 0;
+	size_t used_size = 0;
+	std::vector<chunk> index;
+};
+
+/* Whether the file starts with TRACE_FILE_MAGIC */
+bool is_trace_file(const std::string &path);
+
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+					uint64_t *v)
+{
+	uint64_t val = 0;
+	int shift = 0;
+
+	while (p < end && shift < 64) {
+		uint8_t b = *p++;
+
+		val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = val;
+			return p;
+		}
+		shift += 7;
+	}
+
+	return nullptr;
+}
+
+template<typename F>
+void trace_file::scan(uint64_t from, uint64_t to, trace &t, F &&f) const
+{
+	uint32_t map_dev[256];
+	size_t i = 0, lo = 0, hi = index.size();
+
+	/* First chunk that may hold events at or after from */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (index[mid].last_ts < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < index.size() && index[i].first_ts < to; i++) {
+		const chunk &c = index[i];
+		const uint8_t *p = c.names;
+		uint64_t ts = c.first_ts, v, dev;
+
+		for (unsigned int d = 0; d < c.nr_devs && d < 256; d++) {
+			map_dev[d] = t.dev_index(std::string((const char *)p + 1,
+							     p[0]));
+			p += 1 + p[0];
+		}
+
+		for (p = c.events; p < c.end; ) {
+			p = get_varint(p, c.end, &v);
+			if (!p)
+				break;
+			ts += (v >> 4) * 1000;
+			dev = v & 15;
+			if (dev == 15) {
+				p = get_varint(p, c.end, &dev);
+				if (!p)
+					break;
+			}
+			if (ts >= to)
+				break;
+			if (ts >= from && dev < c.nr_devs)
+				f(ts, map_dev[dev]);
+		}
+	}
+}
+
+} /* namespace hddsaver */
+
+#endif
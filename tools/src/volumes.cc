@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * md arrays and LVM volume groups on the HDD Saver drives
+ */
+#include "volumes.h"
+#include "process.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define SYS_BLOCK	"/sys/block/"
+#define BY_ID		"/dev/disk/by-id/"
+
+static std::vector<std::string> list_dir(const std::string &path)
+{
+	std::vector<std::string> names;
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(path.c_str());
+	if (!d)
+		return names;
+	while ((de = readdir(d)) != nullptr)
+		if (de->d_name[0] != '.')
+			names.push_back(de->d_name);
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	return names;
+}
+
+static std::string read_line(const std::string &path)
+{
+	char buf[256];
+	ssize_t len;
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return "";
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return "";
+	while (len && buf[len - 1] == '\n')
+		len--;
+
+	return std::string(buf, len);
+}
+
+/* The disk a partition is on, the device itself otherwise */
+static std::string disk_of(const std::string &dev)
+{
+	char path[PATH_MAX];
+	const char *base;
+
+	if (access(("/sys/class/block/" + dev + "/partition").c_str(), F_OK))
+		return dev;
+	if (!realpath(("/sys/class/block/" + dev + "/..").c_str(), path))
+		return dev;
+	base = strrchr(path, '/');
+
+	return base ? base + 1 : dev;
+}
+
+/* A by-id link survives the drive coming back under another name */
+static std::string stable_path(const std::string &dev)
+{
+	char target[PATH_MAX];
+	const char *base;
+	ssize_t len;
+
+	for (const auto &name : list_dir(BY_ID)) {
+		len = readlink((BY_ID + name).c_str(), target,
+			       sizeof(target) - 1);
+		if (len < 0)
+			continue;
+		target[len] = '\0';
+		base = strrchr(target, '/');
+		if (dev == (base ? base + 1 : target))
+			return BY_ID + name;
+	}
+
+	return "/dev/" + dev;
+}
+
+/* dm names are VG-LV, with the dashes in either doubled */
+static std::string group_of(const std::string &dm_name)
+{
+	std::string vg;
+
+	for (size_t i = 0; i < dm_name.size(); i++) {
+		if (dm_name[i] != '-') {
+			vg += dm_name[i];
+		} else if (i + 1 < dm_name.size() && dm_name[i + 1] == '-') {
+			vg += '-';
+			i++;
+		} else {
+			break;
+		}
+	}
+
+	return vg;
+}
+
+/* Runs the commands together and waits for all of them */
+static void run_all(const std::vector<std::vector<std::string>> &cmds,
+		    std::vector<int> &results)
+{
+	std::vector<pid_t> pids;
+	int status;
+
+	results.assign(cmds.size(), 0);
+	for (size_t i = 0; i < cmds.size(); i++)
+		pids.push_back(spawn(cmds[i], results[i]));
+
+	for (size_t i = 0; i < cmds.size(); i++) {
+		if (pids[i] < 0)
+			continue;
+		if (waitpid(pids[i], &status, 0) < 0)
+			results[i] = -errno;
+		else
+			results[i] = exit_status(status);
+	}
+}
+
+volumes::~volumes()
+{
+	for (auto *list : { &arrays, &groups }) {
+		for (auto &u : *list) {
+			if (u.pidfd < 0)
+				continue;
+			loop->remove(u.pidfd);
+			close(u.pidfd);
+		}
+	}
+}
+
+int volumes::open(event_loop &l, const std::string &path,
+		  const std::vector<std::string> &watched, done_fn on_done)
+{
+	char line[4096], *save, *tok;
+	FILE *f;
+
+	loop = &l;
+	state = path;
+	disks = watched;
+	done = std::move(on_done);
+
+	/* One "md NAME MEMBER..." or "vg NAME PV..." per line */
+	f = fopen(state.c_str(), "re");
+	if (!f && errno != ENOENT)
+		return -errno;
+	while (f && fgets(line, sizeof(line), f)) {
+		unit u;
+
+		tok = strtok_r(line, " \n", &save);
+		if (!tok || (strcmp(tok, "md") && strcmp(tok, "vg")))
+			continue;
+		u.array = !strcmp(tok, "md");
+		tok = strtok_r(nullptr, " \n", &save);
+		if (!tok)
+			continue;
+		u.name = tok;
+		while ((tok = strtok_r(nullptr, " \n", &save)) != nullptr)
+			u.members.push_back(tok);
+		(u.array ? arrays : groups).push_back(std::move(u));
+	}
+	if (f)
+		fclose(f);
+
+	return learn();
+}
+
+/* What is up now replaces what was known of it */
+bool volumes::merge(std::vector<unit> &found, std::vector<unit> &known)
+{
+	bool changed = false;
+
+	for (auto &u : found) {
+		auto it = std::find_if(known.begin(), known.end(),
+				       [&u](const unit &k) {
+			return k.name == u.name;
+		});
+
+		if (it == known.end()) {
+			known.push_back(std::move(u));
+			changed = true;
+		} else if (it->members != u.members) {
+			it->members = std::move(u.members);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+int volumes::learn()
+{
+	std::vector<unit> found_arrays, found_groups;
+	std::vector<bool> ours_groups;
+	bool changed;
+
+	for (const auto &md : list_dir(SYS_BLOCK)) {
+		unit u;
+		bool ours = false;
+
+		if (md.compare(0, 2, "md"))
+			continue;
+		for (const auto &s : list_dir(SYS_BLOCK + md + "/slaves")) {
+			ours |= std::find(disks.begin(), disks.end(),
+					  disk_of(s)) != disks.end();
+			u.members.push_back(stable_path(s));
+		}
+		if (!ours)
+			continue;
+		u.array = true;
+		u.name = md;
+		u.state = UP;
+		found_arrays.push_back(std::move(u));
+	}
+
+	for (const auto &dm : list_dir(SYS_BLOCK)) {
+		std::string vg;
+		size_t g;
+
+		if (dm.compare(0, 3, "dm-") ||
+		    read_line(SYS_BLOCK + dm + "/dm/uuid").compare(0, 4, "LVM-"))
+			continue;
+		vg = group_of(read_line(SYS_BLOCK + dm + "/dm/name"));
+		for (g = 0; g < found_groups.size(); g++)
+			if (found_groups[g].name == vg)
+				break;
+		if (g == found_groups.size()) {
+			found_groups.push_back(unit());
+			found_groups[g].array = false;
+			found_groups[g].name = vg;
+			found_groups[g].state = UP;
+			ours_groups.push_back(false);
+		}
+
+		for (const auto &s : list_dir(SYS_BLOCK + dm + "/slaves")) {
+			auto &members = found_groups[g].members;
+			std::string pv;
+
+			/* Pools and mirror legs of the same group */
+			if (!s.compare(0, 3, "dm-"))
+				continue;
+			if (std::any_of(found_arrays.begin(), found_arrays.end(),
+					[&s](const unit &a) { return a.name == s; })) {
+				pv = "/dev/" + s;
+				ours_groups[g] = true;
+			} else {
+				pv = stable_path(s);
+				if (std::find(disks.begin(), disks.end(),
+					      disk_of(s)) != disks.end())
+					ours_groups[g] = true;
+			}
+			if (std::find(members.begin(), members.end(), pv) ==
+			    members.end())
+				members.push_back(pv);
+		}
+	}
+	for (size_t g = ours_groups.size(); g-- > 0;)
+		if (!ours_groups[g])
+			found_groups.erase(found_groups.begin() + g);
+
+	changed = merge(found_arrays, arrays);
+	changed |= merge(found_groups, groups);
+
+	return changed ? save() : 0;
+}
+
+int volumes::save() const
+{
+	std::string tmp = state + ".tmp";
+	FILE *f;
+
+	f = fopen(tmp.c_str(), "we");
+	if (!f)
+		return -errno;
+	for (const auto *list : { &arrays, &groups }) {
+		for (const auto &u : *list) {
+			fprintf(f, "%s %s", u.array ? "md" : "vg", u.name.c_str());
+			for (const auto &m : u.members)
+				fprintf(f, " %s", m.c_str());
+			fputc('\n', f);
+		}
+	}
+	if (fclose(f) || rename(tmp.c_str(), state.c_str())) {
+		int err = -errno;
+
+		unlink(tmp.c_str());
+		return err;
+	}
+
+	return 0;
+}
+
+bool volumes::active(const unit &u) const
+{
+	std::string s;
+
+	if (!u.array)
+		return !access(("/dev/" + u.name).c_str(), F_OK);
+
+	s = read_line(SYS_BLOCK + u.name + "/md/array_state");
+	return !s.empty() && s != "inactive" && s != "clear";
+}
+
+bool volumes::present(const std::string &member) const
+{
+	for (const auto &a : arrays)
+		if (member == "/dev/" + a.name)
+			return a.state == UP;
+
+	return !access(member.c_str(), F_OK);
+}
+
+int volumes::start(unit &u, const std::vector<std::string> &args)
+{
+	bool array = u.array;
+	size_t i = &u - (array ? arrays.data() : groups.data());
+	int err;
+
+	u.pid = spawn(args, err);
+	if (u.pid < 0)
+		return err;
+	u.pidfd = pidfd_open(u.pid);
+	if (u.pidfd < 0) {
+		err = u.pidfd;
+		u.pidfd = -1;
+		waitpid(u.pid, nullptr, 0);
+		return err;
+	}
+
+	/* Units are only added by learn(), never while one runs */
+	err = loop->add(u.pidfd, EPOLLIN, [this, array, i](uint32_t) {
+		finished((array ? arrays : groups)[i]);
+	});
+	if (err) {
+		close(u.pidfd);
+		u.pidfd = -1;
+		waitpid(u.pid, nullptr, 0);
+		return err;
+	}
+	u.state = STARTING;
+
+	return 0;
+}
+
+void volumes::finished(unit &u)
+{
+	int status, err;
+
+	if (waitpid(u.pid, &status, 0) < 0)
+		err = -errno;
+	else
+		err = exit_status(status);
+	loop->remove(u.pidfd);
+	close(u.pidfd);
+	u.pidfd = -1;
+
+	u.state = err ? FAILED : UP;
+	if (done)
+		done(u.name, err);
+}
+
+bool volumes::bring_up()
+{
+	bool busy = false;
+	int err;
+
+	for (auto *list : { &arrays, &groups }) {
+		for (auto &u : *list) {
+			if (u.state == UP && !active(u))
+				u.state = DOWN;
+			if (u.state == DOWN && active(u))
+				u.state = UP;
+			if (u.state == STARTING)
+				busy = true;
+			if (u.state != DOWN)
+				continue;
+
+			busy = true;
+			/* Being assembled by someone else */
+			if (u.array && !access((SYS_BLOCK + u.name).c_str(), F_OK))
+				continue;
+			if (!std::all_of(u.members.begin(), u.members.end(),
+					 [this](const std::string &m) {
+				return present(m);
+			}))
+				continue;
+
+			std::vector<std::string> args;
+
+			if (u.array) {
+				args = { "mdadm", "--assemble", "/dev/" + u.name };
+				args.insert(args.end(), u.members.begin(),
+					    u.members.end());
+			} else {
+				args = { "vgchange", "--activate", "y", u.name };
+			}
+			err = start(u, args);
+			if (err) {
+				u.state = FAILED;
+				if (done)
+					done(u.name, err);
+			}
+		}
+	}
+
+	return !busy;
+}
+
+std::string volumes::missing() const
+{
+	std::string names;
+
+	for (const auto *list : { &arrays, &groups }) {
+		for (const auto &u : *list) {
+			if (u.state == UP)
+				continue;
+			if (!names.empty())
+				names += ' ';
+			names += u.name;
+		}
+	}
+
+	return names;
+}
+
+int volumes::tear_down(std::string &failed)
+{
+	std::vector<std::vector<std::string>> cmds;
+	std::vector<unit *> units;
+	std::vector<int> results;
+	int err;
+
+	/* Bring-ups still running end first */
+	for (auto *list : { &arrays, &groups })
+		for (auto &u : *list)
+			if (u.pidfd >= 0)
+				finished(u);
+
+	err = learn();
+	if (err)
+		return err;
+
+	/* Groups first, the arrays below them are in use until then */
+	for (auto *list : { &groups, &arrays }) {
+		cmds.clear();
+		units.clear();
+		for (auto &u : *list) {
+			if (u.state == FAILED)
+				u.state = DOWN;
+			if (!active(u))
+				continue;
+			units.push_back(&u);
+			if (u.array)
+				cmds.push_back({ "mdadm", "--stop",
+						 "/dev/" + u.name });
+			else
+				cmds.push_back({ "vgchange", "--activate", "n",
+						 u.name });
+		}
+
+		run_all(cmds, results);
+		for (size_t i = 0; i < units.size(); i++) {
+			if (results[i]) {
+				failed = units[i]->name;
+				err = -EBUSY;
+			} else {
+				units[i]->state = DOWN;
+			}
+		}
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+} /* namespace hddsaver */
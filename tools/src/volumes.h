@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * md arrays and LVM volume groups on the HDD Saver drives
+ */
+#ifndef HDDSAVER_VOLUMES_H
+#define HDDSAVER_VOLUMES_H
+
+#include "event_loop.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace hddsaver {
+
+/*
+ * Brings the md arrays and LVM volume groups on the drives up after a
+ * power on, and down before a power off, with mdadm and vgchange.
+ *
+ * Which devices make up each array and group is learned while they are
+ * up, and kept in a state file for the times the daemon starts with the
+ * power off. Members are kept by their /dev/disk/by-id name. An array is
+ * assembled from its members as soon as the last of them shows up, with
+ * no scan of the other devices, and a group is activated as soon as its
+ * physical volumes are there. Arrays and groups that do not depend on
+ * each other come up in parallel, each with its own process.
+ *
+ * Arrays that something else started (udev incremental assembly, for
+ * one) are left to it.
+ */
+class volumes {
+public:
+	/* name is "mdN" or the group, status 0 or -errno */
+	using done_fn = std::function<void(const std::string &name, int status)>;
+
+	volumes() = default;
+	~volumes();
+	volumes(const volumes &) = delete;
+	volumes &operator=(const volumes &) = delete;
+
+	/* Reads the state file and learns what is up on the disks now */
+	int open(event_loop &loop, const std::string &state,
+		 const std::vector<std::string> &disks, done_fn done);
+	bool empty() const { return arrays.empty() && groups.empty(); }
+
+	/*
+	 * Starts whatever is complete and not up yet, called until it
+	 * returns true once everything is up or failed
+	 */
+	bool bring_up();
+
+	/* Names of what did not come up, after bring_up() gave up */
+	std::string missing() const;
+
+	/*
+	 * Deactivates the groups and then stops the arrays, in parallel, and
+	 * waits. -EBUSY, with the name in failed, if one was in use, what
+	 * went down is then brought up by the next bring_up().
+	 */
+	int tear_down(std::string &failed);
+
+private:
+	enum unit_state { DOWN, STARTING, UP, FAILED };
+
+	struct unit {
+		bool array;
+		std::string name;
+		std::vector<std::string> members;	/* Device paths */
+		unit_state state = DOWN;
+		pid_t pid = 0;
+		int pidfd = -1;
+	};
+
+	static bool merge(std::vector<unit> &found, std::vector<unit> &known);
+	int learn();
+	int save() const;
+	bool active(const unit &u) const;
+	bool present(const std::string &member) const;
+	int start(unit &u, const std::vector<std::string> &args);
+	void finished(unit &u);
+
+	event_loop *loop = nullptr;
+	std::string state;
+	std::vector<std::string> disks;
+	done_fn done;
+	std::vector<unit> arrays;
+	std::vector<unit> groups;
+};
+
+} /* namespace hddsaver */
+
+#endif
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Dirty page writeback coordinated with the HDD Saver power
+ */
+#include "writeback.h"
+#include "rail.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <set>
+#include <unistd.h>
+
+namespace hddsaver {
+
+#define VM_EXPIRE	"/proc/sys/vm/dirty_expire_centisecs"
+#define VM_BG_BYTES	"/proc/sys/vm/dirty_background_bytes"
+#define VM_BG_RATIO	"/proc/sys/vm/dirty_background_ratio"
+#define MAX_DEPTH	8
+
+static int read_value(const std::string &path, std::string &out)
+{
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	out.assign(buf, len);
+
+	return 0;
+}
+
+static int write_value(const char *path, const std::string &val)
+{
+	int fd, err = 0;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, val.data(), val.size()) != (ssize_t)val.size())
+		err = -errno;
+	close(fd);
+
+	return err;
+}
+
+writeback::~writeback()
+{
+	if (opened)
+		restore();
+}
+
+int writeback::open(const writeback_options &o)
+{
+	int err;
+
+	err = read_value(VM_EXPIRE, expire);
+	if (!err)
+		err = read_value(VM_BG_BYTES, bg_bytes);
+	if (!err)
+		err = read_value(VM_BG_RATIO, bg_ratio);
+	/* Needs root, better to know now */
+	if (!err)
+		err = write_value(VM_EXPIRE, expire);
+	if (err)
+		return err;
+
+	opt = o;
+	opened = true;
+
+	return 0;
+}
+
+/* Writing one of the background limits zeroes the other */
+void writeback::restore()
+{
+	write_value(VM_EXPIRE, expire);
+	if (bg_bytes != "0")
+		write_value(VM_BG_BYTES, bg_bytes);
+	else
+		write_value(VM_BG_RATIO, bg_ratio);
+}
+
+void writeback::set(bool on)
+{
+	if (!opened)
+		return;
+
+	if (on) {
+		restore();
+		write_value(VM_EXPIRE, std::to_string(opt.on_expire_cs));
+	} else {
+		write_value(VM_EXPIRE, std::to_string(opt.off_expire_cs));
+		write_value(VM_BG_BYTES, std::to_string(opt.off_limit));
+	}
+}
+
+/* Device numbers of a drive, its partitions and their holders */
+static void collect(const std::string &name, std::set<std::string> &devs,
+		    int depth)
+{
+	std::string base = "/sys/class/block/" + name, dev;
+	struct dirent *de;
+	DIR *d;
+
+	if (depth > MAX_DEPTH || read_value(base + "/dev", dev) ||
+	    !devs.insert(dev).second)
+		return;
+
+	d = opendir((base + "/holders").c_str());
+	if (d) {
+		while ((de = readdir(d)) != nullptr)
+			if (de->d_name[0] != '.')
+				collect(de->d_name, devs, depth + 1);
+		closedir(d);
+	}
+
+	d = opendir(base.c_str());
+	if (!d)
+		return;
+	while ((de = readdir(d)) != nullptr)
+		if (!strncmp(de->d_name, name.c_str(), name.size()) &&
+		    !access((base + "/" + de->d_name + "/partition").c_str(),
+			    F_OK))
+			collect(de->d_name, devs, depth + 1);
+	closedir(d);
+}
+
+int writeback::drain(const std::vector<std::string> &disks)
+{
+	std::set<std::string> devs, synced;
+	char line[8192], dev[32], mnt[4096];
+	int n = 0, fd;
+	FILE *f;
+
+	for (const auto &disk : disks)
+		collect(disk, devs, 0);
+	if (devs.empty())
+		return 0;
+
+	f = fopen("/proc/self/mountinfo", "re");
+	if (!f)
+		return -errno;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*d %*d %31s %*s %4095s", dev, mnt) != 2 ||
+		    !devs.count(dev) || !synced.insert(dev).second)
+			continue;
+
+		fd = ::open(mountinfo_unescape(mnt).c_str(),
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (!syncfs(fd))
+			n++;
+		close(fd);
+	}
+	fclose(f);
+
+	return n;
+}
+
+} /* namespace hddsaver */
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Dirty page writeback coordinated with the HDD Saver power
+ */
+#ifndef HDDSAVER_WRITEBACK_H
+#define HDDSAVER_WRITEBACK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hddsaver {
+
+struct writeback_options {
+	unsigned int on_expire_cs = 500;	/* Dirty data age to flush at */
+	unsigned int off_expire_cs = 360000;
+	uint64_t off_limit = 256ULL << 20;	/* Dirty bytes before flushing */
+};
+
+/*
+ * While the drives are on, dirty data is written back after a few
+ * seconds, so the idle timeout starts with nothing left to write. The
+ * file systems on them are synced before the power goes off. While they
+ * are off, data is kept dirty for longer, up to a limit of memory, and
+ * the next wake writes it back.
+ *
+ * The kernel only has global knobs for the age, vm.dirty_expire_centisecs
+ * and vm.dirty_background_bytes, so while the drives are off the other
+ * drives keep dirty data longer as well. The values found at open() are
+ * restored by the destructor.
+ */
+class writeback {
+public:
+	writeback() = default;
+	~writeback();
+	writeback(const writeback &) = delete;
+	writeback &operator=(const writeback &) = delete;
+
+	int open(const writeback_options &o);
+	bool is_open() const { return opened; }
+
+	void set(bool on);
+
+	/*
+	 * syncfs() of every file system on the drives, their partitions and
+	 * what holds them (md, dm). Returns how many were synced.
+	 */
+	int drain(const std::vector<std::string> &disks);
+
+private:
+	void restore();
+
+	writeback_options opt;
+	bool opened = false;
+	std::string expire;		/* As found */
+	std::string bg_bytes;
+	std::string bg_ratio;
+};
+
+} /* namespace hddsaver */
+
+#endif